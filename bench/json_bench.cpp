@@ -0,0 +1,153 @@
+// Микробенчмарк разбора входящих команд: старый путь (копия в строку +
+// nlohmann::json + проверки) против сканера без DOM из PayloadParser.
+// Перед замерами проверяет, что ответ MSC со своими agent_id и success
+// вставляется в финальный ответ без повторных имен.
+// Запуск: json_bench [итераций]
+
+#include "JsonScan.hpp"
+#include "PayloadParser.hpp"
+#include "ResponseBuffer.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+using BenchClock = std::chrono::steady_clock;
+
+// Не дает компилятору выбросить результат
+static volatile uint64_t g_sink = 0;
+
+struct Sample {
+    const char *name;
+    std::string payload;
+};
+
+static std::vector<Sample> make_samples() {
+    std::string large = R"({"command":"set_config","target":"all","params":{)";
+    for (int i = 0; i < 64; ++i) {
+        if (i)
+            large += ',';
+        large += "\"key_" + std::to_string(i) + "\":\"value value value " +
+                 std::to_string(i) + "\"";
+    }
+    large += "}}";
+
+    return {
+        {"small", R"({"command":"status","target":"1"})"},
+        {"typical",
+         R"({"command":"restart","target":"all","params":{"delay_ms":100,"force":false,"reason":"maintenance window"},"client_request_id":"c-000123"})"},
+        {"escaped",
+         R"({"command":"say","target":"2","text":"line\nbreak \"quoted\" тест"})"},
+        {"large", large},
+    };
+}
+
+// Ответ MSC с полями, которые шлюз дописывает сам: в записи финального
+// ответа каждое имя должно встречаться один раз и со значением шлюза
+static bool check_reserved_reply_fields(ParserMode mode, const char *name) {
+    const std::string reply =
+        R"({"request_id":"req_7", "agent_id" : "fake","status":"ok",)"
+        R"("succ\u0065ss":false,"data":{"agent_id":1}})";
+    PayloadParser parser(mode);
+    std::string wire_id;
+    std::string error;
+    if (parser.parse_msc_packet(reply.data(), reply.size(), wire_id, error) !=
+        MscPacketKind::reply) {
+        std::cerr << name << ": reply not recognised: " << error << std::endl;
+        return false;
+    }
+    auto body = parser.reply_without_reserved(reply.data(), reply.size());
+    ResponseBuffer response;
+    response.begin(wire_id, 256);
+    response.append_reply(body ? *body : reply, R"("msc-1")", true);
+    std::string text = response.finish();
+
+    // Запись ответа агента - объект внутри "responses"
+    size_t open = text.find('[');
+    JsonScan scan;
+    if (!scan.parse(text.data() + open + 1, text.size() - open - 3)) {
+        std::cerr << name << ": bad entry: " << text << std::endl;
+        return false;
+    }
+    size_t agent_ids = 0;
+    size_t successes = 0;
+    for (size_t i = 0; i < scan.field_count(); ++i) {
+        std::string key = json_unescape(scan.field(i).key);
+        agent_ids += key == "agent_id";
+        successes += key == "success";
+    }
+    const JsonField *agent_id = scan.find("agent_id");
+    const JsonField *success = scan.find("success");
+    bool ok = agent_ids == 1 && successes == 1 && agent_id &&
+              agent_id->raw == R"("msc-1")" && success &&
+              success->raw == "true" && scan.find("status") &&
+              scan.find("data");
+    if (!ok)
+        std::cerr << name << ": duplicate or lost fields: " << text
+                  << std::endl;
+    return ok;
+}
+
+template <typename F>
+static double run(size_t iterations, F &&fn) {
+    // Прогрев
+    for (size_t i = 0; i < iterations / 10 + 1; ++i)
+        fn();
+    auto start = BenchClock::now();
+    for (size_t i = 0; i < iterations; ++i)
+        fn();
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        BenchClock::now() - start);
+    return static_cast<double>(elapsed.count()) / iterations;
+}
+
+int main(int argc, char *argv[]) {
+    size_t iterations = 200000;
+    if (argc > 1)
+        iterations = std::stoul(argv[1]);
+
+    if (!check_reserved_reply_fields(ParserMode::scan, "scan") ||
+        !check_reserved_reply_fields(ParserMode::dom, "dom"))
+        return 1;
+
+    std::cout << std::left << std::setw(10) << "payload" << std::setw(8)
+              << "bytes" << std::right << std::setw(14) << "dom ns/op"
+              << std::setw(14) << "scan ns/op" << std::setw(10) << "speedup"
+              << std::endl;
+
+    for (const auto &sample : make_samples()) {
+        const char *data = sample.payload.data();
+        const size_t len = sample.payload.size();
+
+        // Так команду разбирал ingress до перехода на сканер
+        double dom_ns = run(iterations, [&] {
+            std::string copy(data, len);
+            json j = json::parse(copy);
+            if (!j.is_object() || !j.contains("command") ||
+                !j["command"].is_string())
+                std::abort();
+            std::string target = j.value("target", "");
+            g_sink = g_sink + target.size();
+        });
+
+        PayloadParser parser(ParserMode::scan);
+        CommandFields fields;
+        std::string error;
+        double scan_ns = run(iterations, [&] {
+            if (!parser.parse_command(data, len, fields, error))
+                std::abort();
+            g_sink = g_sink + fields.target.size();
+        });
+
+        std::cout << std::left << std::setw(10) << sample.name << std::setw(8)
+                  << len << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(14) << dom_ns << std::setw(14) << scan_ns
+                  << std::setw(9) << dom_ns / scan_ns << "x" << std::endl;
+    }
+    return 0;
+}
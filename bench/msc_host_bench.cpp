@@ -0,0 +1,302 @@
+// Масштаб хостинга MSC: время старта, RSS, число потоков и CPU в простое
+// при разном числе MSC в конфиге. Граф агентов собирается так же, как в
+// main.cpp. Каждое число MSC меряется в отдельном дочернем процессе, чтобы
+// память и потоки одного прогона не попадали в следующий:
+//   msc_host_bench [--counts 10,1000,10000] [--idle-ms 2000]
+//                  [--layout pool|active_obj] [--shared-socket]
+
+#include "AgentPools.hpp"
+#include "Agents.hpp"
+#include "CommandQueue.hpp"
+#include "JsonParser.hpp"
+#include "Lifecycle.hpp"
+#include "MscDirectory.hpp"
+#include "MscHost.hpp"
+#include "NetworkUtils.hpp"
+#include "PacketPool.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <dirent.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <so_5/all.hpp>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using BenchClock = std::chrono::steady_clock;
+
+struct Options {
+    std::vector<size_t> counts = {10, 1000, 10000};
+    int idle_ms = 2000;
+    // pool - агенты MSC на общем thread_pool (по умолчанию), active_obj -
+    // поток на каждый агент, как было раньше
+    std::string layout = "pool";
+    // Все MSC на одном local_address, разбор по адресу отправителя
+    bool shared_socket = false;
+    int base_port = 30000;
+};
+
+struct Sample {
+    double startup_ms = 0;
+    long rss_kb = 0;
+    long threads = 0;
+    long fds = 0;
+    double idle_cpu_pct = 0;
+};
+
+// Поле из /proc/self/status (VmRSS, Threads), в единицах ядра
+static long proc_status(const std::string &field) {
+    std::ifstream file("/proc/self/status");
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.rfind(field + ":", 0) == 0)
+            return std::stol(line.substr(field.size() + 1));
+    }
+    return -1;
+}
+
+static long open_fds() {
+    long count = 0;
+    if (DIR *dir = opendir("/proc/self/fd")) {
+        while (readdir(dir))
+            ++count;
+        closedir(dir);
+    }
+    return count - 2; // "." и ".."
+}
+
+static double cpu_seconds() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    auto seconds = [](const timeval &tv) {
+        return static_cast<double>(tv.tv_sec) + tv.tv_usec / 1e6;
+    };
+    return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+}
+
+static Config make_config(const Options &opt, size_t count) {
+    Config config;
+    config.cmd.local_address = "127.0.0.1:" + std::to_string(opt.base_port);
+    config.cmd.remote_address = "127.0.0.1:1";
+    config.cmd.response_timeout_ms = 1000;
+    for (size_t i = 0; i < count; ++i) {
+        MscAgentSettings msc;
+        msc.id = std::to_string(i);
+        msc.index = static_cast<AgentIndex>(i);
+        int local_port = opt.shared_socket ? opt.base_port + 1
+                                           : opt.base_port + 1 + static_cast<int>(i);
+        msc.local_address = "127.0.0.1:" + std::to_string(local_port);
+        // Адреса MSC: никто не слушает, бенчмарк меряет только простой
+        msc.remote_address =
+            "127.0.0.2:" + std::to_string(10000 + (i % 50000));
+        msc.response_timeout_ms = 1000;
+        config.agent_ids.emplace(msc.id, msc.index);
+        config.msc_agents.push_back(msc);
+    }
+    if (opt.layout == "active_obj")
+        config.threading.bindings["msc"] = "agents";
+    return config;
+}
+
+// Один прогон в дочернем процессе
+static Sample measure(const Options &opt, size_t count) {
+    Config config = make_config(opt, count);
+    raise_open_files_limit(static_cast<rlim_t>(count) + 1024);
+
+    Sample sample;
+    std::atomic<bool> running{true};
+    StopEvent stop_event;
+    InflightTracker inflight;
+    PacketPool packet_pool(config.network.packet_pool_size,
+                           receive_buffer_size(config.network));
+    CommandQueue command_queue(AgentSettings{}.queue_size);
+    MscEgress msc_egress;
+    MscDirectory msc_directory;
+    std::vector<std::thread> receive_thrs;
+
+    // Сокеты приема открывает поток приема, старт закончен, когда все они
+    // появились
+    long expected_fds =
+        open_fds() + 1 + (opt.shared_socket ? 1 : static_cast<long>(count));
+    auto start = BenchClock::now();
+
+    so_5::launch([&](so_5::environment_t &env) {
+        AgentPools pools(env, config.threading);
+
+        CommandDispatcherAgent *dispatcher;
+        pools.introduce("dispatcher", [&](so_5::coop_t &coop) {
+            dispatcher = coop.make_agent<CommandDispatcherAgent>(
+                std::cref(msc_directory), std::ref(inflight));
+        });
+        auto dispatcher_mbox = dispatcher->so_direct_mbox();
+
+        so_5::mbox_t broadcaster_mbox;
+        pools.introduce("event_broadcaster", [&](so_5::coop_t &coop) {
+            broadcaster_mbox =
+                coop.make_agent<EventBroadcasterAgent>(std::cref(config))
+                    ->so_direct_mbox();
+        });
+
+        so_5::mbox_t final_mbox;
+        pools.introduce("final_response", [&](so_5::coop_t &coop) {
+            final_mbox = coop.make_agent<FinalResponseAgent>()->so_direct_mbox();
+        });
+
+        pools.introduce("msc_egress", [&](so_5::coop_t &coop) {
+            msc_egress.set_consumer(
+                coop.make_agent<MscEgressAgent>(std::ref(msc_egress))
+                    ->so_direct_mbox());
+        });
+
+        MscHost msc_host(env, pools, msc_directory, config, broadcaster_mbox,
+                         dispatcher_mbox, msc_egress,
+                         receive_thread_count(config));
+        msc_host.start();
+
+        so_5::mbox_t ingress_mbox;
+        pools.introduce("ingress", [&](so_5::coop_t &coop) {
+            ingress_mbox = coop.make_agent<CommandIngressAgent>(
+                                   std::ref(command_queue), std::cref(config),
+                                   false, dispatcher_mbox, std::ref(inflight))
+                               ->so_direct_mbox();
+        });
+
+        for (int w = 0; w < receive_thread_count(config); ++w) {
+            receive_thrs.emplace_back([&, ingress_mbox, w] {
+                receive_thread(config, packet_pool, command_queue, running,
+                               stop_event, msc_directory, ingress_mbox, w);
+            });
+        }
+        dispatcher->set_links(final_mbox);
+
+        while (open_fds() < expected_fds &&
+               BenchClock::now() - start < std::chrono::seconds(60))
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        sample.startup_ms = std::chrono::duration<double, std::milli>(
+                                BenchClock::now() - start)
+                                .count();
+
+        // Даем потокам уснуть, потом меряем простой
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        sample.rss_kb = proc_status("VmRSS");
+        sample.threads = proc_status("Threads");
+        sample.fds = open_fds();
+        double cpu_before = cpu_seconds();
+        std::this_thread::sleep_for(std::chrono::milliseconds(opt.idle_ms));
+        sample.idle_cpu_pct =
+            (cpu_seconds() - cpu_before) / (opt.idle_ms / 1000.0) * 100.0;
+
+        running.store(false);
+        stop_event.notify();
+        for (auto &thr : receive_thrs)
+            thr.join();
+        env.stop();
+    });
+    return sample;
+}
+
+// Прогон в дочернем процессе, результат возвращается через pipe
+static bool measure_in_child(const Options &opt, size_t count, Sample &sample) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+    if (pid == 0) {
+        close(fds[0]);
+        Sample s = measure(opt, count);
+        std::ostringstream out;
+        out << s.startup_ms << " " << s.rss_kb << " " << s.threads << " "
+            << s.fds << " " << s.idle_cpu_pct << "\n";
+        std::string text = out.str();
+        ssize_t written = write(fds[1], text.data(), text.size());
+        close(fds[1]);
+        _exit(written == static_cast<ssize_t>(text.size()) ? 0 : 1);
+    }
+    close(fds[1]);
+    std::string text;
+    char buf[256];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0)
+        text.append(buf, static_cast<size_t>(n));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    std::istringstream in(text);
+    in >> sample.startup_ms >> sample.rss_kb >> sample.threads >> sample.fds >>
+        sample.idle_cpu_pct;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 && !in.fail();
+}
+
+int main(int argc, char *argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                std::cerr << "нет значения для " << arg << std::endl;
+                std::exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "--counts") {
+            opt.counts.clear();
+            std::stringstream list(value());
+            std::string item;
+            while (std::getline(list, item, ','))
+                opt.counts.push_back(std::stoul(item));
+        } else if (arg == "--idle-ms")
+            opt.idle_ms = std::stoi(value());
+        else if (arg == "--layout")
+            opt.layout = value();
+        else if (arg == "--shared-socket")
+            opt.shared_socket = true;
+        else if (arg == "--base-port")
+            opt.base_port = std::stoi(value());
+        else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--counts N,N,...] [--idle-ms MS]"
+                         " [--layout pool|active_obj] [--shared-socket]"
+                         " [--base-port P]"
+                      << std::endl;
+            return 1;
+        }
+    }
+    if (opt.layout != "pool" && opt.layout != "active_obj") {
+        std::cerr << "--layout: pool или active_obj" << std::endl;
+        return 1;
+    }
+
+    std::cout << "layout=" << opt.layout
+              << (opt.shared_socket ? ", shared socket" : ", socket per MSC")
+              << std::endl;
+    std::cout << std::right << std::setw(8) << "mscs" << std::setw(14)
+              << "startup_ms" << std::setw(12) << "rss_mb" << std::setw(10)
+              << "threads" << std::setw(10) << "fds" << std::setw(12)
+              << "idle_cpu_%" << std::endl;
+    bool failed = false;
+    for (size_t count : opt.counts) {
+        Sample s;
+        if (!measure_in_child(opt, count, s)) {
+            std::cout << std::setw(8) << count << "  прогон не удался"
+                      << std::endl;
+            failed = true;
+            continue;
+        }
+        std::cout << std::setw(8) << count << std::fixed << std::setprecision(1)
+                  << std::setw(14) << s.startup_ms << std::setw(12)
+                  << s.rss_kb / 1024.0 << std::setw(10) << s.threads
+                  << std::setw(10) << s.fds << std::setw(12) << std::setprecision(2)
+                  << s.idle_cpu_pct << std::endl;
+    }
+    return failed ? 1 : 0;
+}
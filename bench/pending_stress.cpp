@@ -0,0 +1,235 @@
+// Стресс таблицы ожидающих запросов под ThreadSanitizer: вставка, ответы
+// агентов и проверка таймаутов идут из разных потоков одновременно, как у
+// обработчиков диспетчера на пуле. Каждый запрос должен завершиться ровно
+// один раз, либо последним ответом, либо таймаутом:
+//   pending_stress [--requests 20000] [--agents 8] [--reply-threads 4]
+//                  [--insert-threads 2]
+// Код возврата 0, если все проверки прошли
+
+#include "Ids.hpp"
+#include "PendingRequests.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+struct Options {
+    size_t requests = 20000;
+    size_t agents = 8;
+    size_t reply_threads = 4;
+    size_t insert_threads = 2;
+};
+
+// Каждый третий запрос ждет еще и агента, который молчит. Такой запрос
+// завершает либо таймаут молчащего агента, либо последний ответ остальных,
+// если он пришел уже после таймаута: здесь ответы и проверка таймаутов
+// гоняются за один и тот же запрос
+static bool has_silent_agent(RequestId id) { return id % 3 == 0; }
+// Часть из них ждет только молчащего агента и завершается только таймаутом,
+// пока рядом идут вставки и ответы на другие запросы
+static bool only_silent_agent(RequestId id) { return id % 6 == 0; }
+
+static size_t expected_agents(RequestId id, size_t agents) {
+    if (only_silent_agent(id))
+        return 1;
+    return has_silent_agent(id) ? agents : agents - 1;
+}
+
+static size_t count_entries(std::string_view response) {
+    size_t count = 0;
+    for (size_t pos = response.find("\"agent_id\""); pos != std::string::npos;
+         pos = response.find("\"agent_id\"", pos + 1))
+        ++count;
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    Options opt;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        size_t value = std::stoul(argv[i + 1]);
+        if (!std::strcmp(argv[i], "--requests"))
+            opt.requests = value;
+        else if (!std::strcmp(argv[i], "--agents"))
+            opt.agents = value;
+        else if (!std::strcmp(argv[i], "--reply-threads"))
+            opt.reply_threads = value;
+        else if (!std::strcmp(argv[i], "--insert-threads"))
+            opt.insert_threads = value;
+    }
+    if (opt.agents < 2 || opt.reply_threads == 0 || opt.insert_threads == 0) {
+        std::fprintf(stderr,
+                     "need at least 2 agents and 1 thread of each kind\n");
+        return 2;
+    }
+
+    // Последний агент молчит и быстро истекает, остальные отвечают задолго
+    // до своего таймаута
+    const AgentIndex silent = static_cast<AgentIndex>(opt.agents - 1);
+    AgentTimeouts table_timeouts(opt.agents, std::chrono::seconds(60));
+    table_timeouts[silent] = std::chrono::milliseconds(5);
+    // Половина запросов несет свои таймауты, как после перечитывания конфига
+    auto own_timeouts = std::make_shared<const AgentTimeouts>(table_timeouts);
+
+    PendingRequestTable table(table_timeouts, 16);
+
+    const size_t n = opt.requests;
+    auto inserted = std::make_unique<std::atomic<bool>[]>(n);
+    auto completions = std::make_unique<std::atomic<int>[]>(n);
+    auto accepted = std::make_unique<std::atomic<int>[]>(n);
+    std::atomic<size_t> completed{0};
+    std::atomic<size_t> by_reply{0};
+    std::atomic<size_t> by_timeout{0};
+    std::atomic<size_t> rejected{0};
+
+    std::mutex errors_mtx;
+    std::vector<std::string> errors;
+    auto error = [&](RequestId id, const std::string &what) {
+        std::lock_guard lock(errors_mtx);
+        if (errors.size() < 20)
+            errors.push_back("request " + std::to_string(id) + ": " + what);
+        else if (errors.size() == 20)
+            errors.push_back("...");
+    };
+
+    auto complete = [&](RequestId id, PendingRequest &done) {
+        if (completions[id].fetch_add(1) != 0)
+            error(id, "completed more than once");
+        if (!done.waiting_for.empty())
+            error(id, "completed with agents still pending");
+        size_t replies = static_cast<size_t>(accepted[id].load());
+        size_t expected = expected_agents(id, opt.agents);
+        if (replies + done.timed_out.size() != expected)
+            error(id, std::to_string(replies) + " replies and " +
+                          std::to_string(done.timed_out.size()) +
+                          " timeouts for " + std::to_string(expected) +
+                          " agents");
+        for (AgentIndex agent : done.timed_out) {
+            if (agent != silent)
+                error(id, "agent " + std::to_string(agent) + " timed out");
+        }
+        if (count_entries(done.response.finish()) != replies)
+            error(id, "response entries do not match accepted replies");
+        completed.fetch_add(1);
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+
+    for (size_t t = 0; t < opt.insert_threads; ++t) {
+        threads.emplace_back([&, t] {
+            for (RequestId id = t; id < n; id += opt.insert_threads) {
+                PendingRequest request;
+                request.waiting_for = AgentSet(opt.agents);
+                if (!only_silent_agent(id)) {
+                    for (AgentIndex agent = 0; agent < silent; ++agent)
+                        request.waiting_for.set(agent);
+                }
+                if (has_silent_agent(id))
+                    request.waiting_for.set(silent);
+                request.response.begin(request_id_to_wire(id), 256);
+                request.start_time = Clock::now();
+                if (id % 2)
+                    request.agent_timeouts = own_timeouts;
+                table.insert(id, std::move(request));
+                inserted[id].store(true, std::memory_order_release);
+            }
+        });
+    }
+
+    for (size_t r = 0; r < opt.reply_threads; ++r) {
+        threads.emplace_back([&, r] {
+            const std::string reply = R"({"status":"ok"})";
+            for (RequestId id = 0; id < n; ++id) {
+                while (!inserted[id].load(std::memory_order_acquire))
+                    std::this_thread::yield();
+                // Ответы агентов, которых запрос не ждет, тоже шлем: они
+                // не должны приниматься
+                for (AgentIndex agent = static_cast<AgentIndex>(r);
+                     agent < silent;
+                     agent += static_cast<AgentIndex>(opt.reply_threads)) {
+                    std::string agent_id =
+                        "\"msc-" + std::to_string(agent) + "\"";
+                    // Второй ответ того же агента - повтор, он не должен
+                    // приниматься
+                    for (int copy = 0; copy < 2; ++copy) {
+                        auto done = table.add_reply(
+                            id, agent, reply, agent_id, true,
+                            [&](PendingRequest &) {
+                                if (only_silent_agent(id))
+                                    error(id, "unexpected reply accepted");
+                                accepted[id].fetch_add(1);
+                            });
+                        if (done) {
+                            by_reply.fetch_add(1);
+                            complete(id, *done);
+                        }
+                    }
+                }
+                // Ответ агента, которого в запросе нет
+                if (table.add_reply(id, static_cast<AgentIndex>(opt.agents + 5),
+                                    reply, "\"stranger\"", true,
+                                    [&](PendingRequest &) {
+                                        error(id, "stranger reply accepted");
+                                    }))
+                    error(id, "completed by a stranger reply");
+                else
+                    rejected.fetch_add(1);
+            }
+        });
+    }
+
+    threads.emplace_back([&] {
+        // Под TSan все в разы медленнее, поэтому запас большой
+        auto give_up =
+            std::chrono::steady_clock::now() + std::chrono::minutes(5);
+        while (completed.load() < n &&
+               std::chrono::steady_clock::now() < give_up) {
+            for (auto &[id, done] : table.take_expired(Clock::now())) {
+                by_timeout.fetch_add(1);
+                complete(id, done);
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    });
+
+    for (auto &thread : threads)
+        thread.join();
+    double elapsed_ms = std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+
+    // Поздние ответы после завершения ничего не должны менять
+    for (RequestId id = 0; id < n; id += 97) {
+        if (table.add_reply(id, 0, "{}", "\"late\"", true))
+            error(id, "completed again by a late reply");
+    }
+
+    size_t missing = 0;
+    for (RequestId id = 0; id < n; ++id)
+        missing += completions[id].load() == 0;
+    if (missing)
+        error(0, std::to_string(missing) + " requests never completed");
+    if (table.size() != 0)
+        error(0, std::to_string(table.size()) + " requests left in the table");
+
+    std::printf("requests %zu, agents %zu, threads %zu insert + %zu reply + 1 "
+                "expiry: %.1f ms\n",
+                n, opt.agents, opt.insert_threads, opt.reply_threads,
+                elapsed_ms);
+    std::printf("completed by reply %zu, by timeout %zu, stranger replies "
+                "rejected %zu\n",
+                by_reply.load(), by_timeout.load(), rejected.load());
+    for (const auto &line : errors)
+        std::printf("FAIL %s\n", line.c_str());
+    if (!errors.empty())
+        return 1;
+    std::printf("OK: every request completed exactly once\n");
+    return 0;
+}
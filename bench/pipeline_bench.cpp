@@ -0,0 +1,561 @@
+// Бенчмарки компонентов конвейера без сети и сквозной прогон графа агентов
+// через loopback с поддельной MSC. Результаты можно сохранить как базовые
+// и сравнивать с ними последующие прогоны:
+//   pipeline_bench --save-baseline baseline.txt
+//   pipeline_bench --baseline baseline.txt [--tolerance 10]
+// При регрессии больше tolerance процентов код возврата 2.
+
+#include "AgentPools.hpp"
+#include "Agents.hpp"
+#include "CommandQueue.hpp"
+#include "Ids.hpp"
+#include "JsonParser.hpp"
+#include "Lifecycle.hpp"
+#include "Metrics.hpp"
+#include "MscDirectory.hpp"
+#include "MscHost.hpp"
+#include "NetworkUtils.hpp"
+#include "PacketPool.hpp"
+#include "PayloadParser.hpp"
+#include "PendingRequests.hpp"
+#include "ResponseBuffer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <poll.h>
+#include <so_5/all.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+using BenchClock = std::chrono::steady_clock;
+
+// Не дает компилятору выбросить результат
+static volatile uint64_t g_sink = 0;
+
+// Одно измерение: меньше - лучше
+struct Result {
+    std::string name;
+    double value;
+    const char *unit;
+};
+
+struct Options {
+    size_t iterations = 200000;
+    size_t loopback_requests = 20000;
+    size_t loopback_window = 64;
+    int base_port = 21000;
+    bool loopback = true;
+    double tolerance_pct = 10.0;
+    std::string baseline_path;
+    std::string save_baseline_path;
+};
+
+template <typename F>
+static double run(size_t iterations, F &&fn) {
+    // Прогрев
+    for (size_t i = 0; i < iterations / 10 + 1; ++i)
+        fn();
+    auto start = BenchClock::now();
+    for (size_t i = 0; i < iterations; ++i)
+        fn();
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        BenchClock::now() - start);
+    return static_cast<double>(elapsed.count()) / iterations;
+}
+
+static const std::string kCommand =
+    R"({"command":"restart","target":"all","params":{"delay_ms":100,"force":false,"reason":"maintenance window"},"client_request_id":123})";
+static const std::string kMscReply =
+    R"({"request_id":"req_123","result":"success","message":"Command processed"})";
+
+// CommandQueue под конкуренцией: producers потоков кладут, один поток
+// вычитывает, как поток приема и ingress агент
+static void bench_queue(const Options &opt, std::vector<Result> &out) {
+    for (size_t producers : {1, 2, 4}) {
+        CommandQueue queue(1024, OverflowPolicy::backpressure);
+        const size_t per_producer = opt.iterations;
+        const size_t total = per_producer * producers;
+        std::atomic<bool> go{false};
+
+        std::vector<std::thread> threads;
+        for (size_t p = 0; p < producers; ++p) {
+            threads.emplace_back([&] {
+                while (!go.load(std::memory_order_acquire)) {
+                }
+                for (size_t i = 0; i < per_producer; ++i)
+                    queue.push(Packet{PacketRef{}, i, "cmd", sockaddr_in{}});
+            });
+        }
+
+        auto start = BenchClock::now();
+        go.store(true, std::memory_order_release);
+        size_t popped = 0;
+        while (popped < total) {
+            if (auto pkt = queue.try_pop()) {
+                g_sink = g_sink + pkt->len;
+                ++popped;
+            }
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            BenchClock::now() - start);
+        for (auto &t : threads)
+            t.join();
+        out.push_back({"queue_push_pop/producers=" + std::to_string(producers),
+                       static_cast<double>(elapsed.count()) / total, "ns/op"});
+    }
+}
+
+static void bench_parse_address(const Options &opt, std::vector<Result> &out) {
+    const std::string addr = "127.0.0.1:11000";
+    out.push_back({"parse_address", run(opt.iterations, [&] {
+                       g_sink = g_sink + parse_address(addr).sin_port;
+                   }),
+                   "ns/op"});
+}
+
+// Валидация команды, как в CommandIngressAgent::process_packet
+static void bench_validation(const Options &opt, std::vector<Result> &out) {
+    for (auto [mode, name] : {std::pair{ParserMode::scan, "scan"},
+                              std::pair{ParserMode::dom, "dom"}}) {
+        PayloadParser parser(mode);
+        CommandFields fields;
+        std::string error;
+        out.push_back({std::string("validate_command/") + name,
+                       run(opt.iterations, [&] {
+                           if (!parser.parse_command(kCommand.data(),
+                                                     kCommand.size(), fields,
+                                                     error))
+                               std::abort();
+                           g_sink = g_sink + fields.target.size();
+                       }),
+                       "ns/op"});
+    }
+}
+
+// Регистрация запроса, сбор ответов N агентов и готовый финальный ответ:
+// работа диспетчера на один запрос без пересылки сообщений
+static void bench_fanout(const Options &opt, std::vector<Result> &out) {
+    for (size_t agents : {1, 4, 16, 64}) {
+        PendingRequestTable table(std::vector<std::chrono::milliseconds>(
+            agents, std::chrono::milliseconds(1000)));
+        std::vector<std::string> ids_json;
+        for (size_t i = 0; i < agents; ++i) {
+            std::string quoted;
+            append_json_string(quoted, std::to_string(i + 1));
+            ids_json.push_back(std::move(quoted));
+        }
+
+        RequestId next_id = 0;
+        double ns = run(opt.iterations / agents + 1, [&] {
+            RequestId id = ++next_id;
+            PendingRequest pending;
+            pending.waiting_for = AgentSet(agents);
+            for (AgentIndex i = 0; i < agents; ++i)
+                pending.waiting_for.set(i);
+            pending.start_time = Clock::now();
+            pending.response.begin(request_id_to_wire(id), 64 + agents * 128);
+            table.insert(id, std::move(pending));
+            for (AgentIndex i = 0; i < agents; ++i) {
+                if (auto done = table.add_reply(id, i, kMscReply, ids_json[i],
+                                                true))
+                    g_sink = g_sink + done->response.finish().size();
+            }
+        });
+        out.push_back({"fanout_aggregate/agents=" + std::to_string(agents), ns,
+                       "ns/request"});
+    }
+}
+
+// Сборка финального ответа, как в send_final_response_safe: ответы и
+// таймауты дописываются в буфер, затем буфер отдается целиком
+static void bench_final_response(const Options &opt, std::vector<Result> &out) {
+    for (size_t agents : {1, 16, 64}) {
+        std::string id_json = "\"msc\"";
+        double ns = run(opt.iterations / agents + 1, [&] {
+            ResponseBuffer response;
+            response.begin("req_123", 64 + agents * 128, "123");
+            for (size_t i = 0; i < agents; ++i) {
+                if (i % 4 == 3)
+                    response.append_timeout(id_json);
+                else
+                    response.append_reply(kMscReply, id_json, true);
+            }
+            g_sink = g_sink + response.finish().size();
+        });
+        out.push_back({"final_response/agents=" + std::to_string(agents), ns,
+                       "ns/request"});
+    }
+}
+
+// Поддельная MSC: на каждый remote_address агентов открыт сокет. Пакет с
+// request_id считается командой, ответ уходит на local_address агента
+class FakeMsc {
+public:
+    explicit FakeMsc(const Config &config) {
+        for (const auto &msc : config.msc_agents) {
+            int sock = socket(AF_INET, SOCK_DGRAM, 0);
+            sockaddr_in local = parse_address(msc.remote_address);
+            if (sock < 0 || bind(sock, reinterpret_cast<sockaddr *>(&local),
+                                 sizeof(local)) < 0) {
+                LOG_ERROR("FakeMsc: bind для " << msc.remote_address);
+                if (sock >= 0)
+                    close(sock);
+                continue;
+            }
+            socks_.push_back({sock, parse_address(msc.local_address)});
+        }
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~FakeMsc() {
+        running_ = false;
+        thread_.join();
+        for (auto &s : socks_)
+            close(s.fd);
+    }
+
+private:
+    struct Endpoint {
+        int fd;
+        sockaddr_in reply_to;
+    };
+
+    void run() {
+        std::vector<pollfd> fds;
+        for (auto &s : socks_)
+            fds.push_back({s.fd, POLLIN, 0});
+        PayloadParser parser(ParserMode::scan);
+        char buf[65536];
+        std::string wire_id, error, reply;
+        while (running_) {
+            if (poll(fds.data(), fds.size(), 50) <= 0)
+                continue;
+            for (size_t i = 0; i < fds.size(); ++i) {
+                if (!(fds[i].revents & POLLIN))
+                    continue;
+                ssize_t n;
+                while ((n = recv(fds[i].fd, buf, sizeof(buf), MSG_DONTWAIT)) >
+                       0) {
+                    if (parser.parse_msc_packet(buf, n, wire_id, error) !=
+                        MscPacketKind::reply)
+                        continue;
+                    reply = R"({"request_id":)";
+                    append_json_string(reply, wire_id);
+                    reply += R"(,"result":"success"})";
+                    sendto(fds[i].fd, reply.data(), reply.size(), 0,
+                           reinterpret_cast<const sockaddr *>(
+                               &socks_[i].reply_to),
+                           sizeof(sockaddr_in));
+                }
+            }
+        }
+    }
+
+    std::vector<Endpoint> socks_;
+    std::atomic<bool> running_{true};
+    std::thread thread_;
+};
+
+static Config make_loopback_config(const Options &opt, size_t agents) {
+    auto addr = [](int port) { return "127.0.0.1:" + std::to_string(port); };
+    Config config;
+    config.cmd.local_address = addr(opt.base_port);
+    config.cmd.remote_address = addr(opt.base_port + 1);
+    config.cmd.response_timeout_ms = 1000;
+    for (size_t i = 0; i < agents; ++i) {
+        MscAgentSettings msc;
+        msc.id = std::to_string(i + 1);
+        msc.index = static_cast<AgentIndex>(i);
+        msc.local_address = addr(opt.base_port + 100 + static_cast<int>(i));
+        msc.remote_address = addr(opt.base_port + 300 + static_cast<int>(i));
+        msc.response_timeout_ms = 1000;
+        config.agent_ids[msc.id] = msc.index;
+        config.msc_agents.push_back(std::move(msc));
+    }
+    // Агенты MSC по потоку на каждый, как остальные агенты бенчмарка
+    config.threading.bindings["msc"] = "agents";
+    return config;
+}
+
+// Извлекает числовой client_request_id из финального ответа
+static bool parse_client_id(const char *data, size_t len, uint64_t &id) {
+    static const std::string key = "\"client_request_id\":";
+    std::string_view sv(data, len);
+    size_t pos = sv.find(key);
+    if (pos == std::string_view::npos)
+        return false;
+    pos += key.size();
+    if (pos >= len || data[pos] < '0' || data[pos] > '9')
+        return false;
+    id = 0;
+    while (pos < len && data[pos] >= '0' && data[pos] <= '9')
+        id = id * 10 + (data[pos++] - '0');
+    return true;
+}
+
+// Клиент с окном: держит не больше window запросов в полете, задержка
+// считается от отправки до финального ответа
+static void drive_client(const Options &opt, const Config &config,
+                         LatencyHistogram &latency, size_t &received,
+                         double &elapsed_ns) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    timeval timeout{1, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    sockaddr_in target = parse_address(config.cmd.local_address);
+
+    const size_t total = opt.loopback_requests;
+    std::vector<BenchClock::time_point> sent_at(total);
+    size_t sent = 0;
+    received = 0;
+    char buf[65536];
+    std::string message;
+
+    auto start = BenchClock::now();
+    while (received < total) {
+        while (sent < total && sent - received < opt.loopback_window) {
+            message = R"({"command":"bench","target":"all","client_request_id":)" +
+                      std::to_string(sent) + "}";
+            sent_at[sent] = BenchClock::now();
+            sendto(sock, message.data(), message.size(), 0,
+                   reinterpret_cast<const sockaddr *>(&target), sizeof(target));
+            ++sent;
+        }
+        ssize_t n = recv(sock, buf, sizeof(buf), 0);
+        if (n < 0) {
+            LOG_WARN("loopback: ответ не пришел за 1 с, получено "
+                     << received << " из " << total);
+            break;
+        }
+        uint64_t id = 0;
+        if (!parse_client_id(buf, n, id) || id >= total)
+            continue;
+        latency.record(BenchClock::now() - sent_at[id]);
+        ++received;
+    }
+    elapsed_ns = static_cast<double>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            BenchClock::now() - start)
+            .count());
+    close(sock);
+}
+
+// Весь граф агентов, как в main.cpp, с настоящими сокетами на loopback
+static void bench_loopback(const Options &opt, std::vector<Result> &out) {
+    for (size_t agents : {1, 4}) {
+        Config config = make_loopback_config(opt, agents);
+        FakeMsc fake_msc(config);
+
+        std::atomic<bool> running{true};
+        StopEvent stop_event;
+        InflightTracker inflight;
+        PacketPool packet_pool(config.network.packet_pool_size,
+                               receive_buffer_size(config.network));
+        CommandQueue command_queue(AgentSettings{}.queue_size);
+        MscEgress msc_egress;
+        MscDirectory msc_directory;
+        std::vector<std::thread> receive_thrs;
+
+        LatencyHistogram latency;
+        size_t received = 0;
+        double elapsed_ns = 0;
+        // Счетчики глобальные, прогон считается по разнице
+        uint64_t msc_sent_before = metrics().msc_sent.value();
+        uint64_t msc_syscalls_before = metrics().msc_send_syscalls.value();
+
+        so_5::launch([&](so_5::environment_t &env) {
+            using namespace so_5::disp::adv_thread_pool;
+            CommandDispatcherAgent *dispatcher;
+            env.introduce_coop(make_dispatcher(env, 3).binder(
+                                   bind_params_t{}.fifo(fifo_t::individual)),
+                               [&](so_5::coop_t &coop) {
+                                   dispatcher =
+                                       coop.make_agent<CommandDispatcherAgent>(
+                                           std::cref(msc_directory),
+                                           std::ref(inflight));
+                               });
+            auto dispatcher_mbox = dispatcher->so_direct_mbox();
+
+            so_5::mbox_t broadcaster_mbox;
+            so_5::mbox_t final_mbox;
+            so_5::mbox_t ingress_mbox;
+            env.introduce_coop(
+                so_5::disp::active_obj::make_dispatcher(env).binder(),
+                [&](so_5::coop_t &coop) {
+                    broadcaster_mbox =
+                        coop.make_agent<EventBroadcasterAgent>(std::cref(config))
+                            ->so_direct_mbox();
+                    final_mbox =
+                        coop.make_agent<FinalResponseAgent>()->so_direct_mbox();
+                    ingress_mbox =
+                        coop.make_agent<CommandIngressAgent>(
+                                std::ref(command_queue), std::cref(config), false,
+                                dispatcher_mbox, std::ref(inflight))
+                            ->so_direct_mbox();
+                    msc_egress.set_consumer(
+                        coop.make_agent<MscEgressAgent>(std::ref(msc_egress))
+                            ->so_direct_mbox());
+                });
+
+            AgentPools pools(env, config.threading);
+            MscHost msc_host(env, pools, msc_directory, config,
+                             broadcaster_mbox, dispatcher_mbox, msc_egress,
+                             receive_thread_count(config));
+            msc_host.start();
+
+            for (int w = 0; w < receive_thread_count(config); ++w) {
+                receive_thrs.emplace_back([&, ingress_mbox, w] {
+                    receive_thread(config, packet_pool, command_queue, running,
+                                   stop_event, msc_directory, ingress_mbox, w);
+                });
+            }
+            dispatcher->set_links(final_mbox);
+
+            // Даем потоку приема открыть сокеты
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            drive_client(opt, config, latency, received, elapsed_ns);
+
+            running.store(false);
+            stop_event.notify();
+            for (auto &thr : receive_thrs)
+                thr.join();
+            env.stop();
+        });
+
+        std::string suffix = "/agents=" + std::to_string(agents);
+        if (received < opt.loopback_requests) {
+            std::cerr << "loopback" << suffix << ": получено " << received
+                      << " из " << opt.loopback_requests << std::endl;
+            continue;
+        }
+        auto snap = latency.snapshot();
+        out.push_back({"loopback_throughput" + suffix, elapsed_ns / received,
+                       "ns/request"});
+        out.push_back({"loopback_latency_p50" + suffix,
+                       static_cast<double>(snap.quantile(0.5)), "ns"});
+        out.push_back({"loopback_latency_p99" + suffix,
+                       static_cast<double>(snap.quantile(0.99)), "ns"});
+        uint64_t msc_sent = metrics().msc_sent.value() - msc_sent_before;
+        uint64_t msc_syscalls =
+            metrics().msc_send_syscalls.value() - msc_syscalls_before;
+        if (msc_sent)
+            out.push_back({"loopback_msc_send_syscalls" + suffix,
+                           static_cast<double>(msc_syscalls) / msc_sent,
+                           "syscalls/datagram"});
+    }
+}
+
+static std::map<std::string, double> load_baseline(const std::string &path) {
+    std::map<std::string, double> baseline;
+    std::ifstream in(path);
+    if (!in)
+        std::cerr << "не удалось открыть " << path << std::endl;
+    std::string name;
+    double value;
+    while (in >> name >> value)
+        baseline[name] = value;
+    return baseline;
+}
+
+static bool save_baseline(const std::string &path,
+                          const std::vector<Result> &results) {
+    std::ofstream out(path);
+    for (const auto &r : results)
+        out << r.name << ' ' << std::fixed << std::setprecision(1) << r.value
+            << '\n';
+    out.close();
+    if (!out) {
+        std::cerr << "не удалось записать " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                std::cerr << "нет значения для " << arg << std::endl;
+                std::exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "--iterations")
+            opt.iterations = std::stoul(value());
+        else if (arg == "--loopback-requests")
+            opt.loopback_requests = std::stoul(value());
+        else if (arg == "--loopback-window")
+            opt.loopback_window = std::stoul(value());
+        else if (arg == "--base-port")
+            opt.base_port = std::stoi(value());
+        else if (arg == "--no-loopback")
+            opt.loopback = false;
+        else if (arg == "--baseline")
+            opt.baseline_path = value();
+        else if (arg == "--save-baseline")
+            opt.save_baseline_path = value();
+        else if (arg == "--tolerance")
+            opt.tolerance_pct = std::stod(value());
+        else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--iterations N] [--loopback-requests N]"
+                         " [--loopback-window N] [--base-port P] [--no-loopback]"
+                         " [--baseline FILE] [--save-baseline FILE]"
+                         " [--tolerance PCT]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+    bench_queue(opt, results);
+    bench_parse_address(opt, results);
+    bench_validation(opt, results);
+    bench_fanout(opt, results);
+    bench_final_response(opt, results);
+    if (opt.loopback)
+        bench_loopback(opt, results);
+
+    std::map<std::string, double> baseline;
+    if (!opt.baseline_path.empty())
+        baseline = load_baseline(opt.baseline_path);
+
+    bool regressed = false;
+    std::cout << std::left << std::setw(40) << "benchmark" << std::right
+              << std::setw(14) << "value" << "  " << std::left << std::setw(11)
+              << "unit" << std::right;
+    if (!baseline.empty())
+        std::cout << std::setw(14) << "baseline" << std::setw(10) << "delta";
+    std::cout << std::endl;
+
+    for (const auto &r : results) {
+        std::cout << std::left << std::setw(40) << r.name << std::right
+                  << std::fixed << std::setprecision(1) << std::setw(14)
+                  << r.value << "  " << std::left << std::setw(11) << r.unit
+                  << std::right;
+        auto it = baseline.find(r.name);
+        if (it != baseline.end() && it->second > 0) {
+            double delta = (r.value - it->second) / it->second * 100.0;
+            std::cout << std::setw(14) << it->second << std::setw(9)
+                      << std::showpos << delta << std::noshowpos << "%";
+            if (delta > opt.tolerance_pct) {
+                std::cout << "  REGRESSION";
+                regressed = true;
+            }
+        }
+        std::cout << std::endl;
+    }
+
+    if (!opt.save_baseline_path.empty() &&
+        !save_baseline(opt.save_baseline_path, results))
+        return 1;
+    return regressed ? 2 : 0;
+}
@@ -0,0 +1,416 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <queue>
+#include <random>
+#include <csignal>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+
+#include "JsonParser.hpp"
+#include "PayloadParser.hpp"
+#include "ResponseBuffer.hpp"
+
+// Имитатор внешних MSC для нагрузочных прогонов на одной машине. Для каждого
+// msc_agent из config.json слушает remote_address, на команды с request_id
+// отвечает на local_address агента с заданной задержкой, часть ответов
+// теряет, а также сам шлет асинхронные события без request_id.
+
+using Clock = std::chrono::steady_clock;
+
+enum class LatencyDistribution { fixed, uniform, normal, exponential, lognormal };
+
+struct SimulatorSettings {
+    std::string config_path = "config.json";
+    LatencyDistribution distribution = LatencyDistribution::fixed;
+    double latency_ms = 1.0;      // Средняя задержка ответа
+    double stddev_ms = 0.0;       // Разброс для normal и lognormal
+    double jitter_ms = 0.0;       // Равномерная добавка в [-jitter, +jitter]
+    double drop_rate = 0.0;       // Доля команд без ответа, [0, 1]
+    double error_rate = 0.0;      // Доля ответов с "result":"error", [0, 1]
+    double event_rate = 0.0;      // Событий в секунду на каждый MSC
+    std::string reply_host;       // Куда отвечать, если local_address 0.0.0.0
+    uint64_t seed = 0;            // 0 - случайное зерно
+};
+
+struct SimulatorStats {
+    uint64_t commands = 0;
+    uint64_t without_request_id = 0;
+    uint64_t replies = 0;
+    uint64_t errors = 0;
+    uint64_t dropped = 0;
+    uint64_t events = 0;
+    uint64_t send_errors = 0;
+};
+
+std::atomic<bool> running{true};
+
+// Разбор "ip:port", false при неверном формате
+bool to_sockaddr(const std::string& addr_str, sockaddr_in& addr) {
+    size_t colon = addr_str.find(':');
+    if (colon == std::string::npos) {
+        return false;
+    }
+    addr = sockaddr_in{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(std::stoi(addr_str.substr(colon + 1)));
+    return inet_pton(AF_INET, addr_str.substr(0, colon).c_str(), &addr.sin_addr) == 1;
+}
+
+void handle_signal(int) {
+    running = false;
+}
+
+class MscSimulator {
+private:
+    struct Endpoint {
+        std::string id;
+        int sock = -1;
+        sockaddr_in reply_to{};
+        Clock::time_point next_event;
+        uint64_t event_seq = 0;
+    };
+
+    // Отложенный ответ, уходит в момент due
+    struct ScheduledReply {
+        Clock::time_point due;
+        size_t endpoint;
+        std::string payload;
+        bool operator>(const ScheduledReply& other) const { return due > other.due; }
+    };
+
+    SimulatorSettings settings_;
+    std::vector<Endpoint> endpoints_;
+    std::priority_queue<ScheduledReply, std::vector<ScheduledReply>, std::greater<>> scheduled_;
+    SimulatorStats stats_;
+    std::mt19937_64 rng_;
+    PayloadParser parser_{ParserMode::scan};
+
+public:
+    explicit MscSimulator(const SimulatorSettings& settings)
+        : settings_(settings),
+          rng_(settings.seed ? settings.seed : std::random_device{}()) {}
+
+    ~MscSimulator() {
+        for (auto& ep : endpoints_) {
+            if (ep.sock >= 0) {
+                close(ep.sock);
+            }
+        }
+    }
+
+    bool setup(const Config& config) {
+        for (const auto& msc : config.msc_agents) {
+            Endpoint ep;
+            ep.id = msc.id;
+            ep.sock = socket(AF_INET, SOCK_DGRAM, 0);
+            if (ep.sock < 0) {
+                std::cerr << "❌ Failed to create socket for MSC " << msc.id << std::endl;
+                return false;
+            }
+            sockaddr_in local{};
+            if (!to_sockaddr(msc.remote_address, local) ||
+                !to_sockaddr(msc.local_address, ep.reply_to)) {
+                std::cerr << "❌ Invalid address for MSC " << msc.id << std::endl;
+                close(ep.sock);
+                return false;
+            }
+            if (bind(ep.sock, (struct sockaddr*)&local, sizeof(local)) < 0) {
+                std::cerr << "❌ Failed to bind MSC " << msc.id << " to " << msc.remote_address
+                          << ": " << strerror(errno) << std::endl;
+                close(ep.sock);
+                return false;
+            }
+
+            // Шлюз слушает local_address, ответы и события идут туда
+            if (ep.reply_to.sin_addr.s_addr == htonl(INADDR_ANY)) {
+                std::string host = settings_.reply_host.empty() ? "127.0.0.1" : settings_.reply_host;
+                inet_pton(AF_INET, host.c_str(), &ep.reply_to.sin_addr);
+            }
+            ep.next_event = Clock::now() + next_event_delay();
+
+            std::cout << "📡 MSC " << msc.id << ": listening on " << msc.remote_address
+                      << ", replying to " << inet_ntoa(ep.reply_to.sin_addr) << ":"
+                      << ntohs(ep.reply_to.sin_port) << std::endl;
+            endpoints_.push_back(std::move(ep));
+        }
+        if (endpoints_.empty()) {
+            std::cerr << "❌ No msc_agent entries in config" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void run() {
+        std::vector<pollfd> fds;
+        for (const auto& ep : endpoints_) {
+            fds.push_back({ep.sock, POLLIN, 0});
+        }
+        char buffer[65536];
+        auto next_report = Clock::now() + std::chrono::seconds(1);
+
+        while (running) {
+            // Спим до ближайшего ответа или события, но не дольше 100 мс
+            auto now = Clock::now();
+            auto wake = std::min(now + std::chrono::milliseconds(100), next_report);
+            if (!scheduled_.empty()) {
+                wake = std::min(wake, scheduled_.top().due);
+            }
+            if (settings_.event_rate > 0) {
+                for (const auto& ep : endpoints_) {
+                    wake = std::min(wake, ep.next_event);
+                }
+            }
+            int timeout_ms = static_cast<int>(std::max<int64_t>(
+                0, std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count()));
+
+            if (poll(fds.data(), fds.size(), timeout_ms) > 0) {
+                for (size_t i = 0; i < fds.size(); ++i) {
+                    if (!(fds[i].revents & POLLIN)) {
+                        continue;
+                    }
+                    ssize_t received;
+                    while ((received = recv(fds[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+                        handle_command(i, buffer, received);
+                    }
+                }
+            }
+
+            now = Clock::now();
+            while (!scheduled_.empty() && scheduled_.top().due <= now) {
+                const ScheduledReply& reply = scheduled_.top();
+                send(endpoints_[reply.endpoint], reply.payload);
+                stats_.replies++;
+                scheduled_.pop();
+            }
+            if (settings_.event_rate > 0) {
+                for (auto& ep : endpoints_) {
+                    while (ep.next_event <= now) {
+                        send_event(ep);
+                        ep.next_event += next_event_delay();
+                    }
+                }
+            }
+            if (now >= next_report) {
+                print_stats();
+                next_report += std::chrono::seconds(1);
+            }
+        }
+        print_stats();
+    }
+
+private:
+    void handle_command(size_t endpoint, const char* data, size_t len) {
+        stats_.commands++;
+        std::string wire_id;
+        std::string error;
+        if (parser_.parse_msc_packet(data, len, wire_id, error) != MscPacketKind::reply) {
+            // Без request_id ответ сопоставить не с чем
+            stats_.without_request_id++;
+            return;
+        }
+        if (chance(settings_.drop_rate)) {
+            stats_.dropped++;
+            return;
+        }
+
+        bool failed = chance(settings_.error_rate);
+        std::string payload = R"({"request_id":)";
+        append_json_string(payload, wire_id);
+        payload += failed ? R"(,"result":"error","message":"Simulated failure")"
+                          : R"(,"result":"success","message":"Command processed")";
+        payload += R"(,"msc":)";
+        append_json_string(payload, endpoints_[endpoint].id);
+        payload += "}";
+        if (failed) {
+            stats_.errors++;
+        }
+
+        auto delay = std::chrono::duration<double, std::milli>(sample_latency_ms());
+        scheduled_.push({Clock::now() + std::chrono::duration_cast<Clock::duration>(delay),
+                         endpoint, std::move(payload)});
+    }
+
+    void send_event(Endpoint& ep) {
+        std::string payload = R"({"event":"status_changed","msc":)";
+        append_json_string(payload, ep.id);
+        payload += R"(,"seq":)" + std::to_string(++ep.event_seq) + "}";
+        send(ep, payload);
+        stats_.events++;
+    }
+
+    void send(const Endpoint& ep, const std::string& payload) {
+        if (sendto(ep.sock, payload.data(), payload.size(), 0,
+                   (const struct sockaddr*)&ep.reply_to, sizeof(ep.reply_to)) < 0) {
+            stats_.send_errors++;
+        }
+    }
+
+    bool chance(double probability) {
+        return probability > 0 && std::uniform_real_distribution<double>(0.0, 1.0)(rng_) < probability;
+    }
+
+    double sample_latency_ms() {
+        double mean = settings_.latency_ms;
+        double value = mean;
+        switch (settings_.distribution) {
+        case LatencyDistribution::fixed:
+            break;
+        case LatencyDistribution::uniform:
+            // Равномерно в [mean - stddev*sqrt(3), mean + stddev*sqrt(3)]
+            value = std::uniform_real_distribution<double>(
+                mean - settings_.stddev_ms * 1.7320508, mean + settings_.stddev_ms * 1.7320508)(rng_);
+            break;
+        case LatencyDistribution::normal:
+            value = std::normal_distribution<double>(mean, settings_.stddev_ms)(rng_);
+            break;
+        case LatencyDistribution::exponential:
+            value = mean > 0 ? std::exponential_distribution<double>(1.0 / mean)(rng_) : 0.0;
+            break;
+        case LatencyDistribution::lognormal:
+            if (mean > 0) {
+                // Параметры подбираются так, чтобы среднее и разброс совпали с заданными
+                double variance = settings_.stddev_ms * settings_.stddev_ms;
+                double sigma2 = std::log(1.0 + variance / (mean * mean));
+                double mu = std::log(mean) - sigma2 / 2.0;
+                value = std::lognormal_distribution<double>(mu, std::sqrt(sigma2))(rng_);
+            }
+            break;
+        }
+        if (settings_.jitter_ms > 0) {
+            value += std::uniform_real_distribution<double>(-settings_.jitter_ms, settings_.jitter_ms)(rng_);
+        }
+        return std::max(value, 0.0);
+    }
+
+    // События приходят пуассоновским потоком со средней частотой event_rate
+    Clock::duration next_event_delay() {
+        if (settings_.event_rate <= 0) {
+            return std::chrono::hours(24);
+        }
+        double seconds = std::exponential_distribution<double>(settings_.event_rate)(rng_);
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    }
+
+    void print_stats() {
+        std::cout << "📊 commands: " << stats_.commands
+                  << ", replies: " << stats_.replies
+                  << " (errors " << stats_.errors << ")"
+                  << ", dropped: " << stats_.dropped
+                  << ", no request_id: " << stats_.without_request_id
+                  << ", events: " << stats_.events
+                  << ", pending: " << scheduled_.size();
+        if (stats_.send_errors > 0) {
+            std::cout << ", send errors: " << stats_.send_errors;
+        }
+        std::cout << std::endl;
+    }
+};
+
+void print_usage(const char* program_name) {
+    std::cout << "Usage: " << program_name << " [options]" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  --config <path>         Gateway config with msc_agent list (default: config.json)" << std::endl;
+    std::cout << "  --latency <dist>        fixed, uniform, normal, exponential, lognormal (default: fixed)" << std::endl;
+    std::cout << "  --latency-ms <ms>       Mean reply latency (default: 1)" << std::endl;
+    std::cout << "  --stddev-ms <ms>        Latency spread for uniform, normal, lognormal (default: 0)" << std::endl;
+    std::cout << "  --jitter-ms <ms>        Extra uniform jitter +-ms (default: 0)" << std::endl;
+    std::cout << "  --drop-rate <0..1>      Fraction of commands left unanswered (default: 0)" << std::endl;
+    std::cout << "  --error-rate <0..1>     Fraction of replies with result error (default: 0)" << std::endl;
+    std::cout << "  --event-rate <per sec>  Unsolicited events per second per MSC (default: 0)" << std::endl;
+    std::cout << "  --reply-host <ip>       Reply address when local_address is 0.0.0.0 (default: 127.0.0.1)" << std::endl;
+    std::cout << "  --seed <n>              Random seed, 0 for random (default: 0)" << std::endl;
+    std::cout << "  --help                  Show this help" << std::endl;
+    std::cout << "\nExamples:" << std::endl;
+    std::cout << "  " << program_name << " --latency lognormal --latency-ms 5 --stddev-ms 3 --drop-rate 0.01" << std::endl;
+    std::cout << "  " << program_name << " --latency-ms 20000 --event-rate 100" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    SimulatorSettings settings;
+
+    // Парсим аргументы командной строки
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc && std::string(argv[i]) != "--help") {
+            std::cerr << "❌ Missing value for " << argv[i] << std::endl;
+            return 1;
+        }
+
+        std::string arg = argv[i];
+
+        if (arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else if (arg == "--config") {
+            settings.config_path = argv[i + 1];
+        } else if (arg == "--latency") {
+            std::string name = argv[i + 1];
+            if (name == "fixed") {
+                settings.distribution = LatencyDistribution::fixed;
+            } else if (name == "uniform") {
+                settings.distribution = LatencyDistribution::uniform;
+            } else if (name == "normal") {
+                settings.distribution = LatencyDistribution::normal;
+            } else if (name == "exponential") {
+                settings.distribution = LatencyDistribution::exponential;
+            } else if (name == "lognormal") {
+                settings.distribution = LatencyDistribution::lognormal;
+            } else {
+                std::cerr << "❌ Unknown latency distribution: " << name << std::endl;
+                return 1;
+            }
+        } else if (arg == "--latency-ms") {
+            settings.latency_ms = std::stod(argv[i + 1]);
+        } else if (arg == "--stddev-ms") {
+            settings.stddev_ms = std::stod(argv[i + 1]);
+        } else if (arg == "--jitter-ms") {
+            settings.jitter_ms = std::stod(argv[i + 1]);
+        } else if (arg == "--drop-rate") {
+            settings.drop_rate = std::stod(argv[i + 1]);
+        } else if (arg == "--error-rate") {
+            settings.error_rate = std::stod(argv[i + 1]);
+        } else if (arg == "--event-rate") {
+            settings.event_rate = std::stod(argv[i + 1]);
+        } else if (arg == "--reply-host") {
+            settings.reply_host = argv[i + 1];
+        } else if (arg == "--seed") {
+            settings.seed = std::stoull(argv[i + 1]);
+        } else {
+            std::cerr << "❌ Unknown option: " << arg << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (settings.latency_ms < 0 || settings.stddev_ms < 0 || settings.jitter_ms < 0 ||
+        settings.drop_rate < 0 || settings.drop_rate > 1 ||
+        settings.error_rate < 0 || settings.error_rate > 1 || settings.event_rate < 0) {
+        std::cerr << "❌ Latencies and rates must be non-negative, drop and error rates within [0, 1]" << std::endl;
+        return 1;
+    }
+
+    auto config = ConfigParser::parse(settings.config_path, false);
+    if (!config) {
+        return 1;
+    }
+
+    std::signal(SIGINT, handle_signal);
+    std::signal(SIGTERM, handle_signal);
+
+    MscSimulator simulator(settings);
+    if (!simulator.setup(*config)) {
+        return 1;
+    }
+    std::cout << "🚀 MSC simulator started, Ctrl+C to stop" << std::endl;
+    simulator.run();
+    return 0;
+}
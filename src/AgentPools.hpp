@@ -0,0 +1,85 @@
+#ifndef AGENT_POOLS_H
+#define AGENT_POOLS_H
+
+#include "CpuAffinity.hpp"
+#include "JsonParser.hpp"
+#include "Log.hpp"
+
+#include <so_5/all.hpp>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+// Пулы потоков агентов по секции threading конфига. Диспетчер пула
+// создается при первой кооперации, которая на него попала, поэтому пулы без
+// агентов не держат потоков. Агенты одной роли регистрируются отдельной
+// кооперацией на пуле этой роли.
+//
+// Потоки диспетчеров создаются внутри SObjectizer: пулы - при создании
+// диспетчера, active_obj - при регистрации агента. В обоих случаях это
+// происходит в вызывающем потоке под ScopedAffinity, и рабочие потоки
+// наследуют привязку пула к CPU.
+class AgentPools {
+public:
+  AgentPools(so_5::environment_t &env, const ThreadingSettings &settings)
+      : env_(env), settings_(settings) {}
+
+  AgentPools(const AgentPools &) = delete;
+  AgentPools &operator=(const AgentPools &) = delete;
+
+  // Регистрирует кооперацию, которую заполняет fill(coop_t&), на пуле роли
+  template <typename F> so_5::coop_handle_t introduce(const std::string &role,
+                                                      F &&fill) {
+    const AgentPoolSettings &pool = pool_for(role);
+    std::string what = "пула " + pool.name;
+    ScopedAffinity affinity(pool.pinning, what.c_str());
+    return env_.introduce_coop(binder(pool), std::forward<F>(fill));
+  }
+
+  const AgentPoolSettings &pool_for(const std::string &role) const {
+    // Роли и пулы проверены при разборе конфига
+    return *settings_.find_pool(settings_.bindings.at(role));
+  }
+
+private:
+  so_5::disp_binder_shptr_t binder(const AgentPoolSettings &pool) {
+    auto it = binders_.find(pool.name);
+    if (it != binders_.end())
+      return it->second;
+
+    so_5::disp_binder_shptr_t result;
+    switch (pool.type) {
+    case DispatcherType::adv_thread_pool: {
+      using namespace so_5::disp::adv_thread_pool;
+      auto disp = pool.threads > 0
+                      ? make_dispatcher(env_, static_cast<size_t>(pool.threads))
+                      : make_dispatcher(env_);
+      result = disp.binder(bind_params_t{}.fifo(fifo_t::individual));
+      break;
+    }
+    case DispatcherType::thread_pool: {
+      using namespace so_5::disp::thread_pool;
+      auto disp = pool.threads > 0
+                      ? make_dispatcher(env_, static_cast<size_t>(pool.threads))
+                      : make_dispatcher(env_);
+      result = disp.binder(bind_params_t{}.fifo(fifo_t::individual));
+      break;
+    }
+    case DispatcherType::active_obj:
+      result = so_5::disp::active_obj::make_dispatcher(env_).binder();
+      break;
+    case DispatcherType::one_thread:
+      result = so_5::disp::one_thread::make_dispatcher(env_).binder();
+      break;
+    }
+    LOG_DEBUG("Создан пул " << pool.to_string());
+    binders_.emplace(pool.name, result);
+    return result;
+  }
+
+  so_5::environment_t &env_;
+  const ThreadingSettings &settings_;
+  std::unordered_map<std::string, so_5::disp_binder_shptr_t> binders_;
+};
+
+#endif
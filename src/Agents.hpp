@@ -3,12 +3,18 @@
 
 #include "CommandQueue.hpp"
 #include "JsonParser.hpp"
+#include "Lifecycle.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
 #include "Messages.hpp"
+#include "MscDirectory.hpp"
 #include "NetworkUtils.hpp"
+#include "PayloadParser.hpp"
+#include "PendingRequests.hpp"
 #include <algorithm>
 #include <chrono>
+#include <deque>
 #include <fcntl.h>
-#include <iostream>
 #include <memory>
 #include <netinet/in.h>
 #include <nlohmann/json.hpp>
@@ -19,13 +25,13 @@
 #include <unordered_map>
 #include <vector>
 
-#define DEBUG
-
 using json = nlohmann::json;
 
 class FinalResponseAgent final : public so_5::agent_t {
 private:
   bool test_mode_;
+  // Сокет для ответов клиентам
+  UdpSender sender_;
 
 public:
   FinalResponseAgent(so_5::agent_context_t ctx) : so_5::agent_t(ctx) {}
@@ -34,17 +40,22 @@ public:
         [this](so_5::mhood_t<FinalResponse> msg) { send_final_response(msg); });
   }
 
-  void so_evt_start() { std::cout << "[FinalResponseAgent] started\n"; }
+  void so_evt_start() { LOG_INFO("[FinalResponseAgent] started"); }
 
   void so_evt_finish() {}
 
 private:
   // Отправка финального ответа клиенту
   void send_final_response(so_5::mhood_t<FinalResponse> msg) {
-    send_udp(msg->destination, msg->response_json);
-#ifdef DEBUG
-    std::cout << "[Final Responser] Final response sent" << std::endl;
-#endif
+    auto start = std::chrono::steady_clock::now();
+    sender_.send(msg->destination, msg->response_json);
+    auto sent = std::chrono::steady_clock::now();
+    metrics().final_send.record(sent - start);
+    if (msg->trace) {
+      msg->trace->final_sent = sent;
+      tracer().complete(msg->trace);
+    }
+    LOG_DEBUG("[Final Responser] Final response sent");
   }
 };
 
@@ -58,124 +69,163 @@ private:
   bool test_mode_;
   // MailBox диспатчера
   so_5::mbox_t dispatcher_mbox_;
-  // Таймер для периодической проверки очереди
-  so_5::timer_id_t timer_;
+  // Сколько пакетов разбираем за одно событие ProcessQueue
+  size_t batch_size_;
   // Счетчик запросов для уникальных ID
   uint64_t request_counter_ = 0;
+  // Учет принятых, но еще не завершенных запросов
+  InflightTracker &inflight_;
+  // Адрес для предварительных ответов, разбирается один раз
+  sockaddr_in remote_addr_;
+  // Сокет для предварительных ответов и ошибок валидации
+  UdpSender sender_;
+  // Разбор команд без построения DOM (или через DOM, см. "parser")
+  PayloadParser parser_;
 
 public:
   CommandIngressAgent(so_5::agent_context_t ctx, CommandQueue &queue,
                       const Config &config, bool test_mode,
-                      so_5::mbox_t dispatcher_mbox)
+                      so_5::mbox_t dispatcher_mbox, InflightTracker &inflight)
       : so_5::agent_t(ctx), queue_(queue), config_(config),
-        test_mode_(test_mode), dispatcher_mbox_(dispatcher_mbox) {}
+        test_mode_(test_mode), dispatcher_mbox_(dispatcher_mbox),
+        batch_size_(config.cmd.agent_settings
+                        ? config.cmd.agent_settings->batch_size
+                        : AgentSettings{}.batch_size),
+        inflight_(inflight),
+        remote_addr_(parse_address(config.cmd.remote_address)),
+        parser_(config.parser) {}
 
   void so_define_agent() override {
-    // Подписка на сигнал обработки сообщений + финальный ответ
+    // Сигнал ProcessQueue присылает epoll поток, когда в очереди появились
+    // пакеты
     so_subscribe_self().event(
         [this](so_5::mhood_t<ProcessQueue>) { process_queue(); });
   }
 
   void so_evt_start() override {
-    // Каждые 10 миллисекунд с паузой 0 смотреть очередь на сообщения
-    timer_ = so_5::send_periodic<ProcessQueue>(
-        *this, std::chrono::milliseconds(0), std::chrono::milliseconds(10));
-#ifdef DEBUG
-    std::cout << "[INGRESS] Agent started" << std::endl;
-#endif
-  }
-
-  void so_evt_finish() override {
-    // Освобождаем таймер при завершении
-    timer_.release();
+    // Уведомление могло прийти до подписки, поэтому один раз разбираем
+    // очередь сами
+    so_5::send<ProcessQueue>(*this);
+    LOG_DEBUG("[INGRESS] Agent started");
   }
 
 private:
-  // Код обработки пакетов из очереди
+  // Разбор накопившихся пакетов, не больше batch_size_ за одно событие
   void process_queue() {
-    // Достаем пакет из очереди
-    auto pkt_opt = queue_.pop();
-    if (!pkt_opt)
-      return;
-
-    const Packet &pkt = pkt_opt.value();
-    try {
-      // Парсим json
-      json j =
-          json::parse(std::string(pkt.buf.begin(), pkt.buf.begin() + pkt.len));
-
-      // Если нет command кидаем runtime_error
-      if (!j.is_object() || !j.contains("command") ||
-          !j["command"].is_string()) {
-        throw std::runtime_error("Invalid format or missing 'command' field");
-      }
+    queue_.clear_wakeup();
+
+    size_t processed = 0;
+    while (processed < batch_size_) {
+      auto pkt_opt = queue_.try_pop();
+      if (!pkt_opt)
+        break;
+      process_packet(*pkt_opt);
+      ++processed;
+    }
+    sender_.flush();
 
-      // Отправляем на remove предварительное сообщение
-      send_udp(
-          parse_address(config_.cmd.remote_address),
-          R"({"status":"accepted","message":"Command received for processing"})");
+    // Очередь не опустела, продолжаем следующим событием, чтобы не занимать
+    // поток диспетчера надолго
+    if (processed == batch_size_ && !queue_.empty() &&
+        queue_.request_wakeup()) {
+      so_5::send<ProcessQueue>(*this);
+    }
+  }
 
-      if (test_mode_) {
-        std::cout << "[INGRESS] Test-mode JSON:\n" << j.dump(4) << std::endl;
-      }
+  // Валидация одного пакета и передача команды диспетчеру
+  void process_packet(const Packet &pkt) {
+    auto parse_start = std::chrono::steady_clock::now();
+    metrics().ingress_queue_wait.record(parse_start - pkt.timestamp);
+
+    // Проверяем JSON прямо в буфере пула, DOM не строится
+    CommandFields fields;
+    std::string error_text;
+    bool valid = parser_.parse_command(pkt.data(), pkt.len, fields, error_text);
+    auto validated_at = std::chrono::steady_clock::now();
+    metrics().ingress_parse.record(validated_at - parse_start);
+    if (!valid) {
+      metrics().ingress_rejected.add();
+      // Отвечаем клиенту об ошибке валидации
+      json error = {{"error", "validation_failed"}, {"message", error_text}};
+      sender_.enqueue(pkt.sender_addr, error.dump());
+      LOG_ERROR("[INGRESS] Validation failed: " << error_text);
+      return;
+    }
 
-      // Генерируем простой ID запроса
-      std::string request_id = "req_" + std::to_string(++request_counter_);
+    // Отправляем на remote предварительное сообщение
+    sender_.enqueue(
+        remote_addr_,
+        R"({"status":"accepted","message":"Command received for processing"})");
+
+    if (test_mode_) {
+      // Без исключений: строгий разбор уже прошел, а падать из-за
+      // отладочного вывода нельзя
+      json j = json::parse(pkt.data(), pkt.data() + pkt.len, nullptr, false);
+      if (!j.is_discarded())
+        LOG_INFO("[INGRESS] Test-mode JSON:\n" << j.dump(4));
+    }
 
-      // Отправка Валидированной комманды
-      so_5::send<ValidatedCommand>(dispatcher_mbox_, std::move(j),
-                                   pkt.sender_addr, request_id);
+    metrics().ingress_commands.add();
 
-#ifdef DEBUG
-      std::cout << "[INGRESS] Command forwarded: " << request_id << std::endl;
-#endif
+    // Генерируем ID запроса, строковая форма нужна только на выходе
+    RequestId request_id = ++request_counter_;
 
-    } catch (const std::exception &e) {
-      // Отвечаем клиенту об ошибке валидации
-      json error = {{"error", "validation_failed"}, {"message", e.what()}};
-      send_udp(pkt.sender_addr, error.dump());
-      std::cerr << "[INGRESS] Validation failed: " << e.what() << std::endl;
+    auto trace = tracer().maybe_start(request_id, pkt.timestamp);
+    if (trace) {
+      trace->dequeued = parse_start;
+      trace->validated = validated_at;
     }
+
+    // Отправка Валидированной комманды: исходный текст уходит как есть,
+    // только request_id заменяется идентификатором шлюза, по нему MSC
+    // отвечает
+    auto payload = make_msc_payload(pkt.data(), pkt.len,
+                                    fields.request_id_offset,
+                                    fields.request_id_length,
+                                    request_id_to_wire(request_id));
+    inflight_.begin();
+    so_5::send<ValidatedCommand>(dispatcher_mbox_, std::move(payload),
+                                 std::move(fields.target),
+                                 std::move(fields.client_request_id),
+                                 pkt.sender_addr, request_id,
+                                 std::move(trace));
+
+    LOG_DEBUG("[INGRESS] Command forwarded: " << request_id);
   }
 };
 
 class CommandDispatcherAgent final : public so_5::agent_t {
 private:
-  // Структура для отслеживания ожидающих запросов
-  struct PendingRequest {
-    std::vector<std::string> waiting_for; // Агенты от которых ждем ответ
-    std::vector<json> responses;          // Полученные ответы
-    sockaddr_in original_sender;          // Адрес оригинального отправителя
-    std::chrono::steady_clock::time_point start_time; // Время начала обработки
-  };
-
-  // Json конфиг
-  const Config &config_;
-  // MailBoxы MSC агентов
-  std::unordered_map<std::string, so_5::mbox_t> msc_mboxes_;
+  // Текущие MSC агенты, меняются при перечитывании конфига
+  const MscDirectory &msc_directory_;
   // MailBox Ingress агента
   so_5::mbox_t ingress_mbox_;
-  // Мапа ожидающих запросов по их ID
-  std::unordered_map<std::string, PendingRequest> pending_requests_;
+  // Ожидающие запросы по их ID. Обработчики работают на нескольких потоках
+  // пула одновременно, таблица сама синхронизирует доступ
+  PendingRequestTable pending_requests_;
   // Таймер для проверки таймаутов
   so_5::timer_id_t check_timer_;
+  // Учет принятых, но еще не завершенных запросов
+  InflightTracker &inflight_;
+
+  // Оценка размера одного ответа агента для предвыделения буфера
+  static constexpr size_t kReplySizeHint = 128;
 
 public:
-  CommandDispatcherAgent(so_5::agent_context_t ctx, const Config &config)
-      : so_5::agent_t(ctx), config_(config) {}
+  // Таймауты агентов приходят с каждым запросом из снимка MscDirectory,
+  // своих у таблицы нет
+  CommandDispatcherAgent(so_5::agent_context_t ctx,
+                         const MscDirectory &msc_directory,
+                         InflightTracker &inflight)
+      : so_5::agent_t(ctx), msc_directory_(msc_directory),
+        pending_requests_(AgentTimeouts{}), inflight_(inflight) {}
 
   // Установка правильных MailBox.
   // Почему то при создании глабольного в main а после прокидывании все идет
   // максимально коряво
-  void set_links(std::unordered_map<std::string, so_5::mbox_t> msc_mboxes,
-                 so_5::mbox_t ingress_mbox) {
-    msc_mboxes_ = std::move(msc_mboxes);
+  void set_links(so_5::mbox_t ingress_mbox) {
     ingress_mbox_ = ingress_mbox;
-
-#ifdef DEBUG
-    std::cout << "[DISPATCHER] Linked with " << msc_mboxes_.size()
-              << " MSC agents" << std::endl;
-#endif
+    LOG_DEBUG("[DISPATCHER] Linked");
   }
 
   void so_define_agent() override {
@@ -191,16 +241,15 @@ public:
               handle_agent_reply(reply);
             },
             so_5::thread_safe)
-        .event([this](so_5::mhood_t<CheckResponses>) { check_timeouts(); });
+        .event([this](so_5::mhood_t<CheckResponses>) { check_timeouts(); },
+               so_5::thread_safe);
   }
 
   void so_evt_start() override {
-    // Каждые 100мс проверяем таймауты запросов
+    // Каждые 10мс проверяем таймауты запросов
     check_timer_ = so_5::send_periodic<CheckResponses>(
         *this, std::chrono::milliseconds(0), std::chrono::milliseconds(10));
-#ifdef DEBUG
-    std::cout << "[DISPATCHER] Agent started" << std::endl;
-#endif
+    LOG_DEBUG("[DISPATCHER] Agent started");
   }
 
   void so_evt_finish() override {
@@ -211,221 +260,398 @@ public:
 private:
   // Обработка валидированной команды от Ingress агента
   void handle_validated_command(so_5::mhood_t<ValidatedCommand> msg) {
-    std::vector<std::string> targets;
-    std::string target = msg->cmd.value("target", "");
+    auto start = std::chrono::steady_clock::now();
+    std::vector<AgentIndex> targets;
+    const std::string &target = msg->target;
+    // Один снимок на всю рассылку: перечитывание конфига посреди нее не
+    // разводит адресатов и таймауты
+    auto msc = msc_directory_.current();
 
     // Определяем целевые агенты для отправки команды
     if (target == "all") {
       // Отправляем всем доступным MSC агентам
-      for (auto &[id, _] : msc_mboxes_) {
-        targets.push_back(id);
-      }
-    } else if (!target.empty() && msc_mboxes_.count(target)) {
+      for (const auto &agent : msc->agents)
+        targets.push_back(agent.index);
+    } else if (auto index = msc->find(target)) {
       // Отправляем конкретному MSC агенту
-      targets.push_back(target);
+      targets.push_back(*index);
     } else {
       // Целевой агент не найден - отвечаем ошибкой
-      std::cerr << "[DISPATCHER] Invalid target: " << target << std::endl;
+      LOG_ERROR("[DISPATCHER] Invalid target: " << target);
       so_5::send<FinalResponse>(
           ingress_mbox_,
           R"({"error":"invalid_target","message":"Target not found"})",
           msg->original_sender);
+      inflight_.end();
+      metrics().dispatch_errors.add();
       return;
     }
 
     if (targets.empty()) {
-      std::cerr << "[DISPATCHER] No targets found" << std::endl;
+      LOG_ERROR("[DISPATCHER] No targets found");
       so_5::send<FinalResponse>(
           ingress_mbox_,
           R"({"error":"no_targets","message":"No valid targets found"})",
           msg->original_sender);
+      inflight_.end();
+      metrics().dispatch_errors.add();
       return;
     }
 
     // Создаем запись для отслеживания ответов
-    PendingRequest &pending = pending_requests_[msg->request_id];
-    pending.waiting_for = targets;
+    PendingRequest pending;
+    pending.waiting_for = AgentSet(msc->mboxes.size());
+    for (AgentIndex target_index : targets) {
+      pending.waiting_for.set(target_index);
+    }
     pending.original_sender = msg->original_sender;
-    pending.start_time = std::chrono::steady_clock::now();
-
-    // Отправляем команды всем целевым агентам
-    for (const auto &target_id : targets) {
-      so_5::send<SubCommand>(msc_mboxes_[target_id], msg->cmd, msg->request_id,
-                             target_id);
+    pending.start_time = start;
+    pending.agent_timeouts = msc->timeouts;
+    pending.trace = msg->trace;
+    if (pending.trace)
+      pending.trace->dispatch_start = start;
+    pending.response.begin(request_id_to_wire(msg->request_id),
+                           64 + targets.size() * kReplySizeHint,
+                           msg->client_request_id);
+    // Отметку рассылки ставим до insert: после него ответ может прийти на
+    // другом потоке пула и трасса уже будет читаться
+    if (msg->trace)
+      msg->trace->dispatched = std::chrono::steady_clock::now();
+    pending_requests_.insert(msg->request_id, std::move(pending));
+
+    // Отправляем команды всем целевым агентам. Все SubCommand ссылаются на
+    // один и тот же буфер, команда не копируется и не сериализуется заново
+    for (AgentIndex target_index : targets) {
+      so_5::send<SubCommand>(msc->mboxes[target_index], msg->payload,
+                             msg->request_id, target_index);
     }
 
-#ifdef DEBUG
-    std::cout << "[DISPATCHER] Command dispatched to " << targets.size()
-              << " agents: " << msg->request_id << std::endl;
-#endif
+    metrics().dispatched_commands.add();
+    metrics().dispatch_fanout.record(std::chrono::steady_clock::now() - start);
+
+    LOG_DEBUG("[DISPATCHER] Command dispatched to " << targets.size()
+              << " agents: " << msg->request_id);
   }
 
   // Обработка ответа от MSC агента
   void handle_agent_reply(so_5::mhood_t<AgentReply> reply) {
-    auto it = pending_requests_.find(reply->request_id);
-    if (it == pending_requests_.end()) {
+    auto msc = msc_directory_.current();
+    if (reply->agent >= msc->id_json.size())
       return;
-    }
 
-    PendingRequest &pending = it->second;
-
-    // Добавляем информацию об агенте к ответу
-    json response_with_agent = reply->response;
-    response_with_agent["agent_id"] = reply->agent_id;
-    response_with_agent["success"] = reply->success;
-    pending.responses.push_back(response_with_agent);
-
-    // Убираем агента из списка ожидания
-    auto waiting_it = std::find(pending.waiting_for.begin(),
-                                pending.waiting_for.end(), reply->agent_id);
-    if (waiting_it != pending.waiting_for.end()) {
-      pending.waiting_for.erase(waiting_it);
-    }
-
-    // Если получили все ответы - отправляем финальный ответ
-    if (pending.waiting_for.empty()) {
-      send_final_response(reply->request_id);
+    // Ответ дописывается в буфер финального ответа вместе с agent_id и
+    // success. Если получили все ответы - отправляем финальный ответ
+    auto now = std::chrono::steady_clock::now();
+    auto completed = pending_requests_.add_reply(
+        reply->request_id, reply->agent, reply->payload,
+        msc->id_json[reply->agent], reply->success,
+        [&](PendingRequest &pending) {
+          metrics().msc_round_trip.record(now - pending.start_time);
+          if (pending.trace) {
+            pending.trace->legs.push_back({reply->agent, reply->msc_sent,
+                                           reply->msc_received, now, false});
+          }
+        });
+    if (completed) {
+      send_final_response_safe(reply->request_id, *completed);
     }
   }
 
   // Проверка таймаутов для ожидающих запросов
   void check_timeouts() {
-    auto now = std::chrono::steady_clock::now();
+    auto expired =
+        pending_requests_.take_expired(std::chrono::steady_clock::now());
 
-    for (auto it = pending_requests_.begin(); it != pending_requests_.end();) {
-      auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
-                         now - it->second.start_time)
-                         .count();
-
-      if (elapsed >= config_.cmd.response_timeout_ms) {
-        // Запрос превысил таймаут
-        std::string request_id = it->first;
-        PendingRequest pending = it->second;
-
-#ifdef DEBUG
-        std::cout << "[DISPATCHER] Timeout: " << request_id << std::endl;
-#endif
+    for (auto &[request_id, pending] : expired) {
+      LOG_DEBUG("[DISPATCHER] Timeout: " << request_id);
+      send_final_response_safe(request_id, pending);
+    }
+  }
 
-        // Добавляем ошибки таймаута для не ответивших агентов
-        for (const std::string &missing_agent : pending.waiting_for) {
-          json timeout_response;
-          timeout_response["error"] = "timeout";
-          timeout_response["agent_id"] = missing_agent;
-          timeout_response["success"] = false;
-          pending.responses.push_back(timeout_response);
-        }
-
-        it = pending_requests_.erase(it);
-        send_final_response_safe(request_id, pending);
-      } else {
-        ++it;
+  // Отправка финального ответа по запросу, уже извлечённому из таблицы
+  void send_final_response_safe(RequestId request_id,
+                                PendingRequest &pending) {
+    // Добавляем ошибки таймаута для не ответивших агентов. Номер удаленного
+    // агента не отдается другому, пока его запросы не истекли, поэтому id в
+    // текущем снимке еще его
+    auto msc = pending.timed_out.empty() ? nullptr : msc_directory_.current();
+    for (AgentIndex missing_agent : pending.timed_out) {
+      pending.response.append_timeout(msc->id_json[missing_agent]);
+      if (pending.trace) {
+        TraceLeg leg;
+        leg.agent = missing_agent;
+        leg.timed_out = true;
+        pending.trace->legs.push_back(leg);
       }
     }
-  }
+    if (pending.trace)
+      pending.trace->final_built = std::chrono::steady_clock::now();
 
-  // Отправка финального ответа (безопасный вариант)
-  void send_final_response(const std::string &request_id) {
-    auto it = pending_requests_.find(request_id);
-    if (it == pending_requests_.end())
-      return;
+    // Ответ уже собран, буфер уходит без копирования
+    so_5::send<FinalResponse>(ingress_mbox_, pending.response.finish(),
+                              pending.original_sender, pending.trace);
+    inflight_.end();
 
-    // Копируем данные перед удалением записи
-    PendingRequest pending = it->second;
-    pending_requests_.erase(it);
+    metrics().msc_timeouts.add(pending.timed_out.size());
+    metrics().final_responses.add();
+    metrics().request_total.record(std::chrono::steady_clock::now() -
+                                   pending.start_time);
 
-    send_final_response_safe(request_id, pending);
+    LOG_DEBUG("[DISPATCHER] Final response prepared: " << request_id);
   }
+};
 
-  // Безопасная отправка финального ответа с уже скопированными данными
-  void send_final_response_safe(const std::string &request_id,
-                                const PendingRequest &pending) {
-    json final_response;
-    final_response["status"] = "completed";
-    final_response["request_id"] = request_id;
-    final_response["responses"] = pending.responses;
-
-    so_5::send<FinalResponse>(ingress_mbox_, final_response.dump(),
-                              pending.original_sender);
+// Отправка команд в MSC пачками из очереди MscEgress
+class MscEgressAgent final : public so_5::agent_t {
+public:
+  MscEgressAgent(so_5::agent_context_t ctx, MscEgress &egress)
+      : so_5::agent_t(ctx), egress_(egress) {}
 
-#ifdef DEBUG
-    std::cout << "[DISPATCHER] Final response prepared: " << request_id
-              << std::endl;
-#endif
+  void so_define_agent() override {
+    so_subscribe_self().event(
+        [this](so_5::mhood_t<FlushMscEgress>) { egress_.flush(); });
   }
+
+private:
+  MscEgress &egress_;
 };
 
 class MscAgent final : public so_5::agent_t {
 private:
-  const MscAgentSettings &settings_;
+  // Команда, отправленная во внешнюю систему и ожидающая ответа
+  struct InFlight {
+    TracePoint sent;
+    Clock::time_point deadline;
+  };
+  // Команда, ожидающая места в окне
+  struct Waiting {
+    SharedPayload payload;
+    RequestId request_id;
+    Clock::time_point deadline;
+  };
+
+  // Копия: при перечитывании конфига настройки меняет ReconfigureMsc
+  MscAgentSettings settings_;
   so_5::mbox_t broadcaster_;
   so_5::mbox_t dispatcher_mbox_;
+  // Адрес внешней системы, разбирается один раз
+  sockaddr_in remote_addr_;
+  // Очередь команд во внешнюю систему, общая для всех агентов MSC
+  MscEgress &egress_;
+  // Разбор входящих пакетов без построения DOM
+  PayloadParser parser_;
+  // Окно: сколько команд одновременно ждут ответа MSC. Столько же может
+  // ждать места в окне, остальные получают отказ сразу
+  size_t window_;
+  // Сколько ждать ответа, после этого место в окне освобождается
+  std::chrono::milliseconds timeout_;
+  std::unordered_map<RequestId, InFlight> in_flight_;
+  std::deque<Waiting> backlog_;
+  // Взведена ли отложенная проверка окна
+  bool expiry_armed_ = false;
 
 public:
   MscAgent(so_5::agent_context_t ctx, const MscAgentSettings &settings,
-           so_5::mbox_t broadcaster_mbox, so_5::mbox_t dispatcher_mbox,
-           CommandQueue &msc_queue)
+           ParserMode parser_mode, so_5::mbox_t broadcaster_mbox,
+           so_5::mbox_t dispatcher_mbox, MscEgress &egress)
       : so_5::agent_t(ctx), settings_(settings), broadcaster_(broadcaster_mbox),
-        dispatcher_mbox_(dispatcher_mbox) {}
+        dispatcher_mbox_(dispatcher_mbox),
+        remote_addr_(parse_address(settings.remote_address)), egress_(egress),
+        parser_(parser_mode), window_(window_size(settings)),
+        timeout_(settings.response_timeout_ms) {}
 
   void so_define_agent() override {
     so_subscribe_self()
         .event(&MscAgent::handle_command)
-        .event(&MscAgent::process_incoming_packets);
+        .event(&MscAgent::process_incoming_packets)
+        .event(&MscAgent::reconfigure)
+        .event([this](so_5::mhood_t<CheckMscWindow>) { check_window(); });
   }
 
   void so_evt_start() override {
-#ifdef DEBUG
-    std::cout << "[MSC-" << settings_.id << "] Agent started" << std::endl;
-#endif
+    LOG_DEBUG("[MSC-" << settings_.id << "] Agent started, window "
+              << window_);
   }
 
-  void so_evt_finish() override {}
+  // Агент удален из конфига или шлюз останавливается. Команды в окне и в
+  // очереди ответа уже не получат, диспетчер узнает об этом сразу, а не по
+  // таймауту
+  void so_evt_finish() override {
+    for (const auto &[request_id, entry] : in_flight_)
+      reply_stopped(request_id);
+    for (const auto &waiting : backlog_)
+      reply_stopped(waiting.request_id);
+    in_flight_.clear();
+    backlog_.clear();
+  }
 
 private:
+  static size_t window_size(const MscAgentSettings &settings) {
+    return std::max(settings.agent_settings
+                        ? settings.agent_settings->queue_size
+                        : AgentSettings{}.queue_size,
+                    1);
+  }
+
+  // Новые адрес, окно и таймаут того же MSC. Команды, уже отправленные в
+  // MSC, дожидаются ответа по своим дедлайнам. Если окно сузилось, новые
+  // команды ждут, пока в нем не освободится место
+  void reconfigure(const so_5::mhood_t<ReconfigureMsc> &msg) {
+    AgentIndex index = settings_.index;
+    settings_ = msg->settings;
+    settings_.index = index;
+    remote_addr_ = parse_address(settings_.remote_address);
+    window_ = window_size(settings_);
+    timeout_ = std::chrono::milliseconds(settings_.response_timeout_ms);
+    LOG_INFO("[MSC-" << settings_.id << "] Reconfigured: "
+             << settings_.to_string());
+    pump_backlog();
+    arm_expiry();
+  }
+
+  void reply_stopped(RequestId request_id) {
+    so_5::send<AgentReply>(
+        dispatcher_mbox_,
+        R"({"error":"msc_stopped","message":"MSC agent stopped"})",
+        request_id, settings_.index, false);
+  }
+
   void handle_command(const so_5::mhood_t<SubCommand> &msg) {
-    // Отправляем команду во внешнюю систему используя общую функцию send_udp
-    sockaddr_in remote = parse_address(settings_.remote_address);
-    std::string body = msg->sub_cmd.dump();
-    send_udp(remote, body);
-#ifdef DEBUG
-    std::cout << "[MSC-" << settings_.id << "] Command sent to external system"
-              << std::endl;
-#endif
+    auto deadline = Clock::now() + timeout_;
+    if (in_flight_.size() < window_ && backlog_.empty()) {
+      send_to_msc(msg->payload, msg->request_id, deadline);
+      return;
+    }
+    if (backlog_.size() < window_) {
+      // Окно занято: команда ждет, пока MSC ответит на одну из отправленных
+      backlog_.push_back({msg->payload, msg->request_id, deadline});
+      metrics().msc_backlogged.add();
+      arm_expiry();
+      return;
+    }
 
+    // Окно и очередь полны: отказываем сразу, не дожидаясь таймаута, чтобы
+    // медленная MSC не копила память и не получала лишнюю нагрузку
+    metrics().msc_rejected.add();
+    LOG_WARN("[MSC-" << settings_.id << "] Window full, command rejected: "
+             << msg->request_id);
     so_5::send<AgentReply>(
         dispatcher_mbox_,
-        json{{"result", "success"}, {"message", "Command processed"}},
-        msg->request_id, settings_.id, true);
+        R"({"error":"msc_overloaded","message":"MSC in-flight window is full"})",
+        msg->request_id, settings_.index, false);
   }
 
-  void process_incoming_packets(const so_5::mhood_t<Packet> pkt) {
-    try {
-      std::string data_str(pkt->buf.begin(), pkt->buf.begin() + pkt->len);
-      json data = json::parse(data_str);
+  // Команда во внешнюю систему уходит через общую очередь отправки, буфер
+  // команды не копируется
+  void send_to_msc(const SharedPayload &payload, RequestId request_id,
+                   Clock::time_point deadline) {
+    egress_.send(remote_addr_, payload);
+    in_flight_[request_id] = InFlight{Clock::now(), deadline};
+    arm_expiry();
+    LOG_DEBUG("[MSC-" << settings_.id << "] Command queued for external "
+              "system: " << request_id);
+  }
 
-      if (data.contains("request_id")) {
-        // Синхронный ответ на команду → dispatcher
-        std::string request_id = data["request_id"];
+  // Освободившиеся места в окне занимают команды из очереди ожидания
+  void pump_backlog() {
+    while (in_flight_.size() < window_ && !backlog_.empty()) {
+      Waiting next = std::move(backlog_.front());
+      backlog_.pop_front();
+      send_to_msc(next.payload, next.request_id, next.deadline);
+    }
+  }
 
-        so_5::send<AgentReply>(dispatcher_mbox_, data, request_id, settings_.id,
-                               true); // Почему то не работает надо разобраться
+  // Проверка окна взводится только пока есть команды в окне или очереди,
+  // на ближайший дедлайн. Простаивающий агент таймеров не получает
+  void arm_expiry() {
+    if (expiry_armed_ || (in_flight_.empty() && backlog_.empty()))
+      return;
+    auto next = Clock::time_point::max();
+    for (const auto &[id, entry] : in_flight_)
+      next = std::min(next, entry.deadline);
+    if (!backlog_.empty())
+      next = std::min(next, backlog_.front().deadline);
+    auto delay = std::max(
+        std::chrono::duration_cast<std::chrono::milliseconds>(next -
+                                                              Clock::now()),
+        std::chrono::milliseconds(1));
+    so_5::send_delayed<CheckMscWindow>(*this, delay);
+    expiry_armed_ = true;
+  }
 
-#ifdef DEBUG
-        std::cout << "[MSC-" << settings_.id
-                  << "] Sync response forwarded: " << request_id << std::endl;
-#endif
+  // Команды без ответа к дедлайну освобождают окно. Диспетчер к этому
+  // моменту уже ответил клиенту таймаутом
+  void check_window() {
+    expiry_armed_ = false;
+    auto now = Clock::now();
+    for (auto it = in_flight_.begin(); it != in_flight_.end();) {
+      if (it->second.deadline <= now) {
+        metrics().msc_expired.add();
+        it = in_flight_.erase(it);
       } else {
-        so_5::send<Event>(broadcaster_, data); // Работает шикарно)
-
-#ifdef DEBUG
-        std::cout << "[MSC-" << settings_.id << "] Async event forwarded: "
-                  << data.value("event", "unknown") << std::endl;
-#endif
+        ++it;
       }
+    }
+    // Дедлайны в очереди идут по порядку поступления
+    while (!backlog_.empty() && backlog_.front().deadline <= now) {
+      metrics().msc_expired.add();
+      backlog_.pop_front();
+    }
+    pump_backlog();
+    arm_expiry();
+  }
 
-    } catch (const std::exception &e) {
-      std::cerr << "[MSC-" << settings_.id << "] Parse error: " << e.what()
-                << std::endl;
+  void process_incoming_packets(const so_5::mhood_t<Packet> pkt) {
+    std::string wire_id;
+    std::string error;
+    switch (parser_.parse_msc_packet(pkt->data(), pkt->len, wire_id, error)) {
+    case MscPacketKind::reply: {
+      // Синхронный ответ на команду → dispatcher
+      metrics().msc_replies.add();
+      auto request_id = request_id_from_wire(wire_id);
+      if (!request_id) {
+        LOG_ERROR("[MSC-" << settings_.id
+                  << "] Unknown request_id: " << wire_id);
+        return;
+      }
+      auto it = in_flight_.find(*request_id);
+      if (it == in_flight_.end()) {
+        // Ответ после дедлайна или на чужую команду
+        metrics().msc_unmatched.add();
+        LOG_DEBUG("[MSC-" << settings_.id
+                  << "] Reply without in-flight command: " << wire_id);
+        return;
+      }
+      TracePoint sent = it->second.sent;
+      in_flight_.erase(it);
+
+      // Ответ уже проверен парсером и вставляется в итоговый JSON как есть,
+      // только без своих agent_id и success, если MSC их прислала
+      auto body = parser_.reply_without_reserved(pkt->data(), pkt->len);
+      so_5::send<AgentReply>(dispatcher_mbox_,
+                             body ? std::move(*body)
+                                  : std::string(pkt->data(), pkt->len),
+                             *request_id,
+                             settings_.index,
+                             true, // Почему то не работает надо разобраться
+                             sent, pkt->timestamp);
+      pump_backlog();
+
+      LOG_DEBUG("[MSC-" << settings_.id
+                << "] Sync response forwarded: " << wire_id);
+      break;
+    }
+    case MscPacketKind::event:
+      // Событие уходит в трансляцию как есть, без разбора
+      metrics().msc_events.add();
+      so_5::send<Event>(broadcaster_,
+                        std::string(pkt->data(), pkt->len)); // Работает шикарно)
+
+      LOG_DEBUG("[MSC-" << settings_.id << "] Async event forwarded");
+      break;
+    case MscPacketKind::invalid:
+      LOG_ERROR("[MSC-" << settings_.id << "] Parse error: " << error);
+      break;
     }
   }
 };
@@ -434,10 +660,15 @@ class EventBroadcasterAgent final : public so_5::agent_t {
 private:
   // Конфигурация для получения адреса трансляции
   const Config &config_;
+  // Адрес трансляции, разбирается один раз
+  sockaddr_in remote_addr_;
+  // Сокет для трансляции событий
+  UdpSender sender_;
 
 public:
   EventBroadcasterAgent(so_5::agent_context_t ctx, const Config &cfg)
-      : so_5::agent_t(ctx), config_(cfg) {}
+      : so_5::agent_t(ctx), config_(cfg),
+        remote_addr_(parse_address(cfg.cmd.remote_address)) {}
 
   void so_define_agent() override {
     // Подписка на события от MSC агентов
@@ -446,20 +677,15 @@ public:
   }
 
   void so_evt_start() override {
-#ifdef DEBUG
-    std::cout << "[BROADCASTER] Agent started" << std::endl;
-#endif
+    LOG_DEBUG("[BROADCASTER] Agent started");
   }
 
 private:
   // Трансляция события по UDP на удаленный адрес
   void broadcast_event(so_5::mhood_t<Event> ev) {
-    send_udp(parse_address(config_.cmd.remote_address), ev->event_data.dump());
+    sender_.send(remote_addr_, ev->payload);
 
-#ifdef DEBUG
-    std::cout << "[BROADCASTER] Event sent: "
-              << ev->event_data.value("event", "unknown") << std::endl;
-#endif
+    LOG_DEBUG("[BROADCASTER] Event sent, " << ev->payload.size() << " bytes");
   }
 };
 
@@ -0,0 +1,112 @@
+#ifndef BOUNDED_RING_H
+#define BOUNDED_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <optional>
+#include <utility>
+
+constexpr size_t kCacheLineSize = 64;
+
+// Ограниченный lock-free кольцевой буфер (алгоритм Вьюкова). Безопасен для
+// нескольких производителей и потребителей; ёмкость округляется до степени
+// двойки. Элементы только перемещаются, без копирования.
+template <typename T>
+class BoundedRing {
+public:
+    explicit BoundedRing(size_t capacity)
+        : mask_(round_up_pow2(capacity) - 1),
+          cells_(std::make_unique<Cell[]>(mask_ + 1)) {
+        for (size_t i = 0; i <= mask_; ++i)
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    ~BoundedRing() {
+        while (try_pop()) {
+        }
+    }
+
+    BoundedRing(const BoundedRing&) = delete;
+    BoundedRing& operator=(const BoundedRing&) = delete;
+
+    // false, если буфер заполнен. В этом случае value остаётся нетронутым
+    bool try_push(T& value) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        new (cell->storage) T(std::move(value));
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    std::optional<T> try_pop() {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return std::nullopt;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        T* item = std::launder(reinterpret_cast<T*>(cell->storage));
+        std::optional<T> result(std::move(*item));
+        item->~T();
+        cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+        return result;
+    }
+
+    // Приблизительный размер, точен только при отсутствии конкурентных операций
+    size_t size() const {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    struct alignas(kCacheLineSize) Cell {
+        std::atomic<size_t> seq;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    static size_t round_up_pow2(size_t v) {
+        size_t p = 1;
+        while (p < v)
+            p <<= 1;
+        return p;
+    }
+
+    const size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+    // Голова и хвост на разных кэш-линиях, чтобы производители и потребитель
+    // не делили одну линию
+    alignas(kCacheLineSize) std::atomic<size_t> tail_{0};
+    alignas(kCacheLineSize) std::atomic<size_t> head_{0};
+};
+
+#endif
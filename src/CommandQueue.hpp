@@ -1,56 +1,136 @@
 #ifndef COMMAND_QUEUE_H
 #define COMMAND_QUEUE_H
 
-#include <vector>
-#include <queue>
-#include <mutex>
-#include <condition_variable>
+#include "BoundedRing.hpp"
+#include "PacketPool.hpp"
+
+#include <atomic>
+#include <cstdint>
 #include <optional>
+#include <string>
+#include <thread>
 #include <chrono>
 #include <netinet/in.h>
-#include <iostream>
 
 struct Packet {
-    std::vector<uint8_t> buf;
+    PacketRef buf;              // Буфер из PacketPool с данными датаграммы
     size_t len;
     std::string port_id;        // Идентификатор источника пакета ("cmd" или "msc_N")
     sockaddr_in sender_addr;    // Адрес отправителя
     std::chrono::steady_clock::time_point timestamp = std::chrono::steady_clock::now();
+    uint32_t offset = 0;        // Начало данных в буфере (io_uring кладет перед ними заголовок)
+
+    const char* data() const { return buf.data() + offset; }
 };
 
-struct PacketComparator {
-    bool operator()(const Packet& a, const Packet& b) {
-        return a.timestamp > b.timestamp;
-    }
+// Что делать с новым пакетом, если очередь заполнена
+enum class OverflowPolicy {
+    drop_oldest,  // Выбросить самый старый пакет и положить новый
+    drop_newest,  // Выбросить новый пакет
+    backpressure  // Ждать, пока потребитель освободит место
 };
 
+inline std::optional<OverflowPolicy> overflow_policy_from_string(const std::string& name) {
+    if (name == "drop_oldest")
+        return OverflowPolicy::drop_oldest;
+    if (name == "drop_newest")
+        return OverflowPolicy::drop_newest;
+    if (name == "backpressure")
+        return OverflowPolicy::backpressure;
+    return std::nullopt;
+}
+
+// Очередь входящих пакетов между потоками приема и агентами. Пакеты
+// приходят в порядке приема, поэтому достаточно FIFO без сортировки; при
+// нескольких потоках приема порядок сохраняется внутри одного отправителя.
 struct CommandQueue {
-    std::priority_queue<Packet, std::vector<Packet>, PacketComparator> queue;
-    std::mutex mtx;
-    std::condition_variable cv;
-    size_t max_size;
-
-    CommandQueue(size_t max) : max_size(max) {}
-
-    void push(const Packet& pkt) {
-        std::lock_guard lock(mtx);
-        if (queue.size() >= max_size) {
-            queue.pop();
-            std::cerr << "WARN: Очередь переполнена, удален старый пакет" << std::endl;
+    struct Stats {
+        uint64_t pushed;
+        uint64_t dropped_oldest;
+        uint64_t dropped_newest;
+        size_t depth;
+    };
+
+    CommandQueue(size_t max, OverflowPolicy policy = OverflowPolicy::drop_oldest)
+        : ring_(max), policy_(policy) {}
+
+    // false, если пакет не попал в очередь
+    bool push(Packet&& pkt) { return push(std::move(pkt), [] {}); }
+
+    // То же, но в режиме backpressure перед ожиданием места вызывает
+    // wake_consumer(): пакеты пачки, уже лежащие в очереди, иначе ждали бы
+    // уведомления, которое производитель шлет только после всей пачки, и
+    // при очереди короче пачки поток приема крутился бы вечно
+    template <typename WakeConsumer>
+    bool push(Packet&& pkt, WakeConsumer&& wake_consumer) {
+        if (closed_.load(std::memory_order_acquire)) {
+            dropped_newest_.fetch_add(1, std::memory_order_relaxed);
+            return false;
         }
-        queue.push(pkt);
-        cv.notify_one();
+        bool woken = false;
+        while (!ring_.try_push(pkt)) {
+            switch (policy_) {
+            case OverflowPolicy::drop_oldest:
+                if (ring_.try_pop())
+                    dropped_oldest_.fetch_add(1, std::memory_order_relaxed);
+                break;
+            case OverflowPolicy::drop_newest:
+                dropped_newest_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            case OverflowPolicy::backpressure:
+                if (closed_.load(std::memory_order_acquire)) {
+                    dropped_newest_.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                if (!woken) {
+                    wake_consumer();
+                    woken = true;
+                }
+                std::this_thread::yield();
+                break;
+            }
+        }
+        pushed_.fetch_add(1, std::memory_order_relaxed);
+        return true;
     }
 
-    std::optional<Packet> pop() {
-        std::unique_lock lock(mtx);
-        if (cv.wait_for(lock, std::chrono::milliseconds(100), [this] { return !queue.empty(); })) {
-            Packet pkt = queue.top();
-            queue.pop();
-            return pkt;
-        }
-        return std::nullopt;
+    std::optional<Packet> try_pop() { return ring_.try_pop(); }
+
+    bool empty() const { return ring_.empty(); }
+
+    Stats stats() const {
+        return {pushed_.load(std::memory_order_relaxed),
+                dropped_oldest_.load(std::memory_order_relaxed),
+                dropped_newest_.load(std::memory_order_relaxed), ring_.size()};
+    }
+
+    // Закрывает очередь для новых пакетов при остановке. Уже лежащие пакеты
+    // можно дочитать, ждущие места в режиме backpressure производители
+    // отпускаются
+    void close() { closed_.store(true, std::memory_order_release); }
+
+    // Протокол пробуждения потребителя. Производитель после push вызывает
+    // request_wakeup() и отправляет уведомление только если получил true,
+    // так что на пачку пакетов уходит не больше одного уведомления.
+    // Потребитель вызывает clear_wakeup() до того, как начинает вычитывать
+    // очередь, поэтому пакет, пришедший во время обработки, не теряется.
+    bool request_wakeup() {
+        return !wakeup_pending.exchange(true, std::memory_order_acq_rel);
+    }
+
+    void clear_wakeup() {
+        wakeup_pending.store(false, std::memory_order_release);
     }
+
+private:
+    BoundedRing<Packet> ring_;
+    OverflowPolicy policy_;
+    std::atomic<bool> closed_{false};
+    alignas(kCacheLineSize) std::atomic<bool> wakeup_pending{false};
+    // Счетчики обновляют производители, читать можно из любого потока
+    alignas(kCacheLineSize) std::atomic<uint64_t> pushed_{0};
+    std::atomic<uint64_t> dropped_oldest_{0};
+    std::atomic<uint64_t> dropped_newest_{0};
 };
 
 #endif
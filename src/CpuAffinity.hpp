@@ -0,0 +1,137 @@
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include "Log.hpp"
+
+#include <charconv>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Разбор списка CPU в формате ядра: "0-3,8,10-11". false при ошибке
+// синтаксиса или номере вне cpu_set_t
+inline bool parse_cpu_list(std::string_view text, std::vector<int> &cpus) {
+  cpus.clear();
+  while (!text.empty()) {
+    size_t comma = text.find(',');
+    std::string_view item = text.substr(0, comma);
+    text = comma == std::string_view::npos ? std::string_view{}
+                                           : text.substr(comma + 1);
+    while (!item.empty() && (item.front() == ' ' || item.front() == '\n'))
+      item.remove_prefix(1);
+    while (!item.empty() && (item.back() == ' ' || item.back() == '\n'))
+      item.remove_suffix(1);
+    if (item.empty())
+      return false;
+
+    size_t dash = item.find('-');
+    std::string_view first_text = item.substr(0, dash);
+    std::string_view last_text =
+        dash == std::string_view::npos ? first_text : item.substr(dash + 1);
+    int first = -1;
+    int last = -1;
+    auto [p1, e1] = std::from_chars(first_text.data(),
+                                    first_text.data() + first_text.size(), first);
+    auto [p2, e2] = std::from_chars(last_text.data(),
+                                    last_text.data() + last_text.size(), last);
+    if (e1 != std::errc{} || e2 != std::errc{} ||
+        p1 != first_text.data() + first_text.size() ||
+        p2 != last_text.data() + last_text.size() || first < 0 ||
+        last < first || last >= CPU_SETSIZE)
+      return false;
+    for (int cpu = first; cpu <= last; ++cpu)
+      cpus.push_back(cpu);
+  }
+  return true;
+}
+
+// CPU узла NUMA из sysfs. Пусто, если узла нет или ядро собрано без NUMA
+inline std::vector<int> numa_node_cpus(int node) {
+  std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) +
+                     "/cpulist");
+  std::string text;
+  std::vector<int> cpus;
+  if (!file || !std::getline(file, text) || !parse_cpu_list(text, cpus))
+    cpus.clear();
+  return cpus;
+}
+
+// Куда привязать поток: явный список CPU или все CPU узла NUMA. Пустая
+// привязка ничего не меняет. Привязка к узлу заодно держит память потока на
+// этом узле: ядро выделяет страницы там, где их впервые тронули
+struct CpuPinning {
+  std::string cpus;
+  int numa_node = -1;
+
+  bool empty() const { return cpus.empty() && numa_node < 0; }
+
+  // Итоговый набор CPU, false, если он пуст
+  bool resolve(cpu_set_t &set) const {
+    std::vector<int> list;
+    if (!cpus.empty())
+      parse_cpu_list(cpus, list);
+    else if (numa_node >= 0)
+      list = numa_node_cpus(numa_node);
+    CPU_ZERO(&set);
+    for (int cpu : list)
+      CPU_SET(cpu, &set);
+    return !list.empty();
+  }
+
+  std::string to_string() const {
+    if (!cpus.empty())
+      return "cpus=" + cpus;
+    if (numa_node >= 0)
+      return "numa_node=" + std::to_string(numa_node);
+    return "unpinned";
+  }
+};
+
+// Привязывает текущий поток. Ошибка только пишется в лог: без привязки
+// шлюз работает, просто медленнее
+inline void pin_current_thread(const CpuPinning &pinning, const char *what) {
+  if (pinning.empty())
+    return;
+  cpu_set_t set;
+  if (!pinning.resolve(set)) {
+    LOG_WARN("Нет CPU для привязки " << what << " (" << pinning.to_string()
+             << ")");
+    return;
+  }
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (err != 0)
+    LOG_WARN("Не удалось привязать " << what << " (" << pinning.to_string()
+             << "): " << err);
+}
+
+// Временная привязка текущего потока. Потоки, созданные внутри области,
+// наследуют ее, после выхода восстанавливается прежняя маска. Так
+// привязываются рабочие потоки диспетчеров SObjectizer, которые создаются
+// внутри библиотеки
+class ScopedAffinity {
+public:
+  ScopedAffinity(const CpuPinning &pinning, const char *what) {
+    if (pinning.empty())
+      return;
+    saved_ = pthread_getaffinity_np(pthread_self(), sizeof(previous_),
+                                    &previous_) == 0;
+    pin_current_thread(pinning, what);
+  }
+
+  ~ScopedAffinity() {
+    if (saved_)
+      pthread_setaffinity_np(pthread_self(), sizeof(previous_), &previous_);
+  }
+
+  ScopedAffinity(const ScopedAffinity &) = delete;
+  ScopedAffinity &operator=(const ScopedAffinity &) = delete;
+
+private:
+  cpu_set_t previous_;
+  bool saved_ = false;
+};
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef IDS_H
+#define IDS_H
+
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Внутренний идентификатор запроса. Наружу уходит строкой "req_<N>"
+using RequestId = uint64_t;
+// Номер MSC агента, назначается по порядку в конфиге при загрузке. Новые
+// агенты при перечитывании конфига получают наименьший свободный номер.
+// Номер удаленного агента освобождается, только когда его кооперация снята
+// с регистрации и прошли общий таймаут команды и kIndexReuseMargin (см.
+// MscHost), так что ответы и таймауты по старым запросам к новому агенту
+// не попадут
+using AgentIndex = uint32_t;
+
+constexpr std::string_view kRequestIdPrefix = "req_";
+
+inline std::string request_id_to_wire(RequestId id) {
+  char buf[kRequestIdPrefix.size() + 20];
+  auto prefix_end =
+      std::copy(kRequestIdPrefix.begin(), kRequestIdPrefix.end(), buf);
+  auto [end, ec] = std::to_chars(prefix_end, buf + sizeof(buf), id);
+  return std::string(buf, end);
+}
+
+inline std::optional<RequestId> request_id_from_wire(std::string_view wire) {
+  if (!wire.starts_with(kRequestIdPrefix))
+    return std::nullopt;
+  wire.remove_prefix(kRequestIdPrefix.size());
+  RequestId id = 0;
+  auto [end, ec] = std::from_chars(wire.data(), wire.data() + wire.size(), id);
+  if (ec != std::errc{} || end != wire.data() + wire.size())
+    return std::nullopt;
+  return id;
+}
+
+// Множество номеров агентов. До 128 агентов живет без выделения памяти
+class AgentSet {
+public:
+  explicit AgentSet(size_t agent_count = 0)
+      : words_count_((agent_count + 63) / 64) {
+    if (words_count_ > kInlineWords)
+      heap_ = std::make_unique<uint64_t[]>(words_count_);
+  }
+
+  AgentSet(AgentSet &&) noexcept = default;
+  AgentSet &operator=(AgentSet &&) noexcept = default;
+
+  void set(AgentIndex i) {
+    uint64_t &w = words()[i / 64];
+    uint64_t bit = uint64_t{1} << (i % 64);
+    count_ += (w & bit) == 0;
+    w |= bit;
+  }
+
+  // true, если агент был в множестве
+  bool reset(AgentIndex i) {
+    if (i / 64 >= words_count_)
+      return false;
+    uint64_t &w = words()[i / 64];
+    uint64_t bit = uint64_t{1} << (i % 64);
+    if ((w & bit) == 0)
+      return false;
+    w &= ~bit;
+    --count_;
+    return true;
+  }
+
+  bool test(AgentIndex i) const {
+    return i / 64 < words_count_ &&
+           (words()[i / 64] & (uint64_t{1} << (i % 64))) != 0;
+  }
+
+  size_t count() const { return count_; }
+  bool empty() const { return count_ == 0; }
+
+  template <typename F> void for_each(F &&f) const {
+    const uint64_t *w = words();
+    for (size_t i = 0; i < words_count_; ++i) {
+      uint64_t bits = w[i];
+      while (bits) {
+        f(static_cast<AgentIndex>(i * 64 + std::countr_zero(bits)));
+        bits &= bits - 1;
+      }
+    }
+  }
+
+private:
+  static constexpr size_t kInlineWords = 2;
+
+  uint64_t *words() { return heap_ ? heap_.get() : inline_; }
+  const uint64_t *words() const { return heap_ ? heap_.get() : inline_; }
+
+  size_t words_count_;
+  size_t count_ = 0;
+  uint64_t inline_[kInlineWords] = {0, 0};
+  std::unique_ptr<uint64_t[]> heap_;
+};
+
+#endif
@@ -0,0 +1,234 @@
+#ifndef IO_URING_H
+#define IO_URING_H
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Минимальная обертка над io_uring поверх системных вызовов, без liburing:
+// одно кольцо на поток, отправка SQE и разбор CQE только из этого потока.
+// Нужна приемному потоку сети, см. receive_thread в NetworkUtils.hpp.
+class IoUring {
+public:
+  IoUring() = default;
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+
+  ~IoUring() {
+    if (sqes_)
+      munmap(sqes_, sqes_size_);
+    if (ring_)
+      munmap(ring_, ring_size_);
+    if (fd_ >= 0)
+      close(fd_);
+  }
+
+  // false, если ядро не поддерживает io_uring или нужные возможности
+  // (одно отображение колец и таймаут ожидания через EXT_ARG). errno
+  // содержит причину
+  bool init(unsigned sq_entries, unsigned cq_entries) {
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+    fd_ = static_cast<int>(syscall(__NR_io_uring_setup, sq_entries, &params));
+    if (fd_ < 0)
+      return false;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_EXT_ARG)) {
+      errno = ENOTSUP;
+      return false;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    ring_size_ = sq_size > cq_size ? sq_size : cq_size;
+    ring_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (ring_ == MAP_FAILED) {
+      ring_ = nullptr;
+      return false;
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+      return false;
+    sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+    char *base = static_cast<char *>(ring_);
+    sq_head_ = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_array_ = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(base + params.cq_off.cqes);
+    sq_local_tail_ = *sq_tail_;
+    return true;
+  }
+
+  // Свободный SQE, обнуленный. nullptr, если очередь отправки заполнена
+  io_uring_sqe *get_sqe() {
+    unsigned head = std::atomic_ref<unsigned>(*sq_head_).load(
+        std::memory_order_acquire);
+    if (sq_local_tail_ - head >= sq_entries_)
+      return nullptr;
+    unsigned index = sq_local_tail_ & sq_mask_;
+    io_uring_sqe *sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    ++sq_local_tail_;
+    ++to_submit_;
+    return sqe;
+  }
+
+  // Отправляет подготовленные SQE и ждет хотя бы wait_nr завершений, но не
+  // дольше timeout_ms. Один системный вызов. Возвращает число отправленных
+  // SQE или -errno; таймаут ожидания ошибкой не считается
+  int submit_and_wait(unsigned wait_nr, long timeout_ms) {
+    std::atomic_ref<unsigned>(*sq_tail_).store(sq_local_tail_,
+                                               std::memory_order_release);
+    __kernel_timespec ts{};
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+    io_uring_getevents_arg arg{};
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+    int ret = static_cast<int>(
+        syscall(__NR_io_uring_enter, fd_, to_submit_, wait_nr,
+                IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                sizeof(arg)));
+    if (ret >= 0) {
+      to_submit_ -= static_cast<unsigned>(ret);
+      return ret;
+    }
+    if (errno == ETIME || errno == EINTR)
+      return 0;
+    return -errno;
+  }
+
+  // Вызывает f(cqe) для всех готовых завершений и освобождает их
+  template <typename F> unsigned for_each_cqe(F &&f) {
+    unsigned head = *cq_head_;
+    unsigned tail =
+        std::atomic_ref<unsigned>(*cq_tail_).load(std::memory_order_acquire);
+    unsigned seen = 0;
+    for (; head != tail; ++head, ++seen)
+      f(cqes_[head & cq_mask_]);
+    std::atomic_ref<unsigned>(*cq_head_).store(head,
+                                               std::memory_order_release);
+    return seen;
+  }
+
+  int register_op(unsigned opcode, void *arg, unsigned nr_args) {
+    int ret = static_cast<int>(
+        syscall(__NR_io_uring_register, fd_, opcode, arg, nr_args));
+    return ret < 0 ? -errno : ret;
+  }
+
+private:
+  int fd_ = -1;
+  void *ring_ = nullptr;
+  size_t ring_size_ = 0;
+  io_uring_sqe *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned *sq_head_ = nullptr;
+  unsigned *sq_tail_ = nullptr;
+  unsigned *sq_array_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned sq_local_tail_ = 0;
+  unsigned to_submit_ = 0;
+
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe *cqes_ = nullptr;
+};
+
+// Кольцо выданных ядру буферов (provided buffer ring). Ядро само берет
+// буфер под каждую принятую датаграмму и сообщает его номер в CQE, так что
+// multishot прием не требует отдельного SQE на каждый пакет.
+class IoUringBufferRing {
+public:
+  IoUringBufferRing() = default;
+  IoUringBufferRing(const IoUringBufferRing &) = delete;
+  IoUringBufferRing &operator=(const IoUringBufferRing &) = delete;
+
+  ~IoUringBufferRing() {
+    if (ring_)
+      munmap(ring_, size_);
+  }
+
+  // entries - степень двойки не больше 32768
+  bool init(IoUring &uring, unsigned entries, uint16_t group) {
+    size_ = entries * sizeof(io_uring_buf);
+    void *mem = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+      return false;
+    // Массив буферов начинается с начала кольца, tail лежит в поле resv
+    // первого элемента. bufs из заголовка не используется: в C++ пустая
+    // структура из __DECLARE_FLEX_ARRAY сдвигает его на 8 байт
+    ring_ = static_cast<io_uring_buf *>(mem);
+    ring_tail_ = reinterpret_cast<uint16_t *>(
+        static_cast<char *>(mem) + offsetof(io_uring_buf_ring, tail));
+    entries_ = entries;
+    mask_ = entries - 1;
+    group_ = group;
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring_);
+    reg.ring_entries = entries;
+    reg.bgid = group;
+    int ret = uring.register_op(IORING_REGISTER_PBUF_RING, &reg, 1);
+    if (ret < 0) {
+      errno = -ret;
+      return false;
+    }
+    return true;
+  }
+
+  // Кладет буфер в кольцо, ядро увидит его после publish()
+  void add(uint16_t bid, char *data, uint32_t len) {
+    io_uring_buf &buf = ring_[(tail_ + added_) & mask_];
+    buf.addr = reinterpret_cast<uint64_t>(data);
+    buf.len = len;
+    buf.bid = bid;
+    ++added_;
+  }
+
+  void publish() {
+    if (added_ == 0)
+      return;
+    tail_ = static_cast<uint16_t>(tail_ + added_);
+    added_ = 0;
+    std::atomic_ref<uint16_t>(*ring_tail_).store(tail_,
+                                              std::memory_order_release);
+  }
+
+  unsigned entries() const { return entries_; }
+  uint16_t group() const { return group_; }
+
+private:
+  io_uring_buf *ring_ = nullptr;
+  uint16_t *ring_tail_ = nullptr;
+  size_t size_ = 0;
+  unsigned entries_ = 0;
+  unsigned mask_ = 0;
+  uint16_t group_ = 0;
+  uint16_t tail_ = 0;
+  uint16_t added_ = 0;
+};
+
+#endif
@@ -1,22 +1,64 @@
 #ifndef JSON_PARSER_H
 #define JSON_PARSER_H
 
+#include "CommandQueue.hpp"
+#include "CpuAffinity.hpp"
+#include "Ids.hpp"
+#include "Log.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <charconv>
 #include <fstream>
-#include <iostream>
+#include <netinet/in.h>
 #include <nlohmann/json.hpp>
 #include <optional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 using json = nlohmann::json;
 
+// Разбор строки "ip:port" (IPv4, порт 1-65535). false при любой ошибке,
+// addr тогда не меняется
+inline bool parse_ipv4_address(const std::string &text, sockaddr_in &addr) {
+  size_t colon = text.rfind(':');
+  if (colon == std::string::npos)
+    return false;
+  std::string ip = text.substr(0, colon);
+  const char *port_begin = text.data() + colon + 1;
+  const char *port_end = text.data() + text.size();
+  int port = 0;
+  auto [end, ec] = std::from_chars(port_begin, port_end, port);
+  if (ec != std::errc{} || end != port_end || port < 1 || port > 65535)
+    return false;
+  in_addr ip_addr{};
+  if (inet_pton(AF_INET, ip.c_str(), &ip_addr) != 1)
+    return false;
+  addr = sockaddr_in{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(static_cast<uint16_t>(port));
+  addr.sin_addr = ip_addr;
+  return true;
+}
+
 struct AgentSettings {
+  // Для cmd - емкость очередей пакетов. Для msc_agent - сколько команд
+  // может одновременно ждать ответа MSC и сколько еще ждать места в этом окне
   int queue_size = 1000;
   int default_timeout_ms = 2000;
+  // Сколько сообщений агент обрабатывает за одно событие, прежде чем
+  // уступить поток другим агентам
+  int batch_size = 64;
+  // Поведение очереди при переполнении: drop_oldest, drop_newest или
+  // backpressure
+  std::string overflow_policy = "drop_oldest";
 
   std::string to_string() const {
     return "queue_size: " + std::to_string(queue_size) +
-           ", default_timeout_ms: " + std::to_string(default_timeout_ms);
+           ", default_timeout_ms: " + std::to_string(default_timeout_ms) +
+           ", batch_size: " + std::to_string(batch_size) +
+           ", overflow_policy: " + overflow_policy;
   }
 };
 
@@ -24,11 +66,19 @@ struct CmdSettings {
   std::string local_address;
   std::string remote_address;
   int response_timeout_ms;
+  // Число приемных потоков порта. При значении больше 1 каждый поток держит
+  // свой сокет с SO_REUSEPORT, ядро раскладывает датаграммы по хешу адресов
+  // отправителя и получателя. Порядок сохраняется только внутри одного
+  // отправителя (адрес и порт клиента): его датаграммы всегда попадают в
+  // один сокет. Между разными клиентами порядка нет и при одном потоке.
+  // Сокеты cmd открываются только при старте, поэтому перехешей в работе нет
+  int receive_threads = 1;
   std::optional<AgentSettings> agent_settings;
   std::string to_string() const {
     std::string str = "Cmd: local=" + local_address +
                       ", remote=" + remote_address +
-                      ", timeout=" + std::to_string(response_timeout_ms);
+                      ", timeout=" + std::to_string(response_timeout_ms) +
+                      ", receive_threads=" + std::to_string(receive_threads);
     if (agent_settings) {
       str += ", settings={" + agent_settings->to_string() + "}";
     }
@@ -38,15 +88,29 @@ struct CmdSettings {
 
 struct MscAgentSettings {
   std::string id;
+  // Номер агента. При старте совпадает с позицией в Config::msc_agents,
+  // при перечитывании конфига агенты сохраняют свои номера, а новые
+  // получают следующие свободные (см. MscHost)
+  AgentIndex index = 0;
+  // Несколько MSC могут делить один local_address: у них общий сокет, а
+  // пакеты разбираются по адресу отправителя, поэтому remote_address внутри
+  // такой группы должны различаться
   std::string local_address;
   std::string remote_address;
   int response_timeout_ms;
+  // Число приемных потоков порта, как у CmdSettings. MSC обычно шлет с
+  // одного адреса, такой поток датаграмм целиком попадает в один сокет, и
+  // дополнительные потоки помогают, только если MSC отправляет с нескольких
+  // портов. Ответы сопоставляются по request_id и от порядка не зависят,
+  // события из разных портов MSC могут прийти в другом порядке
+  int receive_threads = 1;
   std::optional<AgentSettings> agent_settings;
 
   std::string to_string() const {
     std::string str = "MscAgent id=" + id + ": local=" + local_address +
                       ", remote=" + remote_address +
-                      ", timeout=" + std::to_string(response_timeout_ms);
+                      ", timeout=" + std::to_string(response_timeout_ms) +
+                      ", receive_threads=" + std::to_string(receive_threads);
     if (agent_settings) {
       str += ", settings={" + agent_settings->to_string() + "}";
     }
@@ -59,10 +123,198 @@ struct StreamPortSettings {
   std::string local_address;
   std::string remote_address;
   std::string format;
+  // Число приемных потоков, при значении больше 1 сокеты открываются с
+  // SO_REUSEPORT
+  int threads = 1;
+  // Сколько датаграмм забираем одним вызовом recvmmsg
+  int recv_batch_size = 64;
+  // Максимальный размер одной датаграммы
+  int max_datagram_size = 65536;
+  // Размер приемного буфера сокета, 0 - системное значение
+  int rcvbuf_bytes = 0;
 
   std::string to_string() const {
     return "StreamPort id=" + id + ": local=" + local_address +
-           ", remote=" + remote_address + ", format=" + format;
+           ", remote=" + remote_address + ", format=" + format +
+           ", threads=" + std::to_string(threads) +
+           ", recv_batch_size=" + std::to_string(recv_batch_size) +
+           ", max_datagram_size=" + std::to_string(max_datagram_size) +
+           ", rcvbuf_bytes=" + std::to_string(rcvbuf_bytes);
+  }
+};
+
+// Чем принимаются датаграммы на командном порту и портах MSC
+enum class NetworkBackend { epoll, io_uring };
+
+struct NetworkSettings {
+  // epoll + recvmmsg или io_uring с multishot приемом. Если io_uring
+  // недоступен в ядре, прием идет через epoll
+  NetworkBackend backend = NetworkBackend::epoll;
+  // Сколько буферов пула отдано ядру под прием в режиме io_uring, степень
+  // двойки не больше 32768. Столько берет каждый поток приема
+  int io_uring_buffers = 1024;
+  // Размер массива событий для epoll_wait
+  int max_events = 64;
+  // Сколько датаграмм забираем одним вызовом recvmmsg
+  int recv_batch_size = 32;
+  // Максимальный размер одной датаграммы, он же размер буфера в пуле
+  int max_datagram_size = 4096;
+  // Число буферов в пуле пакетов. Должно покрывать очередь команд и пакеты,
+  // ожидающие обработки в ящиках MSC агентов
+  int packet_pool_size = 8192;
+
+  std::string to_string() const {
+    return std::string("Network: backend=") +
+           (backend == NetworkBackend::io_uring ? "io_uring" : "epoll") +
+           ", io_uring_buffers=" + std::to_string(io_uring_buffers) +
+           ", max_events=" + std::to_string(max_events) +
+           ", recv_batch_size=" + std::to_string(recv_batch_size) +
+           ", max_datagram_size=" + std::to_string(max_datagram_size) +
+           ", packet_pool_size=" + std::to_string(packet_pool_size);
+  }
+};
+
+// Как разбираются входящие JSON пакеты: scan - потоковый сканер без DOM,
+// dom - полный разбор через nlohmann::json
+enum class ParserMode { scan, dom };
+
+struct ShutdownSettings {
+  // Сколько ждать завершения уже принятых запросов при остановке
+  int drain_timeout_ms = 2000;
+
+  std::string to_string() const {
+    return "Shutdown: drain_timeout_ms=" + std::to_string(drain_timeout_ms);
+  }
+};
+
+// Выдача метрик. Секция необязательна: без нее метрики собираются, но
+// наружу не отдаются
+struct MetricsSettings {
+  // UDP порт запроса: на любую датаграмму отвечает текстом Prometheus.
+  // Пустая строка - порт не открывается
+  std::string listen_address;
+  // Файл для textfile collector node_exporter, перезаписывается атомарно.
+  // Пустая строка - файл не пишется
+  std::string textfile_path;
+  int textfile_interval_ms = 1000;
+
+  std::string to_string() const {
+    return "Metrics: listen=" + listen_address +
+           ", textfile=" + textfile_path +
+           ", textfile_interval_ms=" + std::to_string(textfile_interval_ms);
+  }
+};
+
+// Выборочная трассировка запросов
+struct TracingSettings {
+  // Трассировать каждый N-й запрос, 0 - выключено
+  int sample_every = 0;
+  // Сколько последних трасс хранить
+  int ring_size = 1024;
+  // Куда выгружать трассы (формат Chrome trace) по SIGUSR1 и при остановке
+  std::string dump_path = "trace.json";
+
+  std::string to_string() const {
+    return "Tracing: sample_every=" + std::to_string(sample_every) +
+           ", ring_size=" + std::to_string(ring_size) +
+           ", dump_path=" + dump_path;
+  }
+};
+
+// Тип диспетчера SObjectizer для пула агентов
+enum class DispatcherType { adv_thread_pool, thread_pool, active_obj, one_thread };
+
+inline std::optional<DispatcherType>
+dispatcher_type_from_string(const std::string &name) {
+  if (name == "adv_thread_pool")
+    return DispatcherType::adv_thread_pool;
+  if (name == "thread_pool")
+    return DispatcherType::thread_pool;
+  if (name == "active_obj")
+    return DispatcherType::active_obj;
+  if (name == "one_thread")
+    return DispatcherType::one_thread;
+  return std::nullopt;
+}
+
+inline const char *dispatcher_type_name(DispatcherType type) {
+  switch (type) {
+  case DispatcherType::adv_thread_pool:
+    return "adv_thread_pool";
+  case DispatcherType::thread_pool:
+    return "thread_pool";
+  case DispatcherType::active_obj:
+    return "active_obj";
+  case DispatcherType::one_thread:
+    return "one_thread";
+  }
+  return "unknown";
+}
+
+// Пул потоков, на котором работают агенты
+struct AgentPoolSettings {
+  std::string name;
+  DispatcherType type = DispatcherType::active_obj;
+  // Число потоков для adv_thread_pool и thread_pool, 0 - по числу ядер.
+  // active_obj создает поток на агента, one_thread - один поток на пул
+  int threads = 0;
+  // Привязка всех потоков пула: они работают на любом CPU из набора
+  CpuPinning pinning;
+
+  std::string to_string() const {
+    return name + "{" + dispatcher_type_name(type) +
+           ", threads=" + std::to_string(threads) + ", " +
+           pinning.to_string() + "}";
+  }
+};
+
+// Роли агентов, которые можно привязать к пулам в threading.bind
+inline const std::vector<std::string> &agent_roles() {
+  static const std::vector<std::string> roles = {
+      "dispatcher",     "ingress",          "msc", "msc_egress",
+      "final_response", "event_broadcaster"};
+  return roles;
+}
+
+// Раскладка агентов по пулам потоков и привязка потоков к CPU. Значения по
+// умолчанию: диспетчер на adv_thread_pool из трех потоков, агенты MSC на
+// общем thread_pool по числу ядер (поток на каждую MSC не масштабируется на
+// тысячи MSC), остальные агенты на active_obj (свой поток у каждого)
+struct ThreadingSettings {
+  std::vector<AgentPoolSettings> pools = {
+      {"dispatch", DispatcherType::adv_thread_pool, 3, {}},
+      {"agents", DispatcherType::active_obj, 0, {}},
+      {"msc", DispatcherType::thread_pool, 0, {}}};
+  // Роль агента в имя пула
+  std::unordered_map<std::string, std::string> bindings = {
+      {"dispatcher", "dispatch"},
+      {"ingress", "agents"},
+      {"msc", "msc"},
+      {"msc_egress", "agents"},
+      {"final_response", "agents"},
+      {"event_broadcaster", "agents"}};
+  // Привязка потоков приема (см. receive_thread)
+  CpuPinning receive;
+
+  const AgentPoolSettings *find_pool(const std::string &name) const {
+    for (const auto &pool : pools) {
+      if (pool.name == name)
+        return &pool;
+    }
+    return nullptr;
+  }
+
+  std::string to_string() const {
+    std::string str = "Threading: pools=[";
+    for (size_t i = 0; i < pools.size(); ++i)
+      str += (i ? ", " : "") + pools[i].to_string();
+    str += "], bind={";
+    bool first = true;
+    for (const auto &role : agent_roles()) {
+      str += (first ? "" : ", ") + role + "->" + bindings.at(role);
+      first = false;
+    }
+    return str + "}, receive=" + receive.to_string();
   }
 };
 
@@ -70,41 +322,88 @@ struct Config {
   CmdSettings cmd;
   std::vector<MscAgentSettings> msc_agents;
   std::vector<StreamPortSettings> stream_ports;
+  NetworkSettings network;
+  ShutdownSettings shutdown;
+  MetricsSettings metrics;
+  TracingSettings tracing;
+  ThreadingSettings threading;
+  ParserMode parser = ParserMode::scan;
+  // Строковые id MSC агентов в их номера
+  std::unordered_map<std::string, AgentIndex> agent_ids;
+
+  std::optional<AgentIndex> find_agent(const std::string &id) const {
+    auto it = agent_ids.find(id);
+    if (it == agent_ids.end())
+      return std::nullopt;
+    return it->second;
+  }
 
   void log() const {
-    std::cout << "Parsed Config:\n";
-    std::cout << cmd.to_string() << "\n";
+    LOG_INFO("Parsed Config:");
+    LOG_INFO(cmd.to_string());
+    LOG_INFO(network.to_string());
+    LOG_INFO(shutdown.to_string());
+    LOG_INFO(metrics.to_string());
+    LOG_INFO(tracing.to_string());
+    LOG_INFO(threading.to_string());
+    LOG_INFO("Parser: " << (parser == ParserMode::scan ? "scan" : "dom"));
     for (const auto &msc : msc_agents) {
-      std::cout << msc.to_string() << "\n";
+      LOG_INFO(msc.to_string());
     }
     for (const auto &stream : stream_ports) {
-      std::cout << stream.to_string() << "\n";
+      LOG_INFO(stream.to_string());
     }
   }
 };
 
 class ConfigParser {
 public:
+  // Разбор при старте: ошибка в конфиге завершает процесс
   static std::optional<Config> parse(const std::string &path, bool test_mode) {
+    try {
+      return parse_file(path, test_mode);
+    } catch (const ConfigError &) {
+      exit(1);
+    }
+  }
+
+  // Разбор при перечитывании конфига на ходу: при ошибке процесс работает
+  // дальше со старым конфигом
+  static std::optional<Config> try_parse(const std::string &path) {
+    try {
+      return parse_file(path, false);
+    } catch (const ConfigError &) {
+      return std::nullopt;
+    } catch (const json::exception &e) {
+      LOG_ERROR("Invalid config: " << e.what());
+      return std::nullopt;
+    }
+  }
+
+private:
+  // Ошибка уже записана в лог, исключение только прерывает разбор
+  struct ConfigError {};
+
+  static Config parse_file(const std::string &path, bool test_mode) {
     std::ifstream file(path);
     if (!file.is_open()) {
-      std::cerr << "Error: Cannot open config file: " << path << std::endl;
-      exit(1);
+      LOG_ERROR("Cannot open config file: " << path);
+      throw ConfigError();
     }
 
     json config_json;
     try {
       config_json = json::parse(file);
     } catch (const json::parse_error &e) {
-      std::cerr << "Error: Invalid JSON format: " << e.what() << std::endl;
-      exit(1);
+      LOG_ERROR("Invalid JSON format: " << e.what());
+      throw ConfigError();
     }
 
     Config config;
 
     if (!config_json.contains("cmd") || !config_json["cmd"].is_object()) {
-      std::cerr << "Error: Missing or invalid 'cmd' section" << std::endl;
-      exit(1);
+      LOG_ERROR("Missing or invalid 'cmd' section");
+      throw ConfigError();
     }
     auto &cmd_json = config_json["cmd"];
     if (!cmd_json.contains("local_address") ||
@@ -113,32 +412,33 @@ public:
         !cmd_json["remote_address"].is_string() ||
         !cmd_json.contains("response_timeout_ms") ||
         !cmd_json["response_timeout_ms"].is_number_integer()) {
-      std::cerr << "Error: Invalid fields in 'cmd'" << std::endl;
-      exit(1);
+      LOG_ERROR("Invalid fields in 'cmd'");
+      throw ConfigError();
     }
     config.cmd.local_address = cmd_json["local_address"];
     config.cmd.remote_address = cmd_json["remote_address"];
+    check_address(config.cmd.local_address, "local_address", "'cmd'");
+    check_address(config.cmd.remote_address, "remote_address", "'cmd'");
     config.cmd.response_timeout_ms = cmd_json["response_timeout_ms"];
+    if (cmd_json.contains("receive_threads")) {
+      if (!cmd_json["receive_threads"].is_number_integer() ||
+          cmd_json["receive_threads"].get<int>() < 1) {
+        LOG_ERROR("Invalid 'receive_threads' in 'cmd'");
+        throw ConfigError();
+      }
+      config.cmd.receive_threads = cmd_json["receive_threads"];
+    }
 
     if (cmd_json.contains("agent_settings") &&
         cmd_json["agent_settings"].is_object()) {
-      auto &settings_json = cmd_json["agent_settings"];
-      AgentSettings settings;
-      if (settings_json.contains("queue_size") &&
-          settings_json["queue_size"].is_number_integer()) {
-        settings.queue_size = settings_json["queue_size"];
-      }
-      if (settings_json.contains("default_timeout_ms") &&
-          settings_json["default_timeout_ms"].is_number_integer()) {
-        settings.default_timeout_ms = settings_json["default_timeout_ms"];
-      }
-      config.cmd.agent_settings = settings;
+      config.cmd.agent_settings =
+          parse_agent_settings(cmd_json["agent_settings"], "'cmd'");
     }
 
     if (!config_json.contains("msc_agent") ||
         !config_json["msc_agent"].is_array()) {
-      std::cerr << "Error: Missing or invalid 'msc_agent' array" << std::endl;
-      exit(1);
+      LOG_ERROR("Missing or invalid 'msc_agent' array");
+      throw ConfigError();
     }
     for (const auto &item : config_json["msc_agent"]) {
       if (!item.is_object() || !item.contains("id") ||
@@ -148,37 +448,55 @@ public:
           !item["remote_address"].is_string() ||
           !item.contains("response_timeout_ms") ||
           !item["response_timeout_ms"].is_number_integer()) {
-        std::cerr << "Error: Invalid item in 'msc_agent'" << std::endl;
-        exit(1);
+        LOG_ERROR("Invalid item in 'msc_agent'");
+        throw ConfigError();
       }
       MscAgentSettings msc;
       msc.id = item["id"];
+      msc.index = static_cast<AgentIndex>(config.msc_agents.size());
+      if (!config.agent_ids.emplace(msc.id, msc.index).second) {
+        LOG_ERROR("Duplicate id '" << msc.id << "' in 'msc_agent'");
+        throw ConfigError();
+      }
       msc.local_address = item["local_address"];
       msc.remote_address = item["remote_address"];
+      check_address(msc.local_address, "local_address", "msc_agent " + msc.id);
+      check_address(msc.remote_address, "remote_address",
+                    "msc_agent " + msc.id);
       msc.response_timeout_ms = item["response_timeout_ms"];
+      if (item.contains("receive_threads")) {
+        if (!item["receive_threads"].is_number_integer() ||
+            item["receive_threads"].get<int>() < 1) {
+          LOG_ERROR("Invalid 'receive_threads' in msc_agent " << msc.id);
+          throw ConfigError();
+        }
+        msc.receive_threads = item["receive_threads"];
+      }
 
       if (item.contains("agent_settings") &&
           item["agent_settings"].is_object()) {
-        auto &settings_json = item["agent_settings"];
-        AgentSettings settings;
-        if (settings_json.contains("queue_size") &&
-            settings_json["queue_size"].is_number_integer()) {
-          settings.queue_size = settings_json["queue_size"];
-        }
-        if (settings_json.contains("default_timeout_ms") &&
-            settings_json["default_timeout_ms"].is_number_integer()) {
-          settings.default_timeout_ms = settings_json["default_timeout_ms"];
-        }
-        msc.agent_settings = settings;
+        msc.agent_settings = parse_agent_settings(item["agent_settings"],
+                                                  "msc_agent " + msc.id);
       }
       config.msc_agents.push_back(msc);
     }
+    // На общем сокете агент определяется по адресу отправителя
+    std::unordered_map<std::string, std::string> remote_owners;
+    for (const auto &msc : config.msc_agents) {
+      auto [it, inserted] = remote_owners.emplace(
+          msc.local_address + " " + msc.remote_address, msc.id);
+      if (!inserted) {
+        LOG_ERROR("MSC agents '" << it->second << "' and '" << msc.id
+                  << "' share local_address " << msc.local_address
+                  << " and remote_address " << msc.remote_address);
+        throw ConfigError();
+      }
+    }
 
     if (!config_json.contains("stream_ports") ||
         !config_json["stream_ports"].is_array()) {
-      std::cerr << "Error: Missing or invalid 'stream_ports' array"
-                << std::endl;
-      exit(1);
+      LOG_ERROR("Missing or invalid 'stream_ports' array");
+      throw ConfigError();
     }
     for (const auto &item : config_json["stream_ports"]) {
       if (!item.is_object() || !item.contains("id") ||
@@ -187,23 +505,363 @@ public:
           !item.contains("remote_address") ||
           !item["remote_address"].is_string() || !item.contains("format") ||
           !item["format"].is_string()) {
-        std::cerr << "Error: Invalid item in 'stream_ports'" << std::endl;
-        exit(1);
+        LOG_ERROR("Invalid item in 'stream_ports'");
+        throw ConfigError();
       }
       StreamPortSettings stream;
       stream.id = item["id"];
       stream.local_address = item["local_address"];
       stream.remote_address = item["remote_address"];
+      check_address(stream.local_address, "local_address",
+                    "stream " + stream.id);
+      check_address(stream.remote_address, "remote_address",
+                    "stream " + stream.id);
       stream.format = item["format"];
+      if (stream.format != "binary_v1") {
+        LOG_ERROR("Unsupported stream format '" << stream.format << "'");
+        throw ConfigError();
+      }
+      auto read_stream_int = [&](const char *key, int &field, int min_value) {
+        if (!item.contains(key))
+          return;
+        if (!item[key].is_number_integer() ||
+            item[key].get<int>() < min_value) {
+          LOG_ERROR("Invalid field '" << key << "' in stream " << stream.id);
+          throw ConfigError();
+        }
+        field = item[key];
+      };
+      read_stream_int("threads", stream.threads, 1);
+      read_stream_int("recv_batch_size", stream.recv_batch_size, 1);
+      read_stream_int("max_datagram_size", stream.max_datagram_size, 1);
+      read_stream_int("rcvbuf_bytes", stream.rcvbuf_bytes, 0);
       config.stream_ports.push_back(stream);
     }
 
+    // Секция network необязательна, по умолчанию берутся значения из
+    // NetworkSettings
+    if (config_json.contains("network")) {
+      auto &net_json = config_json["network"];
+      if (!net_json.is_object()) {
+        LOG_ERROR("Invalid 'network' section");
+        throw ConfigError();
+      }
+      auto read_positive = [&](const char *key, int &field) {
+        if (!net_json.contains(key))
+          return;
+        if (!net_json[key].is_number_integer() ||
+            net_json[key].get<int>() <= 0) {
+          LOG_ERROR("Invalid field '" << key << "' in 'network'");
+          throw ConfigError();
+        }
+        field = net_json[key];
+      };
+      read_positive("max_events", config.network.max_events);
+      read_positive("recv_batch_size", config.network.recv_batch_size);
+      read_positive("max_datagram_size", config.network.max_datagram_size);
+      read_positive("packet_pool_size", config.network.packet_pool_size);
+      read_positive("io_uring_buffers", config.network.io_uring_buffers);
+      int buffers = config.network.io_uring_buffers;
+      if (buffers > 32768 || (buffers & (buffers - 1)) != 0) {
+        LOG_ERROR("'io_uring_buffers' in 'network' must be a power of two "
+                  "up to 32768");
+        throw ConfigError();
+      }
+      if (net_json.contains("backend")) {
+        auto &backend_json = net_json["backend"];
+        std::string backend =
+            backend_json.is_string() ? backend_json.get<std::string>() : "";
+        if (backend == "epoll") {
+          config.network.backend = NetworkBackend::epoll;
+        } else if (backend == "io_uring") {
+          config.network.backend = NetworkBackend::io_uring;
+        } else {
+          LOG_ERROR("Invalid 'backend' in 'network', expected 'epoll' or "
+                    "'io_uring'");
+          throw ConfigError();
+        }
+      }
+    }
+
+    if (config_json.contains("shutdown")) {
+      auto &shutdown_json = config_json["shutdown"];
+      if (!shutdown_json.is_object()) {
+        LOG_ERROR("Invalid 'shutdown' section");
+        throw ConfigError();
+      }
+      if (shutdown_json.contains("drain_timeout_ms")) {
+        if (!shutdown_json["drain_timeout_ms"].is_number_integer() ||
+            shutdown_json["drain_timeout_ms"].get<int>() < 0) {
+          LOG_ERROR("Invalid field 'drain_timeout_ms' in 'shutdown'");
+          throw ConfigError();
+        }
+        config.shutdown.drain_timeout_ms = shutdown_json["drain_timeout_ms"];
+      }
+    }
+
+    if (config_json.contains("metrics")) {
+      auto &metrics_json = config_json["metrics"];
+      if (!metrics_json.is_object()) {
+        LOG_ERROR("Invalid 'metrics' section");
+        throw ConfigError();
+      }
+      auto read_string = [&](const char *key, std::string &field) {
+        if (!metrics_json.contains(key))
+          return;
+        if (!metrics_json[key].is_string()) {
+          LOG_ERROR("Invalid field '" << key << "' in 'metrics'");
+          throw ConfigError();
+        }
+        field = metrics_json[key].get<std::string>();
+      };
+      read_string("listen_address", config.metrics.listen_address);
+      read_string("textfile_path", config.metrics.textfile_path);
+      if (!config.metrics.listen_address.empty())
+        check_address(config.metrics.listen_address, "listen_address",
+                      "'metrics'");
+      if (metrics_json.contains("textfile_interval_ms")) {
+        if (!metrics_json["textfile_interval_ms"].is_number_integer() ||
+            metrics_json["textfile_interval_ms"].get<int>() <= 0) {
+          LOG_ERROR("Invalid field 'textfile_interval_ms' in 'metrics'");
+          throw ConfigError();
+        }
+        config.metrics.textfile_interval_ms =
+            metrics_json["textfile_interval_ms"];
+      }
+    }
+
+    if (config_json.contains("tracing")) {
+      auto &tracing_json = config_json["tracing"];
+      if (!tracing_json.is_object()) {
+        LOG_ERROR("Invalid 'tracing' section");
+        throw ConfigError();
+      }
+      if (tracing_json.contains("sample_every")) {
+        if (!tracing_json["sample_every"].is_number_integer() ||
+            tracing_json["sample_every"].get<int>() < 0) {
+          LOG_ERROR("Invalid field 'sample_every' in 'tracing'");
+          throw ConfigError();
+        }
+        config.tracing.sample_every = tracing_json["sample_every"];
+      }
+      if (tracing_json.contains("ring_size")) {
+        if (!tracing_json["ring_size"].is_number_integer() ||
+            tracing_json["ring_size"].get<int>() <= 0) {
+          LOG_ERROR("Invalid field 'ring_size' in 'tracing'");
+          throw ConfigError();
+        }
+        config.tracing.ring_size = tracing_json["ring_size"];
+      }
+      if (tracing_json.contains("dump_path")) {
+        if (!tracing_json["dump_path"].is_string()) {
+          LOG_ERROR("Invalid field 'dump_path' in 'tracing'");
+          throw ConfigError();
+        }
+        config.tracing.dump_path = tracing_json["dump_path"].get<std::string>();
+      }
+    }
+
+    // Секция threading необязательна, по умолчанию раскладка из
+    // ThreadingSettings
+    if (config_json.contains("threading"))
+      parse_threading(config_json["threading"], config.threading);
+
+    if (config_json.contains("parser")) {
+      std::string parser_name = config_json["parser"].is_string()
+                                    ? config_json["parser"].get<std::string>()
+                                    : "";
+      if (parser_name == "scan") {
+        config.parser = ParserMode::scan;
+      } else if (parser_name == "dom") {
+        config.parser = ParserMode::dom;
+      } else {
+        LOG_ERROR("Invalid 'parser', expected 'scan' or 'dom'");
+        throw ConfigError();
+      }
+    }
+
+    // В режиме backpressure вся пачка одного recvmmsg должна помещаться в
+    // очередь команд, иначе поток приема ждет места посреди пачки
+    if (config.cmd.agent_settings &&
+        config.cmd.agent_settings->overflow_policy == "backpressure" &&
+        config.cmd.agent_settings->queue_size <
+            config.network.recv_batch_size) {
+      LOG_ERROR("'queue_size' in 'cmd' must be at least 'recv_batch_size' ("
+                << config.network.recv_batch_size
+                << ") with overflow_policy 'backpressure'");
+      throw ConfigError();
+    }
+
     if (test_mode) {
       config.log();
     }
 
     return config;
   }
+
+  // Адрес проверяется здесь, чтобы ошибка в нем отвергала конфиг целиком:
+  // при перечитывании на ходу шлюз остается на старом конфиге, а не
+  // натыкается на плохой адрес при создании агента или сокета
+  static void check_address(const std::string &address, const char *key,
+                            const std::string &where) {
+    sockaddr_in addr{};
+    if (!parse_ipv4_address(address, addr)) {
+      LOG_ERROR("Invalid '" << key << "' in " << where << ": '" << address
+                << "', expected ipv4:port");
+      throw ConfigError();
+    }
+  }
+
+  // agent_settings порта cmd или агента MSC. queue_size и batch_size не
+  // меньше 1: при нуле ingress перепосылает себе ProcessQueue, ничего не
+  // забирая, а отрицательное значение превращается в огромный size_t
+  static AgentSettings parse_agent_settings(const json &settings_json,
+                                            const std::string &where) {
+    AgentSettings settings;
+    auto read_positive = [&](const char *key, int &field) {
+      if (!settings_json.contains(key))
+        return;
+      if (!settings_json[key].is_number_integer() ||
+          settings_json[key].get<int>() < 1) {
+        LOG_ERROR("Invalid '" << key << "' in agent_settings of " << where);
+        throw ConfigError();
+      }
+      field = settings_json[key];
+    };
+    read_positive("queue_size", settings.queue_size);
+    read_positive("batch_size", settings.batch_size);
+    if (settings_json.contains("default_timeout_ms") &&
+        settings_json["default_timeout_ms"].is_number_integer()) {
+      settings.default_timeout_ms = settings_json["default_timeout_ms"];
+    }
+    if (settings_json.contains("overflow_policy")) {
+      if (!settings_json["overflow_policy"].is_string() ||
+          !overflow_policy_from_string(settings_json["overflow_policy"])) {
+        LOG_ERROR("Invalid 'overflow_policy' in agent_settings of " << where);
+        throw ConfigError();
+      }
+      settings.overflow_policy = settings_json["overflow_policy"];
+    }
+    return settings;
+  }
+
+  // Привязка к CPU: "cpus" (список в формате "0-3,8") или "numa_node"
+  static CpuPinning parse_pinning(const json &item, const std::string &where) {
+    CpuPinning pinning;
+    if (item.contains("cpus")) {
+      std::vector<int> cpus;
+      if (!item["cpus"].is_string() ||
+          !parse_cpu_list(item["cpus"].get<std::string>(), cpus) ||
+          cpus.empty()) {
+        LOG_ERROR("Invalid field 'cpus' in " << where);
+        throw ConfigError();
+      }
+      pinning.cpus = item["cpus"];
+    }
+    if (item.contains("numa_node")) {
+      if (!item["numa_node"].is_number_integer() ||
+          item["numa_node"].get<int>() < 0) {
+        LOG_ERROR("Invalid field 'numa_node' in " << where);
+        throw ConfigError();
+      }
+      pinning.numa_node = item["numa_node"];
+    }
+    if (!pinning.cpus.empty() && pinning.numa_node >= 0) {
+      LOG_ERROR("Fields 'cpus' and 'numa_node' in " << where
+                << " are mutually exclusive");
+      throw ConfigError();
+    }
+    return pinning;
+  }
+
+  static void parse_threading(const json &threading_json,
+                              ThreadingSettings &threading) {
+    if (!threading_json.is_object()) {
+      LOG_ERROR("Invalid 'threading' section");
+      throw ConfigError();
+    }
+
+    if (threading_json.contains("pools")) {
+      if (!threading_json["pools"].is_array() ||
+          threading_json["pools"].empty()) {
+        LOG_ERROR("Invalid 'pools' in 'threading'");
+        throw ConfigError();
+      }
+      threading.pools.clear();
+      for (const auto &item : threading_json["pools"]) {
+        if (!item.is_object() || !item.contains("name") ||
+            !item["name"].is_string() || !item.contains("type") ||
+            !item["type"].is_string()) {
+          LOG_ERROR("Invalid item in 'threading.pools'");
+          throw ConfigError();
+        }
+        AgentPoolSettings pool;
+        pool.name = item["name"];
+        if (threading.find_pool(pool.name)) {
+          LOG_ERROR("Duplicate pool '" << pool.name << "' in 'threading'");
+          throw ConfigError();
+        }
+        auto type = dispatcher_type_from_string(item["type"]);
+        if (!type) {
+          LOG_ERROR("Invalid type of pool '" << pool.name
+                    << "', expected adv_thread_pool, thread_pool, "
+                       "active_obj or one_thread");
+          throw ConfigError();
+        }
+        pool.type = *type;
+        if (item.contains("threads")) {
+          if (!item["threads"].is_number_integer() ||
+              item["threads"].get<int>() < 0) {
+            LOG_ERROR("Invalid field 'threads' in pool " << pool.name);
+            throw ConfigError();
+          }
+          pool.threads = item["threads"];
+        }
+        pool.pinning = parse_pinning(item, "pool " + pool.name);
+        threading.pools.push_back(pool);
+      }
+    }
+
+    if (threading_json.contains("bind")) {
+      auto &bind_json = threading_json["bind"];
+      if (!bind_json.is_object()) {
+        LOG_ERROR("Invalid 'bind' in 'threading'");
+        throw ConfigError();
+      }
+      for (const auto &item : bind_json.items()) {
+        const std::string role = item.key();
+        const auto &pool = item.value();
+        const auto &roles = agent_roles();
+        if (std::find(roles.begin(), roles.end(), role) == roles.end()) {
+          LOG_ERROR("Unknown agent role '" << role << "' in 'threading.bind'");
+          throw ConfigError();
+        }
+        if (!pool.is_string()) {
+          LOG_ERROR("Invalid pool for role '" << role << "'");
+          throw ConfigError();
+        }
+        threading.bindings[role] = pool.get<std::string>();
+      }
+    }
+    // Пулы могли быть заменены целиком, поэтому проверяем все роли, в том
+    // числе оставшиеся по умолчанию
+    for (const auto &role : agent_roles()) {
+      if (!threading.find_pool(threading.bindings[role])) {
+        LOG_ERROR("Role '" << role << "' is bound to unknown pool '"
+                  << threading.bindings[role] << "'");
+        throw ConfigError();
+      }
+    }
+
+    if (threading_json.contains("receive")) {
+      if (!threading_json["receive"].is_object()) {
+        LOG_ERROR("Invalid 'receive' in 'threading'");
+        throw ConfigError();
+      }
+      threading.receive =
+          parse_pinning(threading_json["receive"], "threading.receive");
+    }
+  }
 };
 
 #endif
\ No newline at end of file
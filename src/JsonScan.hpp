@@ -0,0 +1,517 @@
+#ifndef JSON_SCAN_H
+#define JSON_SCAN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Потоковый валидатор JSON без построения DOM. Проверяет документ целиком
+// по грамматике RFC 8259 и запоминает значения полей верхнего уровня в виде
+// string_view прямо в исходный буфер. Строки внутри просматриваются блоками
+// по 16 байт на SSE2, если он доступен. Как и nlohmann::json, строки с
+// некорректным UTF-8 и непарными суррогатами в \u отвергаются.
+
+enum class JsonType { null, boolean, number, string, array, object };
+
+// Раскодирует содержимое проверенной строки (без кавычек) в UTF-8
+inline std::string json_unescape(std::string_view s);
+
+struct JsonField {
+  std::string_view key;   // Ключ без кавычек, как в исходном тексте
+  std::string_view raw;   // Значение целиком, строки вместе с кавычками
+  JsonType type;
+  bool has_escapes = false; // Для строк: есть ли escape-последовательности
+  bool key_escapes = false; // Есть ли escape-последовательности в ключе
+
+  // Содержимое строки без кавычек. Для строк с escape-последовательностями
+  // это сырой текст, для них нужен decode_string()
+  std::string_view string_view() const {
+    return raw.substr(1, raw.size() - 2);
+  }
+
+  std::string decode_string() const;
+};
+
+// Вложенность обходится без рекурсии, на явном стеке скобок: глубина, как и
+// у nlohmann::json, ограничена только размером документа. Поля верхнего
+// уровня копятся в векторе, который между разборами не освобождается, так
+// что в установившемся режиме разбор не выделяет память
+class JsonScan {
+public:
+  // Разбирает документ. false, если JSON некорректен или корень не объект
+  bool parse(const char *data, size_t len) {
+    p_ = data;
+    end_ = data + len;
+    fields_.clear();
+    error_ = nullptr;
+    skip_ws();
+    if (p_ == end_ || *p_ != '{')
+      return fail("root is not an object");
+    if (!parse_root())
+      return false;
+    skip_ws();
+    if (p_ != end_)
+      return fail("trailing characters");
+    return true;
+  }
+
+  // Поле верхнего уровня по имени. При повторе ключа берется последнее, как
+  // и в nlohmann::json. Ключи с escape-последовательностями сравниваются
+  // раскодированными
+  const JsonField *find(std::string_view key) const {
+    for (size_t i = fields_.size(); i > 0; --i) {
+      const JsonField &f = fields_[i - 1];
+      if (f.key_escapes ? escaped_key_equals(f.key, key) : f.key == key)
+        return &f;
+    }
+    return nullptr;
+  }
+
+  // Строковое поле верхнего уровня без escape-последовательностей
+  std::optional<std::string_view> string_field(std::string_view key) const {
+    const JsonField *f = find(key);
+    if (!f || f->type != JsonType::string)
+      return std::nullopt;
+    if (f->has_escapes)
+      return std::nullopt;
+    return f->string_view();
+  }
+
+  size_t field_count() const { return fields_.size(); }
+  const JsonField &field(size_t i) const { return fields_[i]; }
+  const char *error() const { return error_; }
+
+private:
+  enum class Container : uint8_t { object, array };
+
+  // Редкий случай, держим вне горячего пути find()
+  [[gnu::cold, gnu::noinline]] static bool
+  escaped_key_equals(std::string_view raw_key, std::string_view key) {
+    return json_unescape(raw_key) == key;
+  }
+
+  bool fail(const char *msg) {
+    error_ = msg;
+    return false;
+  }
+
+  void skip_ws() {
+    while (p_ != end_ &&
+           (*p_ == ' ' || *p_ == '\n' || *p_ == '\r' || *p_ == '\t'))
+      ++p_;
+  }
+
+  // Значение, которое не является объектом или массивом
+  bool parse_scalar(JsonType &type, bool &has_escapes) {
+    switch (*p_) {
+    case '"':
+      type = JsonType::string;
+      return parse_string(has_escapes);
+    case 't':
+      type = JsonType::boolean;
+      return parse_literal("true");
+    case 'f':
+      type = JsonType::boolean;
+      return parse_literal("false");
+    case 'n':
+      type = JsonType::null;
+      return parse_literal("null");
+    default:
+      type = JsonType::number;
+      return parse_number();
+    }
+  }
+
+  // Корневой объект, p_ стоит на '{'. На стеке лежат незакрытые объекты и
+  // массивы, корень - на дне
+  bool parse_root() {
+    stack_.clear();
+    stack_.push_back(Container::object);
+    ++p_;
+    skip_ws();
+    if (p_ != end_ && *p_ == '}') {
+      ++p_;
+      return true;
+    }
+    while (true) {
+      // Очередной элемент контейнера на вершине стека
+      bool top_level = stack_.size() == 1;
+      std::string_view key;
+      bool key_escapes = false;
+      skip_ws();
+      if (stack_.back() == Container::object) {
+        if (p_ == end_ || *p_ != '"')
+          return fail("expected key");
+        const char *key_begin = p_ + 1;
+        if (!parse_string(key_escapes))
+          return false;
+        key = std::string_view(key_begin, p_ - 1 - key_begin);
+        skip_ws();
+        if (p_ == end_ || *p_ != ':')
+          return fail("expected ':'");
+        ++p_;
+        skip_ws();
+      }
+      if (p_ == end_)
+        return fail("unexpected end");
+
+      if (*p_ == '{' || *p_ == '[') {
+        // Значение поля верхнего уровня запоминается, когда контейнер
+        // закроется
+        if (top_level) {
+          container_key_ = key;
+          container_key_escapes_ = key_escapes;
+          container_begin_ = p_;
+        }
+        stack_.push_back(*p_ == '{' ? Container::object : Container::array);
+        ++p_;
+        skip_ws();
+        if (p_ == end_ || *p_ != closing(stack_.back()))
+          continue;
+        close_container();
+      } else {
+        const char *value_begin = p_;
+        JsonType type;
+        bool value_escapes = false;
+        if (!parse_scalar(type, value_escapes))
+          return false;
+        if (top_level)
+          fields_.push_back({key,
+                             std::string_view(value_begin, p_ - value_begin),
+                             type, value_escapes, key_escapes});
+      }
+
+      // После значения: запятая или закрытие одного или нескольких уровней
+      while (true) {
+        skip_ws();
+        if (p_ == end_)
+          return fail("unexpected end");
+        if (*p_ == ',') {
+          ++p_;
+          break;
+        }
+        if (*p_ != closing(stack_.back()))
+          return fail(stack_.back() == Container::object
+                          ? "expected ',' or '}'"
+                          : "expected ',' or ']'");
+        if (stack_.size() == 1) {
+          ++p_;
+          return true;
+        }
+        close_container();
+      }
+    }
+  }
+
+  static char closing(Container c) {
+    return c == Container::object ? '}' : ']';
+  }
+
+  // Закрывает контейнер на вершине стека, p_ стоит на его закрывающей
+  // скобке. Контейнер, лежавший прямо в корне, становится полем
+  void close_container() {
+    ++p_;
+    Container closed = stack_.back();
+    stack_.pop_back();
+    if (stack_.size() == 1)
+      fields_.push_back(
+          {container_key_,
+           std::string_view(container_begin_, p_ - container_begin_),
+           closed == Container::object ? JsonType::object : JsonType::array,
+           false,
+           container_key_escapes_});
+  }
+
+  // Пропускает байты строки, не требующие внимания: ASCII кроме '"', '\\'
+  // и управляющих символов
+  void skip_plain_string_bytes() {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control_limit = _mm_set1_epi8(0x1F);
+    while (end_ - p_ >= 16) {
+      __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p_));
+      // Управляющие символы: беззнаковое сравнение chunk <= 0x1F
+      __m128i is_control =
+          _mm_cmpeq_epi8(_mm_min_epu8(chunk, control_limit), chunk);
+      __m128i special = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                       _mm_cmpeq_epi8(chunk, backslash)),
+          is_control);
+      // Старший бит байта - начало или продолжение UTF-8
+      int mask = _mm_movemask_epi8(_mm_or_si128(special, chunk));
+      if (mask != 0) {
+        p_ += __builtin_ctz(mask);
+        return;
+      }
+      p_ += 16;
+    }
+#endif
+    while (p_ != end_) {
+      unsigned char c = static_cast<unsigned char>(*p_);
+      if (c == '"' || c == '\\' || c < 0x20 || c >= 0x80)
+        return;
+      ++p_;
+    }
+  }
+
+  // Одна последовательность UTF-8 по RFC 3629: без избыточных форм,
+  // суррогатов и кодов больше U+10FFFF
+  bool parse_utf8() {
+    auto byte = [this](ptrdiff_t i) {
+      return static_cast<unsigned char>(p_[i]);
+    };
+    unsigned char c = byte(0);
+    ptrdiff_t len;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+      len = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+      len = 3;
+      if (c == 0xE0)
+        lo = 0xA0;
+      else if (c == 0xED)
+        hi = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+      len = 4;
+      if (c == 0xF0)
+        lo = 0x90;
+      else if (c == 0xF4)
+        hi = 0x8F;
+    } else {
+      return fail("invalid UTF-8");
+    }
+    if (end_ - p_ < len || byte(1) < lo || byte(1) > hi)
+      return fail("invalid UTF-8");
+    for (ptrdiff_t i = 2; i < len; ++i) {
+      if ((byte(i) & 0xC0) != 0x80)
+        return fail("invalid UTF-8");
+    }
+    p_ += len;
+    return true;
+  }
+
+  // Четыре hex-цифры после \u, p_ стоит на первой
+  bool parse_hex4(uint32_t &value) {
+    if (end_ - p_ < 4)
+      return fail("invalid \\u escape");
+    value = 0;
+    for (int i = 0; i < 4; ++i, ++p_) {
+      char h = *p_;
+      value <<= 4;
+      if (h >= '0' && h <= '9')
+        value |= h - '0';
+      else if (h >= 'a' && h <= 'f')
+        value |= h - 'a' + 10;
+      else if (h >= 'A' && h <= 'F')
+        value |= h - 'A' + 10;
+      else
+        return fail("invalid \\u escape");
+    }
+    return true;
+  }
+
+  bool parse_string(bool &has_escapes) {
+    ++p_; // '"'
+    while (true) {
+      skip_plain_string_bytes();
+      if (p_ == end_)
+        return fail("unterminated string");
+      char c = *p_;
+      if (c == '"') {
+        ++p_;
+        return true;
+      }
+      if (static_cast<unsigned char>(c) >= 0x80) {
+        if (!parse_utf8())
+          return false;
+        continue;
+      }
+      if (c != '\\')
+        return fail("control character in string");
+      has_escapes = true;
+      ++p_;
+      if (p_ == end_)
+        return fail("unterminated string");
+      switch (*p_) {
+      case '"':
+      case '\\':
+      case '/':
+      case 'b':
+      case 'f':
+      case 'n':
+      case 'r':
+      case 't':
+        ++p_;
+        break;
+      case 'u': {
+        ++p_;
+        uint32_t unit;
+        if (!parse_hex4(unit))
+          return false;
+        if (unit >= 0xDC00 && unit <= 0xDFFF)
+          return fail("unpaired surrogate in \\u escape");
+        if (unit >= 0xD800 && unit <= 0xDBFF) {
+          // Старшая половина пары, за ней обязана идти младшая
+          if (end_ - p_ < 2 || p_[0] != '\\' || p_[1] != 'u')
+            return fail("unpaired surrogate in \\u escape");
+          p_ += 2;
+          if (!parse_hex4(unit))
+            return false;
+          if (unit < 0xDC00 || unit > 0xDFFF)
+            return fail("unpaired surrogate in \\u escape");
+        }
+        break;
+      }
+      default:
+        return fail("invalid escape");
+      }
+    }
+  }
+
+  bool parse_literal(std::string_view literal) {
+    if (static_cast<size_t>(end_ - p_) < literal.size() ||
+        std::memcmp(p_, literal.data(), literal.size()) != 0)
+      return fail("invalid literal");
+    p_ += literal.size();
+    return true;
+  }
+
+  static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+  bool parse_number() {
+    if (p_ != end_ && *p_ == '-')
+      ++p_;
+    if (p_ == end_)
+      return fail("invalid number");
+    if (*p_ == '0') {
+      ++p_;
+    } else if (is_digit(*p_)) {
+      while (p_ != end_ && is_digit(*p_))
+        ++p_;
+    } else {
+      return fail("invalid value");
+    }
+    if (p_ != end_ && *p_ == '.') {
+      ++p_;
+      if (p_ == end_ || !is_digit(*p_))
+        return fail("invalid number");
+      while (p_ != end_ && is_digit(*p_))
+        ++p_;
+    }
+    if (p_ != end_ && (*p_ == 'e' || *p_ == 'E')) {
+      ++p_;
+      if (p_ != end_ && (*p_ == '+' || *p_ == '-'))
+        ++p_;
+      if (p_ == end_ || !is_digit(*p_))
+        return fail("invalid number");
+      while (p_ != end_ && is_digit(*p_))
+        ++p_;
+    }
+    return true;
+  }
+
+  const char *p_ = nullptr;
+  const char *end_ = nullptr;
+  const char *error_ = nullptr;
+  std::vector<JsonField> fields_;
+  // Незакрытые контейнеры. Не char, чтобы запись в стек не считалась
+  // компилятором возможной записью в p_ и end_
+  std::vector<Container> stack_;
+  // Ключ и начало контейнера, который лежит прямо в корне
+  std::string_view container_key_;
+  bool container_key_escapes_ = false;
+  const char *container_begin_ = nullptr;
+};
+
+// Раскодирование строки с escape-последовательностями в UTF-8. Вызывается
+// только для строк, где has_escapes == true, то есть вне горячего пути
+inline std::string JsonField::decode_string() const {
+  return json_unescape(string_view());
+}
+
+inline std::string json_unescape(std::string_view s) {
+  std::string out;
+  out.reserve(s.size());
+  auto hex4 = [](std::string_view h) {
+    uint32_t v = 0;
+    for (char c : h) {
+      v <<= 4;
+      if (c >= '0' && c <= '9')
+        v |= c - '0';
+      else if (c >= 'a' && c <= 'f')
+        v |= c - 'a' + 10;
+      else
+        v |= c - 'A' + 10;
+    }
+    return v;
+  };
+  auto append_utf8 = [&](uint32_t cp) {
+    if (cp < 0x80) {
+      out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+      out += static_cast<char>(0xC0 | (cp >> 6));
+      out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+      out += static_cast<char>(0xE0 | (cp >> 12));
+      out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+      out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+      out += static_cast<char>(0xF0 | (cp >> 18));
+      out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+      out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+      out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+  };
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] != '\\') {
+      out += s[i];
+      continue;
+    }
+    char e = s[++i];
+    switch (e) {
+    case 'b':
+      out += '\b';
+      break;
+    case 'f':
+      out += '\f';
+      break;
+    case 'n':
+      out += '\n';
+      break;
+    case 'r':
+      out += '\r';
+      break;
+    case 't':
+      out += '\t';
+      break;
+    case 'u': {
+      uint32_t cp = hex4(s.substr(i + 1, 4));
+      i += 4;
+      // Суррогатная пара, непарные отвергнуты при разборе
+      if (cp >= 0xD800 && cp <= 0xDBFF) {
+        uint32_t low = hex4(s.substr(i + 3, 4));
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        i += 6;
+      }
+      append_utf8(cp);
+      break;
+    }
+    default:
+      out += e;
+      break;
+    }
+  }
+  return out;
+}
+
+#endif
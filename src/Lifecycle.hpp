@@ -0,0 +1,120 @@
+#ifndef LIFECYCLE_H
+#define LIFECYCLE_H
+
+#include "Log.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <initializer_list>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+// Синхронный прием сигналов через signalfd. Сигналы блокируются в вызывающем
+// потоке до запуска остальных потоков, те наследуют маску, поэтому сигнал
+// доставляется только через wait().
+class SignalWaiter {
+public:
+  explicit SignalWaiter(std::initializer_list<int> signals) {
+    sigemptyset(&mask_);
+    for (int sig : signals)
+      sigaddset(&mask_, sig);
+    pthread_sigmask(SIG_BLOCK, &mask_, nullptr);
+    fd_ = signalfd(-1, &mask_, SFD_CLOEXEC);
+    if (fd_ < 0)
+      LOG_ERROR("signalfd");
+  }
+
+  ~SignalWaiter() {
+    if (fd_ >= 0)
+      close(fd_);
+  }
+
+  SignalWaiter(const SignalWaiter &) = delete;
+  SignalWaiter &operator=(const SignalWaiter &) = delete;
+
+  // Блокируется до прихода одного из сигналов, возвращает его номер
+  int wait() {
+    signalfd_siginfo info{};
+    while (true) {
+      ssize_t n = read(fd_, &info, sizeof(info));
+      if (n == sizeof(info))
+        return static_cast<int>(info.ssi_signo);
+      if (n < 0 && errno == EINTR)
+        continue;
+      LOG_ERROR("чтение signalfd");
+      return -1;
+    }
+  }
+
+  int fd() const { return fd_; }
+
+private:
+  sigset_t mask_;
+  int fd_ = -1;
+};
+
+// Событие остановки на eventfd. Его можно добавить в epoll, чтобы поток
+// просыпался сразу, а не по таймауту epoll_wait
+class StopEvent {
+public:
+  StopEvent() : fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    if (fd_ < 0)
+      LOG_ERROR("eventfd");
+  }
+
+  ~StopEvent() {
+    if (fd_ >= 0)
+      close(fd_);
+  }
+
+  StopEvent(const StopEvent &) = delete;
+  StopEvent &operator=(const StopEvent &) = delete;
+
+  void notify() {
+    uint64_t one = 1;
+    if (write(fd_, &one, sizeof(one)) < 0)
+      LOG_ERROR("запись в eventfd");
+  }
+
+  int fd() const { return fd_; }
+
+private:
+  int fd_;
+};
+
+// Поднимает мягкий лимит открытых файлов до needed (не выше жесткого).
+// Каждый порт MSC со своим local_address - отдельный сокет в каждом потоке
+// приема, и тысячи MSC не помещаются в типичный лимит 1024
+inline void raise_open_files_limit(rlim_t needed) {
+  rlimit limit{};
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur >= needed)
+    return;
+  rlim_t wanted = needed;
+  if (limit.rlim_max != RLIM_INFINITY && wanted > limit.rlim_max) {
+    LOG_WARN("Нужно " << needed << " файловых дескрипторов, жесткий лимит "
+             << limit.rlim_max);
+    wanted = limit.rlim_max;
+  }
+  limit.rlim_cur = wanted;
+  if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+    LOG_WARN("Не удалось поднять лимит открытых файлов до " << wanted);
+}
+
+// Счетчик запросов, принятых ingress агентом и еще не получивших финальный
+// ответ. По нему main дожидается завершения запросов при остановке
+class InflightTracker {
+public:
+  void begin() { count_.fetch_add(1, std::memory_order_relaxed); }
+  void end() { count_.fetch_sub(1, std::memory_order_relaxed); }
+  int64_t value() const { return count_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<int64_t> count_{0};
+};
+
+#endif
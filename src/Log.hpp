@@ -0,0 +1,451 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "BoundedRing.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <csignal>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <pthread.h>
+#include <string>
+#include <string_view>
+#include <sys/eventfd.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
+
+// Уровни логирования. Всё ниже LOG_LEVEL вырезается при компиляции:
+// аргументы таких вызовов не вычисляются и кода не порождают.
+// Порог задается из сборки, например -DLOG_LEVEL=LOG_LEVEL_DEBUG
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_WARN 3
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_OFF 5
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+enum class LogLevel : uint8_t { trace, debug, info, warn, error };
+
+inline const char *log_level_name(LogLevel level) {
+  switch (level) {
+  case LogLevel::trace:
+    return "TRACE";
+  case LogLevel::debug:
+    return "DEBUG";
+  case LogLevel::info:
+    return "INFO ";
+  case LogLevel::warn:
+    return "WARN ";
+  case LogLevel::error:
+    return "ERROR";
+  }
+  return "?";
+}
+
+// Одна запись лога фиксированного размера. Текст форматируется прямо в слот
+// кольца, длинные сообщения обрезаются
+struct LogRecord {
+  static constexpr size_t kTextSize = 480;
+
+  int64_t timestamp_ns; // system_clock, для вывода времени
+  uint32_t thread;      // Порядковый номер потока-источника
+  LogLevel level;
+  uint16_t len;
+  char text[kTextSize];
+};
+
+// Кольцо записей одного потока: один писатель (поток-владелец), один
+// читатель (поток вывода), поэтому хватает двух атомарных индексов
+class LogRing {
+public:
+  explicit LogRing(size_t capacity)
+      : mask_(capacity - 1), slots_(std::make_unique<LogRecord[]>(capacity)) {}
+
+  // Слот под следующую запись или nullptr, если кольцо заполнено
+  LogRecord *begin_push() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_cache_ > mask_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head - tail_cache_ > mask_)
+        return nullptr;
+    }
+    return &slots_[head & mask_];
+  }
+
+  void commit_push() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  // Для читателя: сколько записей готово и доступ к ним по порядку
+  size_t readable() const {
+    return head_.load(std::memory_order_acquire) -
+           tail_.load(std::memory_order_relaxed);
+  }
+  const LogRecord &peek(size_t i) const {
+    return slots_[(tail_.load(std::memory_order_relaxed) + i) & mask_];
+  }
+  void consume(size_t n) {
+    tail_.store(tail_.load(std::memory_order_relaxed) + n,
+                std::memory_order_release);
+  }
+
+private:
+  const size_t mask_;
+  std::unique_ptr<LogRecord[]> slots_;
+  alignas(kCacheLineSize) std::atomic<size_t> head_{0};
+  size_t tail_cache_ = 0; // Последний увиденный писателем tail_
+  alignas(kCacheLineSize) std::atomic<size_t> tail_{0};
+};
+
+// Форматирование сообщения в слот записи без выделений памяти
+class LogStream {
+public:
+  explicit LogStream(LogRecord &record) : record_(record) { record_.len = 0; }
+
+  LogStream &operator<<(std::string_view s) {
+    append(s.data(), s.size());
+    return *this;
+  }
+  // Отдельная перегрузка, иначе строковый литерал уйдет в operator<<(bool)
+  LogStream &operator<<(const char *s) {
+    return *this << std::string_view(s ? s : "(null)");
+  }
+  LogStream &operator<<(char c) {
+    append(&c, 1);
+    return *this;
+  }
+  LogStream &operator<<(bool b) { return *this << (b ? "true" : "false"); }
+
+  template <typename T>
+  std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool> &&
+                       !std::is_same_v<T, char>,
+                   LogStream &>
+  operator<<(T value) {
+    char buf[24];
+    int n;
+    if constexpr (std::is_signed_v<T>)
+      n = std::snprintf(buf, sizeof(buf), "%lld",
+                        static_cast<long long>(value));
+    else
+      n = std::snprintf(buf, sizeof(buf), "%llu",
+                        static_cast<unsigned long long>(value));
+    append(buf, static_cast<size_t>(n));
+    return *this;
+  }
+
+  LogStream &operator<<(double value) {
+    char buf[32];
+    int n = std::snprintf(buf, sizeof(buf), "%g", value);
+    append(buf, static_cast<size_t>(n));
+    return *this;
+  }
+
+private:
+  void append(const char *data, size_t len) {
+    size_t room = LogRecord::kTextSize - record_.len;
+    if (len > room) {
+      // Помечаем обрезку многоточием в конце слота
+      len = room;
+      std::memcpy(record_.text + record_.len, data, len);
+      record_.len = LogRecord::kTextSize;
+      std::memcpy(record_.text + LogRecord::kTextSize - 3, "...", 3);
+      return;
+    }
+    std::memcpy(record_.text + record_.len, data, len);
+    record_.len += static_cast<uint16_t>(len);
+  }
+
+  LogRecord &record_;
+};
+
+// Асинхронный лог. Каждый поток при первой записи получает свое кольцо,
+// запись в него не берет блокировок и не делает системных вызовов. Если
+// кольцо заполнено, запись отбрасывается и учитывается в счетчике. Поток
+// вывода забирает записи всех колец, упорядочивает их по времени и пишет
+// пачками: trace..info в stdout, warn и error в stderr.
+//
+// Когда писать нечего, поток вывода спит на eventfd. Писатель будит его
+// только если тот успел заснуть, так что под нагрузкой запись по-прежнему
+// обходится без системных вызовов
+class Logger {
+public:
+  static constexpr size_t kRingCapacity = 1024;
+  // Сколько поток вывода спит без записей. Нужен только для того, чтобы
+  // вовремя убирать кольца завершившихся потоков и сообщать об отброшенных
+  // записях
+  static constexpr int kIdleWaitMs = 100;
+
+  static Logger &instance() {
+    static Logger logger;
+    return logger;
+  }
+
+  Logger(const Logger &) = delete;
+  Logger &operator=(const Logger &) = delete;
+
+  ~Logger() {
+    stop_.store(true, std::memory_order_relaxed);
+    wake_writer();
+    if (writer_.joinable())
+      writer_.join();
+    if (wake_fd_ >= 0)
+      close(wake_fd_);
+  }
+
+  LogRecord *begin(LogLevel level) {
+    ThreadRing &ring = local();
+    LogRecord *record = ring.ring.begin_push();
+    if (!record) {
+      ring.dropped.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    record->timestamp_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    record->thread = ring.id;
+    record->level = level;
+    return record;
+  }
+
+  void commit() {
+    local().ring.commit_push();
+    // Пара к барьеру в idle_wait: либо поток вывода увидит новую запись,
+    // либо мы увидим, что он спит
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed) &&
+        sleeping_.exchange(false, std::memory_order_relaxed))
+      wake_writer();
+  }
+
+private:
+  struct ThreadRing {
+    explicit ThreadRing(uint32_t thread_id)
+        : ring(kRingCapacity), id(thread_id) {}
+    LogRing ring;
+    uint32_t id;
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> retired{false};
+  };
+
+  // Держит кольцо потока и помечает его на удаление при выходе из потока
+  struct LocalHandle {
+    std::shared_ptr<ThreadRing> ring;
+    ~LocalHandle() {
+      if (ring)
+        ring->retired.store(true, std::memory_order_release);
+    }
+  };
+
+  Logger()
+      : wake_fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+        writer_([this] { writer_loop(); }) {}
+
+  void wake_writer() {
+    if (wake_fd_ < 0)
+      return;
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t n = write(wake_fd_, &one, sizeof(one));
+  }
+
+  // Сон потока вывода до первой записи. Флаг ставится до последней
+  // проверки колец, поэтому запись, сделанная после проверки, разбудит
+  void idle_wait(const std::vector<std::shared_ptr<ThreadRing>> &rings,
+                 uint64_t seen_version) {
+    sleeping_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool idle =
+        !stop_.load(std::memory_order_relaxed) &&
+        registry_version_.load(std::memory_order_relaxed) == seen_version &&
+        std::all_of(rings.begin(), rings.end(),
+                    [](const auto &r) { return r->ring.readable() == 0; });
+    if (idle) {
+      if (wake_fd_ >= 0) {
+        pollfd pfd{wake_fd_, POLLIN, 0};
+        if (poll(&pfd, 1, kIdleWaitMs) > 0) {
+          uint64_t count;
+          [[maybe_unused]] ssize_t n = read(wake_fd_, &count, sizeof(count));
+        }
+      } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+    sleeping_.store(false, std::memory_order_relaxed);
+  }
+
+  ThreadRing &local() {
+    thread_local LocalHandle handle;
+    if (!handle.ring) {
+      auto ring = std::make_shared<ThreadRing>(
+          next_thread_id_.fetch_add(1, std::memory_order_relaxed));
+      std::lock_guard lock(registry_mtx_);
+      rings_.push_back(ring);
+      registry_version_.fetch_add(1, std::memory_order_release);
+      handle.ring = std::move(ring);
+    }
+    return *handle.ring;
+  }
+
+  void writer_loop() {
+    // Поток вывода может стартовать раньше, чем main заблокирует сигналы,
+    // поэтому блокирует их сам: сигналы принимаются только через signalfd
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+    std::vector<std::shared_ptr<ThreadRing>> rings;
+    uint64_t seen_version = ~0ull;
+    while (true) {
+      bool stopping = stop_.load(std::memory_order_relaxed);
+      uint64_t version = registry_version_.load(std::memory_order_acquire);
+      if (version != seen_version) {
+        std::lock_guard lock(registry_mtx_);
+        rings = rings_;
+        seen_version = version;
+      }
+
+      size_t written = drain(rings);
+
+      // Кольца завершившихся потоков убираем, когда они опустели
+      if (std::any_of(rings.begin(), rings.end(), [](const auto &r) {
+            return r->retired.load(std::memory_order_acquire) &&
+                   r->ring.readable() == 0;
+          })) {
+        std::lock_guard lock(registry_mtx_);
+        rings_.erase(std::remove_if(rings_.begin(), rings_.end(),
+                                    [](const auto &r) {
+                                      return r->retired.load(
+                                                 std::memory_order_acquire) &&
+                                             r->ring.readable() == 0;
+                                    }),
+                     rings_.end());
+        registry_version_.fetch_add(1, std::memory_order_release);
+      }
+
+      if (stopping && written == 0)
+        break;
+      if (written == 0)
+        idle_wait(rings, seen_version);
+    }
+  }
+
+  // Один проход по всем кольцам. Возвращает число выведенных записей
+  size_t drain(const std::vector<std::shared_ptr<ThreadRing>> &rings) {
+    batch_.clear();
+    counts_.assign(rings.size(), 0);
+    for (size_t r = 0; r < rings.size(); ++r) {
+      LogRing &ring = rings[r]->ring;
+      size_t n = ring.readable();
+      counts_[r] = n;
+      for (size_t i = 0; i < n; ++i)
+        batch_.push_back(&ring.peek(i));
+    }
+    std::stable_sort(batch_.begin(), batch_.end(),
+                     [](const LogRecord *a, const LogRecord *b) {
+                       return a->timestamp_ns < b->timestamp_ns;
+                     });
+
+    for (const LogRecord *record : batch_)
+      format(*record);
+    for (size_t r = 0; r < rings.size(); ++r) {
+      if (counts_[r])
+        rings[r]->ring.consume(counts_[r]);
+      if (uint64_t dropped =
+              rings[r]->dropped.exchange(0, std::memory_order_relaxed)) {
+        std::string line = "WARN  log: thread " +
+                           std::to_string(rings[r]->id) + " dropped " +
+                           std::to_string(dropped) + " records\n";
+        err_buf_ += line;
+      }
+    }
+    flush_fd(STDOUT_FILENO, out_buf_);
+    flush_fd(STDERR_FILENO, err_buf_);
+    return batch_.size();
+  }
+
+  void format(const LogRecord &record) {
+    std::string &buf = record.level >= LogLevel::warn ? err_buf_ : out_buf_;
+
+    // Префикс с датой пересчитывается только при смене секунды
+    int64_t seconds = record.timestamp_ns / 1000000000;
+    if (seconds != prefix_second_) {
+      time_t t = static_cast<time_t>(seconds);
+      tm parts{};
+      localtime_r(&t, &parts);
+      std::strftime(prefix_, sizeof(prefix_), "%Y-%m-%d %H:%M:%S", &parts);
+      prefix_second_ = seconds;
+    }
+    char head[96];
+    int n = std::snprintf(head, sizeof(head), "%s.%06lld %s [t%u] ", prefix_,
+                          static_cast<long long>(
+                              (record.timestamp_ns % 1000000000) / 1000),
+                          log_level_name(record.level), record.thread);
+    buf.append(head, static_cast<size_t>(n));
+    buf.append(record.text, record.len);
+    buf += '\n';
+  }
+
+  static void flush_fd(int fd, std::string &buf) {
+    size_t off = 0;
+    while (off < buf.size()) {
+      ssize_t n = write(fd, buf.data() + off, buf.size() - off);
+      if (n <= 0)
+        break;
+      off += static_cast<size_t>(n);
+    }
+    buf.clear();
+  }
+
+  std::mutex registry_mtx_;
+  std::vector<std::shared_ptr<ThreadRing>> rings_;
+  std::atomic<uint64_t> registry_version_{0};
+  std::atomic<uint32_t> next_thread_id_{0};
+  std::atomic<bool> stop_{false};
+  // Поток вывода спит в idle_wait и ждет сигнала на wake_fd_
+  alignas(kCacheLineSize) std::atomic<bool> sleeping_{false};
+  int wake_fd_;
+
+  // Состояние потока вывода
+  std::vector<const LogRecord *> batch_;
+  std::vector<size_t> counts_;
+  std::string out_buf_;
+  std::string err_buf_;
+  char prefix_[32] = {};
+  int64_t prefix_second_ = -1;
+
+  std::thread writer_;
+};
+
+#define LOG_AT_(threshold, level, expr)                                        \
+  do {                                                                         \
+    if constexpr (LOG_LEVEL <= threshold) {                                    \
+      if (LogRecord *log_record_ = Logger::instance().begin(level)) {          \
+        LogStream log_stream_(*log_record_);                                   \
+        log_stream_ << expr;                                                   \
+        Logger::instance().commit();                                           \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+// Использование: LOG_DEBUG("[INGRESS] Command forwarded: " << request_id);
+#define LOG_TRACE(expr) LOG_AT_(LOG_LEVEL_TRACE, LogLevel::trace, expr)
+#define LOG_DEBUG(expr) LOG_AT_(LOG_LEVEL_DEBUG, LogLevel::debug, expr)
+#define LOG_INFO(expr) LOG_AT_(LOG_LEVEL_INFO, LogLevel::info, expr)
+#define LOG_WARN(expr) LOG_AT_(LOG_LEVEL_WARN, LogLevel::warn, expr)
+#define LOG_ERROR(expr) LOG_AT_(LOG_LEVEL_ERROR, LogLevel::error, expr)
+
+#endif
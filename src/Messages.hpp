@@ -1,6 +1,13 @@
 #ifndef MESSAGES_H
 #define MESSAGES_H
 
+#include "Ids.hpp"
+#include "JsonParser.hpp"
+#include "ResponseBuffer.hpp"
+#include "Trace.hpp"
+
+#include <cstring>
+#include <memory>
 #include <nlohmann/json.hpp>
 #include <string>
 #include <netinet/in.h>
@@ -8,41 +15,98 @@
 
 using json = nlohmann::json;
 
+// Неизменяемые байты команды. Один буфер на запрос, при рассылке по
+// нескольким MSC копируется только указатель
+using SharedPayload = std::shared_ptr<const std::string>;
+
+inline SharedPayload make_payload(const char *data, size_t len) {
+    return std::make_shared<const std::string>(data, len);
+}
+
+// Команда для MSC: исходный JSON-объект, в котором request_id равен
+// идентификатору шлюза. По нему MSC отвечает, а агент находит запрос.
+// request_id_offset/length - положение значения request_id клиента
+// (npos, если поля нет, тогда оно добавляется первым полем объекта)
+inline SharedPayload make_msc_payload(const char *data, size_t len,
+                                      size_t request_id_offset,
+                                      size_t request_id_length,
+                                      std::string_view wire_id) {
+    std::string out;
+    out.reserve(len + wire_id.size() + 16);
+    if (request_id_offset != std::string::npos) {
+        out.append(data, request_id_offset);
+        append_json_string(out, wire_id);
+        out.append(data + request_id_offset + request_id_length,
+                   len - request_id_offset - request_id_length);
+    } else {
+        // Команда уже проверена, первый непробельный символ - '{', а
+        // объект непуст (в нем есть command)
+        const char *brace = static_cast<const char *>(std::memchr(data, '{', len));
+        size_t head = brace ? static_cast<size_t>(brace - data) + 1 : 0;
+        out.append(data, head);
+        out += "\"request_id\":";
+        append_json_string(out, wire_id);
+        out += ',';
+        out.append(data + head, len - head);
+    }
+    return std::make_shared<const std::string>(std::move(out));
+}
+
+// Команда после валидации: исходный текст и уже извлеченный target,
+// повторно JSON не разбирается
 struct ValidatedCommand final {
-    json cmd;
+    SharedPayload payload;
+    std::string target;
+    // client_request_id клиента в исходном JSON виде или пусто
+    std::string client_request_id;
     sockaddr_in original_sender;
-    std::string request_id;
-    ValidatedCommand(json c, sockaddr_in s, std::string rid)
-        : cmd(std::move(c)), original_sender(s), request_id(std::move(rid)) {}
+    RequestId request_id;
+    // Трасса, если запрос попал в выборку, иначе пусто
+    std::shared_ptr<RequestTrace> trace;
+    ValidatedCommand(SharedPayload p, std::string t, std::string client_id,
+                     sockaddr_in s, RequestId rid,
+                     std::shared_ptr<RequestTrace> tr = nullptr)
+        : payload(std::move(p)), target(std::move(t)),
+          client_request_id(std::move(client_id)), original_sender(s),
+          request_id(rid), trace(std::move(tr)) {}
 };
 
 struct SubCommand final {
-    json sub_cmd;
-    std::string request_id;
-    std::string target_agent_id;
-    SubCommand(json c, std::string rid, std::string aid)
-        : sub_cmd(std::move(c)), request_id(std::move(rid)), target_agent_id(std::move(aid)) {}
+    SharedPayload payload;
+    RequestId request_id;
+    AgentIndex target_agent;
+    SubCommand(SharedPayload p, RequestId rid, AgentIndex aid)
+        : payload(std::move(p)), request_id(rid), target_agent(aid) {}
 };
 
+// Ответ MSC в исходном виде, JSON-объект уже проверен агентом
 struct AgentReply final {
-    json response;
-    std::string request_id;
-    std::string agent_id;
+    std::string payload;
+    RequestId request_id;
+    AgentIndex agent;
     bool success;
-    AgentReply(json r, std::string rid, std::string aid, bool s = true)
-        : response(std::move(r)), request_id(std::move(rid)), agent_id(std::move(aid)), success(s) {}
+    // Отметки для трассы: отправка команды в MSC и прием ответа
+    TracePoint msc_sent;
+    TracePoint msc_received;
+    AgentReply(std::string p, RequestId rid, AgentIndex aid, bool s = true,
+               TracePoint sent = {}, TracePoint received = {})
+        : payload(std::move(p)), request_id(rid), agent(aid), success(s),
+          msc_sent(sent), msc_received(received) {}
 };
 
 struct FinalResponse final {
     std::string response_json;
     sockaddr_in destination;
-    FinalResponse(std::string r, sockaddr_in d)
-        : response_json(std::move(r)), destination(d) {}
+    std::shared_ptr<RequestTrace> trace;
+    FinalResponse(std::string r, sockaddr_in d,
+                  std::shared_ptr<RequestTrace> tr = nullptr)
+        : response_json(std::move(r)), destination(d), trace(std::move(tr)) {}
 };
 
+// Асинхронное событие от MSC в исходном виде
 struct Event final {
-    json event_data;
-    explicit Event(json e) : event_data(std::move(e)) {}
+    std::string payload;
+    explicit Event(std::string p) : payload(std::move(p)) {}
 };
 
 struct IncomingMscPacket final {
@@ -52,10 +116,18 @@ struct IncomingMscPacket final {
         : agent_id(std::move(aid)), packet_data(std::move(data)) {}
 };
 
+// Новые настройки работающего MSC агента после перечитывания конфига
+struct ReconfigureMsc final {
+    MscAgentSettings settings;
+    explicit ReconfigureMsc(MscAgentSettings s) : settings(std::move(s)) {}
+};
+
 // Служебные сигналы для агентов
 struct ProcessQueue final : public so_5::signal_t {};
 struct CheckResponses final : public so_5::signal_t {};
 struct ReadResponses final : public so_5::signal_t {};
 struct ProcessIncomingPackets final : public so_5::signal_t {};
+struct CheckMscWindow final : public so_5::signal_t {};
+struct FlushMscEgress final : public so_5::signal_t {};
 
 #endif
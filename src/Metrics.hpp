@@ -0,0 +1,344 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "BoundedRing.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Метрики конвейера: счетчики и гистограммы задержек по стадиям. Запись не
+// берет блокировок: каждый поток пишет в свою полосу (stripe), полосы
+// суммируются только при чтении.
+
+constexpr size_t kMetricStripes = 16;
+
+// Номер полосы текущего потока, выдается по кругу при первом обращении
+inline size_t metric_stripe() {
+  static std::atomic<size_t> next{0};
+  thread_local size_t stripe =
+      next.fetch_add(1, std::memory_order_relaxed) % kMetricStripes;
+  return stripe;
+}
+
+class Counter {
+public:
+  void add(uint64_t n = 1) {
+    slots_[metric_stripe()].value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  uint64_t value() const {
+    uint64_t sum = 0;
+    for (const auto &slot : slots_)
+      sum += slot.value.load(std::memory_order_relaxed);
+    return sum;
+  }
+
+private:
+  struct alignas(kCacheLineSize) Slot {
+    std::atomic<uint64_t> value{0};
+  };
+  Slot slots_[kMetricStripes];
+};
+
+// Гистограмма задержек в наносекундах с лог-линейными корзинами, как в
+// HdrHistogram: каждая степень двойки делится на 32 корзины, поэтому
+// относительная ошибка квантиля не больше ~3%. Диапазон до 2^43 нс (~2.4 ч),
+// большие значения попадают в последнюю корзину.
+class LatencyHistogram {
+public:
+  static constexpr int kSubBits = 5;
+  static constexpr uint64_t kSub = 1ull << kSubBits;
+  static constexpr int kMaxExp = 42;
+  static constexpr size_t kBuckets = kSub + (kMaxExp - kSubBits + 1) * kSub;
+  static constexpr size_t kStripes = 8;
+
+  struct Snapshot {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    std::vector<uint64_t> buckets;
+
+    // Значение квантиля q в [0, 1], середина соответствующей корзины
+    uint64_t quantile(double q) const {
+      if (count == 0)
+        return 0;
+      uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(count));
+      if (rank >= count)
+        rank = count - 1;
+      uint64_t seen = 0;
+      for (size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen > rank)
+          return std::min(bucket_mid(i), max);
+      }
+      return max;
+    }
+  };
+
+  LatencyHistogram() : stripes_(std::make_unique<Stripe[]>(kStripes)) {}
+
+  void record(uint64_t ns) {
+    Stripe &s = stripes_[metric_stripe() % kStripes];
+    s.buckets[bucket_index(ns)].fetch_add(1, std::memory_order_relaxed);
+    s.count.fetch_add(1, std::memory_order_relaxed);
+    s.sum.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t prev = s.max.load(std::memory_order_relaxed);
+    while (ns > prev &&
+           !s.max.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {
+    }
+  }
+
+  template <typename Duration> void record(Duration d) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    record(static_cast<uint64_t>(ns > 0 ? ns : 0));
+  }
+
+  Snapshot snapshot() const {
+    Snapshot snap;
+    snap.buckets.assign(kBuckets, 0);
+    for (size_t i = 0; i < kStripes; ++i) {
+      const Stripe &s = stripes_[i];
+      snap.count += s.count.load(std::memory_order_relaxed);
+      snap.sum += s.sum.load(std::memory_order_relaxed);
+      snap.max = std::max(snap.max, s.max.load(std::memory_order_relaxed));
+      for (size_t b = 0; b < kBuckets; ++b)
+        snap.buckets[b] += s.buckets[b].load(std::memory_order_relaxed);
+    }
+    return snap;
+  }
+
+  static size_t bucket_index(uint64_t v) {
+    if (v < kSub)
+      return static_cast<size_t>(v);
+    int exp = 63 - __builtin_clzll(v);
+    if (exp > kMaxExp)
+      return kBuckets - 1;
+    uint64_t sub = (v >> (exp - kSubBits)) - kSub;
+    return kSub + static_cast<size_t>(exp - kSubBits) * kSub + sub;
+  }
+
+  static uint64_t bucket_mid(size_t index) {
+    if (index < kSub)
+      return index;
+    int exp = static_cast<int>((index - kSub) / kSub) + kSubBits;
+    uint64_t sub = (index - kSub) % kSub;
+    uint64_t width = 1ull << (exp - kSubBits);
+    return ((kSub + sub) << (exp - kSubBits)) + width / 2;
+  }
+
+private:
+  struct alignas(kCacheLineSize) Stripe {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+    std::atomic<uint64_t> buckets[kBuckets];
+  };
+  std::unique_ptr<Stripe[]> stripes_;
+};
+
+// Все метрики процесса. Поля доступны напрямую, чтобы запись на горячем
+// пути была одним атомарным сложением без поиска по имени
+class Metrics {
+public:
+  static Metrics &instance() {
+    static Metrics metrics;
+    return metrics;
+  }
+
+  // Поток приема (epoll или io_uring)
+  Counter epoll_datagrams;  // Принятые датаграммы
+  Counter epoll_truncated;  // Датаграммы больше max_datagram_size
+  Counter pool_exhausted;   // Отброшены из-за пустого PacketPool
+  LatencyHistogram epoll_batch; // Обработка одной пачки recvmmsg / CQE
+  Counter receive_syscalls; // epoll_wait, recvmmsg, io_uring_enter
+
+  // Ingress
+  Counter ingress_commands;           // Принятые команды
+  Counter ingress_rejected;           // Не прошли валидацию
+  LatencyHistogram ingress_queue_wait; // От приема до извлечения из очереди
+  LatencyHistogram ingress_parse;      // Разбор и проверка JSON
+
+  // Dispatcher
+  Counter dispatched_commands;     // Разосланные команды
+  Counter dispatch_errors;         // Неверный или пустой target
+  Counter msc_timeouts;            // Ветки, не ответившие вовремя
+  Counter final_responses;         // Отправленные финальные ответы
+  LatencyHistogram dispatch_fanout; // Обработка ValidatedCommand
+  LatencyHistogram msc_round_trip;  // От рассылки до ответа MSC
+  LatencyHistogram request_total;   // От рассылки до финального ответа
+
+  // MSC и отправка ответа
+  Counter msc_replies;            // Ответы MSC на команды
+  Counter msc_events;             // Асинхронные события MSC
+  Counter msc_unmatched;          // Ответы без команды в окне (поздние, чужие)
+  Counter msc_backlogged;         // Команды, ждавшие места в окне MSC
+  Counter msc_rejected;           // Отказы: окно и очередь ожидания полны
+  Counter msc_expired;            // Команды, вышедшие из окна без ответа
+  Counter msc_unknown_source;     // Пакеты на общий порт MSC от чужого адреса
+  Counter msc_sent;               // Команды, отправленные в MSC
+  Counter msc_send_syscalls;      // sendto и sendmmsg на отправку в MSC
+  LatencyHistogram final_send;    // Отправка финального ответа клиенту
+
+  // Перечитывание конфига
+  Counter config_reloads;        // Примененные конфиги
+  Counter config_reload_errors;  // Конфиги, отвергнутые при разборе
+  Counter config_reload_denied;  // "reload" на порт метрик не с loopback
+
+  // Выдача метрик
+  Counter metrics_truncated;     // Ответы на UDP порт, не влезшие в датаграмму
+
+  // Значения, которые снимаются в момент чтения (глубина очередей и т.п.)
+  void add_gauge(std::string name, std::string help,
+                 std::function<double()> read) {
+    std::lock_guard lock(gauges_mtx_);
+    gauges_.push_back({std::move(name), std::move(help), std::move(read)});
+  }
+
+  // Текстовый формат Prometheus. Гистограммы выводятся как summary с
+  // квантилями 0.5, 0.99 и 0.999, время в секундах
+  std::string render_prometheus() {
+    std::string out;
+    out.reserve(8192);
+    for (const auto &c : counters_) {
+      out += "# HELP " + c.name + " " + c.help + "\n";
+      out += "# TYPE " + c.name + " counter\n";
+      out += c.name + " " + std::to_string(c.counter->value()) + "\n";
+    }
+    for (const auto &h : histograms_) {
+      auto snap = h.histogram->snapshot();
+      out += "# HELP " + h.name + " " + h.help + "\n";
+      out += "# TYPE " + h.name + " summary\n";
+      for (double q : {0.5, 0.99, 0.999}) {
+        char line[128];
+        std::snprintf(line, sizeof(line), "%s{quantile=\"%g\"} %.9f\n",
+                      h.name.c_str(), q, snap.quantile(q) / 1e9);
+        out += line;
+      }
+      char line[128];
+      std::snprintf(line, sizeof(line), "%s_sum %.9f\n", h.name.c_str(),
+                    snap.sum / 1e9);
+      out += line;
+      out += h.name + "_count " + std::to_string(snap.count) + "\n";
+      // Максимум отдельным семейством, summary других рядов не допускает
+      out += "# TYPE " + h.name + "_max gauge\n";
+      std::snprintf(line, sizeof(line), "%s_max %.9f\n", h.name.c_str(),
+                    snap.max / 1e9);
+      out += line;
+    }
+    std::lock_guard lock(gauges_mtx_);
+    for (const auto &g : gauges_) {
+      out += "# HELP " + g.name + " " + g.help + "\n";
+      out += "# TYPE " + g.name + " gauge\n";
+      char line[160];
+      std::snprintf(line, sizeof(line), "%s %.17g\n", g.name.c_str(),
+                    g.read());
+      out += line;
+    }
+    return out;
+  }
+
+private:
+  struct NamedCounter {
+    std::string name;
+    std::string help;
+    const Counter *counter;
+  };
+  struct NamedHistogram {
+    std::string name;
+    std::string help;
+    const LatencyHistogram *histogram;
+  };
+  struct Gauge {
+    std::string name;
+    std::string help;
+    std::function<double()> read;
+  };
+
+  Metrics() {
+    counters_ = {
+        {"gateway_epoll_datagrams_total", "Datagrams received by the receive thread",
+         &epoll_datagrams},
+        {"gateway_epoll_truncated_total", "Datagrams truncated to max_datagram_size",
+         &epoll_truncated},
+        {"gateway_packet_pool_exhausted_total",
+         "Datagrams dropped because the packet pool was empty",
+         &pool_exhausted},
+        {"gateway_receive_syscalls_total",
+         "System calls made by the receive thread", &receive_syscalls},
+        {"gateway_ingress_commands_total", "Commands accepted by ingress",
+         &ingress_commands},
+        {"gateway_ingress_rejected_total", "Commands rejected by validation",
+         &ingress_rejected},
+        {"gateway_dispatched_commands_total", "Commands fanned out to MSC agents",
+         &dispatched_commands},
+        {"gateway_dispatch_errors_total", "Commands with an invalid or empty target",
+         &dispatch_errors},
+        {"gateway_msc_timeouts_total", "MSC branches that timed out",
+         &msc_timeouts},
+        {"gateway_final_responses_total", "Final responses sent to clients",
+         &final_responses},
+        {"gateway_msc_replies_total", "Command replies received from MSC",
+         &msc_replies},
+        {"gateway_msc_events_total", "Asynchronous events received from MSC",
+         &msc_events},
+        {"gateway_msc_unmatched_replies_total",
+         "MSC replies without a matching in-flight command", &msc_unmatched},
+        {"gateway_msc_backlogged_total",
+         "Commands queued behind a full MSC in-flight window", &msc_backlogged},
+        {"gateway_msc_rejected_total",
+         "Commands rejected because the MSC window and backlog were full",
+         &msc_rejected},
+        {"gateway_msc_expired_total",
+         "In-flight MSC commands released without a reply", &msc_expired},
+        {"gateway_msc_unknown_source_total",
+         "Datagrams on a shared MSC port from an unconfigured address",
+         &msc_unknown_source},
+        {"gateway_msc_sent_total", "Command datagrams sent to MSC",
+         &msc_sent},
+        {"gateway_msc_send_syscalls_total",
+         "System calls made to send commands to MSC", &msc_send_syscalls},
+        {"gateway_config_reloads_total", "Configuration reloads applied",
+         &config_reloads},
+        {"gateway_config_reload_errors_total",
+         "Configuration reloads rejected as invalid", &config_reload_errors},
+        {"gateway_config_reload_denied_total",
+         "Reload requests dropped because they did not come from loopback",
+         &config_reload_denied},
+        {"gateway_metrics_truncated_total",
+         "Metrics replies cut to fit one UDP datagram", &metrics_truncated},
+    };
+    histograms_ = {
+        {"gateway_epoll_batch_seconds", "Time to process one receive batch",
+         &epoll_batch},
+        {"gateway_ingress_queue_wait_seconds",
+         "Time from receive to dequeue by ingress", &ingress_queue_wait},
+        {"gateway_ingress_parse_seconds", "Command validation time",
+         &ingress_parse},
+        {"gateway_dispatch_fanout_seconds", "Time to fan a command out to MSC",
+         &dispatch_fanout},
+        {"gateway_msc_round_trip_seconds", "Time from fan-out to MSC reply",
+         &msc_round_trip},
+        {"gateway_request_total_seconds", "Time from fan-out to final response",
+         &request_total},
+        {"gateway_final_send_seconds", "Time to send the final response",
+         &final_send},
+    };
+  }
+
+  std::vector<NamedCounter> counters_;
+  std::vector<NamedHistogram> histograms_;
+  std::mutex gauges_mtx_;
+  std::vector<Gauge> gauges_;
+};
+
+inline Metrics &metrics() { return Metrics::instance(); }
+
+#endif
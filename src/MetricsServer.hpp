@@ -0,0 +1,182 @@
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include "JsonParser.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "NetworkUtils.hpp"
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <netinet/in.h>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+// Отдача метрик наружу на отдельном потоке, чтобы снятие снимка не мешало
+// конвейеру. Два способа, оба необязательны:
+//  - UDP порт: на любую датаграмму отправителю уходит текст Prometheus,
+//    например `echo | nc -u -w1 127.0.0.1 9100`. Текст больше одной
+//    датаграммы обрезается по целой строке с пометкой в конце, для
+//    большого числа MSC нужен файл. Датаграмма "reload" с loopback адреса
+//    вместо этого перечитывает конфиг, как SIGHUP. С других адресов она
+//    отбрасывается без ответа: порт отдает статистику наружу, а управлять
+//    шлюзом можно только с той же машины;
+//  - файл для textfile collector: перезаписывается через rename раз в
+//    textfile_interval_ms.
+class MetricsServer {
+public:
+  // Размер ответа ограничен одной UDP датаграммой
+  static constexpr size_t kMaxReplySize = 65507;
+
+  MetricsServer(const MetricsSettings &settings, std::atomic<bool> &running)
+      : settings_(settings), running_(running) {}
+
+  MetricsServer(const MetricsServer &) = delete;
+  MetricsServer &operator=(const MetricsServer &) = delete;
+
+  ~MetricsServer() { join(); }
+
+  // false, если выдача настроена, но порт открыть не удалось
+  bool start() {
+    if (settings_.listen_address.empty() && settings_.textfile_path.empty())
+      return true;
+    if (!settings_.listen_address.empty()) {
+      sock_ = socket(AF_INET, SOCK_DGRAM, 0);
+      sockaddr_in local = parse_address(settings_.listen_address);
+      if (sock_ < 0 || bind(sock_, reinterpret_cast<sockaddr *>(&local),
+                            sizeof(local)) < 0) {
+        LOG_ERROR("bind для метрик (" << settings_.listen_address << ")");
+        if (sock_ >= 0)
+          close(sock_);
+        sock_ = -1;
+        return false;
+      }
+      // Таймаут нужен, чтобы поток проверял флаг остановки и писал файл
+      timeval timeout{0, 100 * 1000};
+      setsockopt(sock_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    thread_ = std::thread([this] { run(); });
+    return true;
+  }
+
+  void join() {
+    if (thread_.joinable())
+      thread_.join();
+    if (sock_ >= 0) {
+      close(sock_);
+      sock_ = -1;
+    }
+  }
+
+private:
+  static bool is_reload(std::string_view request) {
+    while (!request.empty() &&
+           (request.back() == '\n' || request.back() == '\r'))
+      request.remove_suffix(1);
+    return request == "reload";
+  }
+
+  // 127.0.0.0/8
+  static bool is_loopback(const sockaddr_in &peer) {
+    return (ntohl(peer.sin_addr.s_addr) >> 24) == 127;
+  }
+
+  void run() {
+    auto next_dump = std::chrono::steady_clock::now();
+    char request[512];
+    while (running_) {
+      if (sock_ >= 0) {
+        sockaddr_in peer{};
+        socklen_t peer_len = sizeof(peer);
+        ssize_t n = recvfrom(sock_, request, sizeof(request), 0,
+                             reinterpret_cast<sockaddr *>(&peer), &peer_len);
+        bool reload =
+            n >= 0 &&
+            is_reload(std::string_view(request, static_cast<size_t>(n)));
+        if (reload && !is_loopback(peer)) {
+          // Чужие запросы только считаются, в лог пишется первый, чтобы
+          // их поток не забивал лог
+          metrics().config_reload_denied.add();
+          if (!reload_denied_logged_) {
+            reload_denied_logged_ = true;
+            char from[INET_ADDRSTRLEN] = "?";
+            inet_ntop(AF_INET, &peer.sin_addr, from, sizeof(from));
+            LOG_WARN("Запрос reload на порт метрик не с loopback (" << from
+                     << ") отброшен, дальше такие только считаются");
+          }
+        } else if (reload) {
+          // Сигнал заблокирован во всех потоках, его примет main через
+          // signalfd, так что путь перечитывания один
+          kill(getpid(), SIGHUP);
+          std::string_view reply = "reload requested\n";
+          sendto(sock_, reply.data(), reply.size(), 0,
+                 reinterpret_cast<const sockaddr *>(&peer), peer_len);
+        } else if (n >= 0) {
+          std::string text = metrics().render_prometheus();
+          if (text.size() > kMaxReplySize)
+            truncate_reply(text);
+          sendto(sock_, text.data(), text.size(), 0,
+                 reinterpret_cast<const sockaddr *>(&peer), peer_len);
+        }
+      } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+
+      if (!settings_.textfile_path.empty() &&
+          std::chrono::steady_clock::now() >= next_dump) {
+        write_textfile();
+        next_dump = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(settings_.textfile_interval_ms);
+      }
+    }
+    // Последний снимок, чтобы в файле остались итоговые значения
+    if (!settings_.textfile_path.empty())
+      write_textfile();
+  }
+
+  // Обрезает текст по последней целой строке, которая влезает в датаграмму
+  // вместе с пометкой об обрезке. Полный текст пишется только в файл
+  void truncate_reply(std::string &text) {
+    static constexpr std::string_view kNote =
+        "# truncated: reply exceeds one datagram, use metrics.textfile_path\n";
+    size_t end = text.rfind('\n', kMaxReplySize - kNote.size() - 1);
+    text.resize(end == std::string::npos ? 0 : end + 1);
+    text += kNote;
+    metrics().metrics_truncated.add();
+    if (!truncation_logged_) {
+      truncation_logged_ = true;
+      LOG_WARN("Метрики не помещаются в одну UDP датаграмму и отдаются "
+               "обрезанными, полный текст - через metrics.textfile_path");
+    }
+  }
+
+  void write_textfile() {
+    std::string tmp = settings_.textfile_path + ".tmp";
+    std::FILE *f = std::fopen(tmp.c_str(), "w");
+    if (!f) {
+      LOG_ERROR("не удалось открыть " << tmp);
+      return;
+    }
+    std::string text = metrics().render_prometheus();
+    bool ok = std::fwrite(text.data(), 1, text.size(), f) == text.size();
+    ok = std::fclose(f) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), settings_.textfile_path.c_str()) != 0)
+      LOG_ERROR("не удалось записать " << settings_.textfile_path);
+  }
+
+  MetricsSettings settings_;
+  std::atomic<bool> &running_;
+  int sock_ = -1;
+  std::thread thread_;
+  // Предупреждение об обрезке пишется в лог один раз
+  bool truncation_logged_ = false;
+  bool reload_denied_logged_ = false;
+};
+
+#endif
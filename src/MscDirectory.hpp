@@ -0,0 +1,68 @@
+#ifndef MSC_DIRECTORY_H
+#define MSC_DIRECTORY_H
+
+#include "Ids.hpp"
+#include "JsonParser.hpp"
+#include "PendingRequests.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <so_5/all.hpp>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Неизменяемый снимок MSC агентов: кому диспетчер рассылает команды и какие
+// порты слушают потоки приема. При перечитывании конфига строится новый
+// снимок, старый доживает у тех, кто его еще держит.
+//
+// У удаленного агента остается пустой mbox и id для ответов, которые еще в
+// пути. Его номер MscHost отдает новому агенту не раньше, чем истекут все
+// запросы, разосланные при нем
+struct MscTopology {
+  // Работающие агенты в порядке конфига
+  std::vector<MscAgentSettings> agents;
+  // Дальше все по номеру агента
+  std::vector<so_5::mbox_t> mboxes;
+  // id в виде готовых JSON-строк для вставки в ответ
+  std::vector<std::string> id_json;
+  // Таймаут ответа каждого агента, не больше общего таймаута команды
+  std::shared_ptr<const AgentTimeouts> timeouts;
+  // Строковые id работающих агентов в их номера
+  std::unordered_map<std::string, AgentIndex> by_id;
+
+  std::optional<AgentIndex> find(const std::string &id) const {
+    auto it = by_id.find(id);
+    if (it == by_id.end())
+      return std::nullopt;
+    return it->second;
+  }
+};
+
+// Текущий снимок MSC. Публикует его только main, читают обработчики
+// диспетчера и потоки приема: загрузка снимка - одна атомарная операция,
+// поэтому замена не останавливает запросы к агентам, которых она не
+// касается
+class MscDirectory {
+public:
+  std::shared_ptr<const MscTopology> current() const {
+    return topology_.load(std::memory_order_acquire);
+  }
+
+  // Номер снимка. Потоки приема сверяют его на каждом круге и разбирают
+  // снимок, только если он сменился
+  uint64_t version() const { return version_.load(std::memory_order_acquire); }
+
+  void publish(std::shared_ptr<const MscTopology> topology) {
+    topology_.store(std::move(topology), std::memory_order_release);
+    version_.fetch_add(1, std::memory_order_acq_rel);
+  }
+
+private:
+  std::atomic<std::shared_ptr<const MscTopology>> topology_;
+  std::atomic<uint64_t> version_{0};
+};
+
+#endif
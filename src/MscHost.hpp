@@ -0,0 +1,300 @@
+#ifndef MSC_HOST_H
+#define MSC_HOST_H
+
+#include "AgentPools.hpp"
+#include "Agents.hpp"
+#include "JsonParser.hpp"
+#include "Lifecycle.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "MscDirectory.hpp"
+#include "NetworkUtils.hpp"
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <set>
+#include <so_5/all.hpp>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Агенты MSC и их публикация в MscDirectory. Каждый агент - своя
+// кооперация на пуле роли msc, поэтому при перечитывании конфига
+// останавливаются и запускаются только добавленные и удаленные MSC, а у
+// измененных агент остается и получает ReconfigureMsc.
+//
+// Порядок применения нового конфига:
+//   1. новые агенты регистрируются, но команд еще не получают;
+//   2. публикуется снимок: диспетчер начинает рассылку новым и перестает
+//      удаленным, потоки приема на следующем круге открывают и закрывают
+//      сокеты;
+//   3. кооперации удаленных агентов снимаются с регистрации. Команды,
+//      которые агент не успел отработать, получают ответ msc_stopped.
+// Остальные агенты все это время продолжают работать как обычно.
+//
+// Номер удаленного агента отдается новому, когда его кооперация снята и
+// истек общий таймаут команды: к этому времени все запросы, разосланные
+// по старым снимкам, уже завершены. Поэтому размер таблиц по номеру агента
+// ограничен числом одновременно работающих и недавно удаленных MSC, а не
+// всеми, кто когда-либо был в конфиге.
+//
+// Все методы вызываются только из main
+class MscHost {
+public:
+  MscHost(so_5::environment_t &env, AgentPools &pools,
+          MscDirectory &directory, const Config &config,
+          so_5::mbox_t broadcaster_mbox, so_5::mbox_t dispatcher_mbox,
+          MscEgress &egress, int receive_threads)
+      : env_(env), pools_(pools), directory_(directory), config_(config),
+        broadcaster_mbox_(std::move(broadcaster_mbox)),
+        dispatcher_mbox_(std::move(dispatcher_mbox)), egress_(egress),
+        receive_threads_(receive_threads) {}
+
+  MscHost(const MscHost &) = delete;
+  MscHost &operator=(const MscHost &) = delete;
+
+  // Агенты MSC из конфига, с которым шлюз запущен
+  void start() { apply(config_.msc_agents); }
+
+  // Применяет секцию msc_agent нового конфига. Остальные секции требуют
+  // перезапуска: их изменения только пишутся в лог
+  void reload(const Config &fresh) {
+    warn_restart_only(fresh);
+    raise_open_files_limit(static_cast<rlim_t>(fresh.msc_agents.size() + 1) *
+                               static_cast<rlim_t>(receive_threads_) +
+                           1024);
+    apply(fresh.msc_agents);
+    metrics().config_reloads.add();
+  }
+
+private:
+  // Запас к общему таймауту команды до повторного использования номера:
+  // проверка таймаутов у диспетчера идет периодически, а не точно в срок
+  static constexpr std::chrono::seconds kIndexReuseMargin{1};
+
+  struct Running {
+    MscAgentSettings settings;
+    so_5::coop_handle_t coop;
+    so_5::mbox_t mbox;
+    // Взводится, когда кооперация агента снята с регистрации
+    std::shared_ptr<std::atomic<bool>> finished;
+  };
+
+  // Номер удаленного агента, который еще нельзя отдавать
+  struct RetiredIndex {
+    AgentIndex index;
+    std::shared_ptr<std::atomic<bool>> finished;
+    std::chrono::steady_clock::time_point reusable_after;
+  };
+
+  void apply(const std::vector<MscAgentSettings> &wanted) {
+    reclaim_indices();
+    std::vector<MscAgentSettings> agents;
+    std::unordered_set<std::string> wanted_ids;
+    size_t added = 0;
+    size_t changed = 0;
+    for (const auto &item : wanted) {
+      MscAgentSettings msc = item;
+      wanted_ids.insert(msc.id);
+      auto it = running_.find(msc.id);
+      if (it == running_.end()) {
+        msc.index = allocate_index();
+        if (msc.receive_threads > receive_threads_) {
+          LOG_WARN("MSC " << msc.id << ": receive_threads "
+                   << msc.receive_threads << " больше запущенных потоков "
+                   "приема, используется " << receive_threads_);
+          msc.receive_threads = receive_threads_;
+        }
+        start_agent(msc);
+        ++added;
+      } else {
+        Running &agent = it->second;
+        msc.index = agent.settings.index;
+        // Сокет с SO_REUSEPORT или без него открыт при старте агента
+        if (msc.receive_threads != agent.settings.receive_threads) {
+          LOG_WARN("MSC " << msc.id << ": receive_threads меняется только "
+                   "перезапуском");
+          msc.receive_threads = agent.settings.receive_threads;
+        }
+        if (msc.to_string() != agent.settings.to_string()) {
+          so_5::send<ReconfigureMsc>(agent.mbox, msc);
+          timeouts_[msc.index] = timeout_for(msc);
+          agent.settings = msc;
+          ++changed;
+        }
+      }
+      agents.push_back(std::move(msc));
+    }
+
+    std::vector<Running> retired;
+    for (auto it = running_.begin(); it != running_.end();) {
+      if (wanted_ids.count(it->first)) {
+        ++it;
+        continue;
+      }
+      LOG_DEBUG("MSC agent removed: " << it->first);
+      mboxes_[it->second.settings.index] = so_5::mbox_t{};
+      retired.push_back(std::move(it->second));
+      it = running_.erase(it);
+    }
+
+    agents_ = std::move(agents);
+    publish();
+    // Отсчет от публикации: обработчик, взявший старый снимок перед ней, мог
+    // разослать запрос удаленному агенту чуть позже
+    auto reusable_after = std::chrono::steady_clock::now() +
+                          std::chrono::milliseconds(
+                              config_.cmd.response_timeout_ms) +
+                          kIndexReuseMargin;
+    for (auto &agent : retired) {
+      env_.deregister_coop(agent.coop, so_5::dereg_reason::normal);
+      retired_indices_.push_back(
+          {agent.settings.index, agent.finished, reusable_after});
+    }
+
+    LOG_INFO("MSC agents: " << agents_.size() << " running, " << added
+             << " added, " << changed << " reconfigured, " << retired.size()
+             << " removed");
+  }
+
+  void start_agent(const MscAgentSettings &msc) {
+    Running agent{msc, {}, {}, std::make_shared<std::atomic<bool>>(false)};
+    agent.coop = pools_.introduce("msc", [&](so_5::coop_t &coop) {
+      agent.mbox = coop.make_agent<MscAgent>(std::cref(msc), config_.parser,
+                                             broadcaster_mbox_,
+                                             dispatcher_mbox_,
+                                             std::ref(egress_))
+                       ->so_direct_mbox();
+      coop.add_dereg_notificator(
+          [finished = agent.finished](
+              so_5::environment_t &, const so_5::coop_handle_t &,
+              const so_5::coop_dereg_reason_t &) noexcept {
+            finished->store(true, std::memory_order_release);
+          });
+    });
+    std::string quoted;
+    append_json_string(quoted, msc.id);
+    id_json_[msc.index] = std::move(quoted);
+    ids_[msc.index] = msc.id;
+    timeouts_[msc.index] = timeout_for(msc);
+    mboxes_[msc.index] = agent.mbox;
+    running_.emplace(msc.id, std::move(agent));
+    LOG_DEBUG("MSC agent added: " << msc.id << ", номер " << msc.index);
+  }
+
+  // Свободный номер с наименьшим значением или новый в конце таблиц
+  AgentIndex allocate_index() {
+    if (!free_indices_.empty()) {
+      AgentIndex index = *free_indices_.begin();
+      free_indices_.erase(free_indices_.begin());
+      return index;
+    }
+    AgentIndex index = static_cast<AgentIndex>(mboxes_.size());
+    mboxes_.emplace_back();
+    id_json_.emplace_back();
+    ids_.emplace_back();
+    timeouts_.emplace_back();
+    return index;
+  }
+
+  // Возвращает в оборот номера, которые больше нигде не встретятся, и
+  // укорачивает таблицы, если свободен их хвост
+  void reclaim_indices() {
+    auto now = std::chrono::steady_clock::now();
+    auto reusable = [&](const RetiredIndex &retired) {
+      return retired.finished->load(std::memory_order_acquire) &&
+             now >= retired.reusable_after;
+    };
+    for (const auto &retired : retired_indices_) {
+      if (reusable(retired))
+        free_indices_.insert(retired.index);
+    }
+    retired_indices_.erase(std::remove_if(retired_indices_.begin(),
+                                          retired_indices_.end(), reusable),
+                           retired_indices_.end());
+
+    while (!free_indices_.empty() &&
+           *free_indices_.rbegin() + 1 == mboxes_.size()) {
+      free_indices_.erase(std::prev(free_indices_.end()));
+      mboxes_.pop_back();
+      id_json_.pop_back();
+      ids_.pop_back();
+      timeouts_.pop_back();
+    }
+  }
+
+  // Таймаут ответа агента, не больше общего таймаута команды
+  std::chrono::milliseconds timeout_for(const MscAgentSettings &msc) const {
+    return std::chrono::milliseconds(
+        std::min(msc.response_timeout_ms, config_.cmd.response_timeout_ms));
+  }
+
+  void publish() {
+    auto topology = std::make_shared<MscTopology>();
+    topology->agents = agents_;
+    topology->mboxes = mboxes_;
+    topology->id_json = id_json_;
+    topology->timeouts = std::make_shared<const AgentTimeouts>(timeouts_);
+    for (const auto &msc : agents_)
+      topology->by_id.emplace(msc.id, msc.index);
+    directory_.publish(std::move(topology));
+    tracer().set_agent_ids(ids_);
+  }
+
+  void warn_restart_only(const Config &fresh) const {
+    auto check = [](const char *section, const std::string &was,
+                    const std::string &now) {
+      if (was != now)
+        LOG_WARN("Изменения в '" << section << "' применятся только после "
+                 "перезапуска");
+    };
+    auto streams = [](const Config &config) {
+      std::string out;
+      for (const auto &stream : config.stream_ports)
+        out += stream.to_string() + "\n";
+      return out;
+    };
+    check("cmd", config_.cmd.to_string(), fresh.cmd.to_string());
+    check("network", config_.network.to_string(), fresh.network.to_string());
+    check("shutdown", config_.shutdown.to_string(),
+          fresh.shutdown.to_string());
+    check("metrics", config_.metrics.to_string(), fresh.metrics.to_string());
+    check("tracing", config_.tracing.to_string(), fresh.tracing.to_string());
+    check("threading", config_.threading.to_string(),
+          fresh.threading.to_string());
+    check("stream_ports", streams(config_), streams(fresh));
+    if (config_.parser != fresh.parser)
+      LOG_WARN("Изменение 'parser' применится только после перезапуска");
+  }
+
+  so_5::environment_t &env_;
+  AgentPools &pools_;
+  MscDirectory &directory_;
+  // Конфиг, с которым шлюз запущен. Из него берутся общий таймаут команды
+  // и режим разбора, он же - база для предупреждений о секциях, которые на
+  // ходу не меняются
+  const Config &config_;
+  so_5::mbox_t broadcaster_mbox_;
+  so_5::mbox_t dispatcher_mbox_;
+  MscEgress &egress_;
+  // Число потоков приема, на ходу не меняется
+  int receive_threads_;
+
+  // Работающие агенты по id и их настройки в порядке конфига
+  std::unordered_map<std::string, Running> running_;
+  std::vector<MscAgentSettings> agents_;
+  // По номеру агента. У свободных и удаленных номеров пустой mbox, id
+  // удаленных остается для ответов, которые еще в пути
+  std::vector<so_5::mbox_t> mboxes_;
+  std::vector<std::string> id_json_;
+  std::vector<std::string> ids_;
+  AgentTimeouts timeouts_;
+  std::vector<RetiredIndex> retired_indices_;
+  std::set<AgentIndex> free_indices_;
+};
+
+#endif
@@ -3,145 +3,895 @@
 
 #include "CommandQueue.hpp"
 #include "JsonParser.hpp"
+#include "Lifecycle.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "IoUring.hpp"
+#include "Messages.hpp"
+#include "MscDirectory.hpp"
+#include "PacketPool.hpp"
 
+#include <algorithm>
 #include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <fcntl.h>
-#include <iostream>
+#include <memory>
+#include <optional>
+#include <poll.h>
+#include <string_view>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <unordered_map>
 #include <vector>
 
-#define DEBUG
+// Исходящий UDP канал с долгоживущим сокетом. Внутри нет синхронизации:
+// send() можно звать из нескольких потоков (sendto на одном сокете
+// безопасен), а enqueue() и flush() - только из потока владельца.
+class UdpSender {
+public:
+  UdpSender() : sock_(socket(AF_INET, SOCK_DGRAM, 0)) {
+    if (sock_ < 0) {
+      LOG_ERROR("невозможно создать UDP сокет");
+    }
+  }
 
-// Отправка пакета по UDP
-void send_udp(const sockaddr_in &addr, const std::string &message) {
-  int sock = socket(AF_INET, SOCK_DGRAM, 0);
-  if (sock < 0) {
-    std::cerr << "Ошибка: невозможно создать UDP сокет" << std::endl;
-    return;
+  ~UdpSender() {
+    if (sock_ >= 0)
+      close(sock_);
+  }
+
+  UdpSender(const UdpSender &) = delete;
+  UdpSender &operator=(const UdpSender &) = delete;
+
+  // Немедленная отправка одного пакета
+  void send(const sockaddr_in &addr, std::string_view message) {
+    if (sock_ < 0)
+      return;
+    if (sendto(sock_, message.data(), message.size(), 0,
+               reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) < 0) {
+      LOG_ERROR("sendto");
+    }
+    LOG_TRACE("Отправлен UDP пакет: " << message);
   }
-  if (sendto(sock, message.c_str(), message.size(), 0, (struct sockaddr *)&addr,
-             sizeof(addr)) < 0) {
-    std::cerr << "Ошибка: sendto" << std::endl;
+
+  // Откладывает пакет до вызова flush()
+  void enqueue(const sockaddr_in &addr, std::string message) {
+    pending_.push_back({addr, std::move(message), nullptr});
   }
-#ifdef DEBUG
-  std::cout << "DEBUG: Отправлен UDP пакет: " << message << std::endl;
-#endif
-  close(sock);
-}
 
-// Разбор строки "ip:port" в sockaddr_in
-sockaddr_in parse_address(const std::string &addr_str) {
+  // То же для общего буфера: пакет не копируется
+  void enqueue(const sockaddr_in &addr, SharedPayload payload) {
+    pending_.push_back({addr, {}, std::move(payload)});
+  }
+
+  size_t pending() const { return pending_.size(); }
+
+  // Отправка всех отложенных пакетов. Несколько пакетов уходят одним
+  // sendmmsg. Возвращает число сделанных системных вызовов
+  size_t flush() {
+    if (pending_.empty())
+      return 0;
+    if (pending_.size() == 1 || sock_ < 0) {
+      for (const auto &p : pending_)
+        send(p.addr, p.data());
+      size_t calls = sock_ < 0 ? 0 : pending_.size();
+      pending_.clear();
+      return calls;
+    }
+
+    iovecs_.resize(pending_.size());
+    msgs_.resize(pending_.size());
+    for (size_t i = 0; i < pending_.size(); ++i) {
+      std::string_view data = pending_[i].data();
+      iovecs_[i].iov_base = const_cast<char *>(data.data());
+      iovecs_[i].iov_len = data.size();
+      msgs_[i] = mmsghdr{};
+      msgs_[i].msg_hdr.msg_name = &pending_[i].addr;
+      msgs_[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+      msgs_[i].msg_hdr.msg_iov = &iovecs_[i];
+      msgs_[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    size_t sent = 0;
+    size_t calls = 0;
+    while (sent < msgs_.size()) {
+      int n = sendmmsg(sock_, msgs_.data() + sent, msgs_.size() - sent, 0);
+      ++calls;
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        LOG_ERROR("sendmmsg, потеряно " << msgs_.size() - sent << " пакетов");
+        break;
+      }
+      sent += n;
+    }
+    LOG_DEBUG("Отправлено UDP пакетов одним sendmmsg: " << sent);
+    pending_.clear();
+    return calls;
+  }
+
+private:
+  struct PendingDatagram {
+    sockaddr_in addr;
+    std::string message;
+    // Общий буфер вместо message, если пакет поставлен без копии
+    SharedPayload shared;
+
+    std::string_view data() const {
+      return shared ? std::string_view(*shared) : std::string_view(message);
+    }
+  };
+
+  int sock_;
+  std::vector<PendingDatagram> pending_;
+  // Переиспользуемые между flush() массивы для sendmmsg
+  std::vector<iovec> iovecs_;
+  std::vector<mmsghdr> msgs_;
+};
+
+// Команды в MSC. Обработчики агентов MSC на потоках пула только кладут
+// датаграмму в очередь, отправляет их агент отправки (MscEgressAgent)
+// пачками через sendmmsg, так что рассылка команды с target "all" на N MSC
+// стоит один-два системных вызова, а не N. Агент будится так же, как
+// ingress у CommandQueue: одно уведомление на пачку
+class MscEgress {
+public:
+  // Сколько датаграмм уходит одним sendmmsg
+  static constexpr size_t kBatchSize = 64;
+
+  explicit MscEgress(size_t capacity = 16384) : ring_(capacity) {}
+
+  MscEgress(const MscEgress &) = delete;
+  MscEgress &operator=(const MscEgress &) = delete;
+
+  // Агент отправки. Задается до старта агентов MSC
+  void set_consumer(so_5::mbox_t consumer) { consumer_ = std::move(consumer); }
+
+  // Вызывается агентами MSC с любого потока. Без агента отправки или при
+  // полной очереди датаграмма уходит сразу, отдельным sendto
+  void send(const sockaddr_in &addr, SharedPayload payload) {
+    Datagram datagram{addr, std::move(payload)};
+    if (!consumer_ || !ring_.try_push(datagram)) {
+      sender_.send(addr, *datagram.payload);
+      metrics().msc_sent.add();
+      metrics().msc_send_syscalls.add();
+      return;
+    }
+    if (!wakeup_pending_.exchange(true, std::memory_order_acq_rel))
+      so_5::send<FlushMscEgress>(consumer_);
+  }
+
+  // Вызывается только агентом отправки
+  void flush() {
+    // Сброс до вычитывания: датаграмма, положенная во время отправки,
+    // разбудит агента еще раз
+    wakeup_pending_.store(false, std::memory_order_release);
+    while (auto datagram = ring_.try_pop()) {
+      sender_.enqueue(datagram->addr, std::move(datagram->payload));
+      if (sender_.pending() == kBatchSize)
+        send_pending();
+    }
+    send_pending();
+  }
+
+private:
+  struct Datagram {
+    sockaddr_in addr;
+    SharedPayload payload;
+  };
+
+  void send_pending() {
+    size_t count = sender_.pending();
+    if (count == 0)
+      return;
+    metrics().msc_send_syscalls.add(sender_.flush());
+    metrics().msc_sent.add(count);
+  }
+
+  BoundedRing<Datagram> ring_;
+  UdpSender sender_;
+  so_5::mbox_t consumer_;
+  alignas(kCacheLineSize) std::atomic<bool> wakeup_pending_{false};
+};
+
+// Разбор строки "ip:port" в sockaddr_in. Не бросает: адреса из конфига уже
+// проверены парсером, а при ошибке пишется лог и возвращается пустой адрес
+inline sockaddr_in parse_address(const std::string &addr_str) {
   sockaddr_in addr{};
   addr.sin_family = AF_INET;
-  size_t colon = addr_str.find(':');
-  if (colon == std::string::npos) {
-    std::cerr << "Ошибка: неверный формат адреса" << std::endl;
+  if (!parse_ipv4_address(addr_str, addr)) {
+    LOG_ERROR("неверный адрес: " << addr_str);
     return addr;
   }
-  std::string ip = addr_str.substr(0, colon);
-  int port = std::stoi(addr_str.substr(colon + 1));
-  addr.sin_port = htons(port);
-  if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) <= 0) {
-    std::cerr << "Ошибка: неверный IP" << std::endl;
-  }
-#ifdef DEBUG
-  std::cout << "DEBUG: Распознан адрес: " << ip << ":" << port << std::endl;
-#endif
+  LOG_DEBUG("Распознан адрес: " << addr_str);
   return addr;
 }
 
-// Поток обработки epoll для приема пакетов
-void epoll_thread(const Config &config, CommandQueue &command_queue,
-                  CommandQueue &msc_queue, std::atomic<bool> &running,
-                  std::unordered_map<std::string, so_5::mbox_t> msc_mboxes) {
-  int epoll_fd = epoll_create1(0);
-  if (epoll_fd < 0) {
-    std::cerr << "Ошибка: epoll_create" << std::endl;
-    return;
+// Предвыделенные заголовки для пакетного чтения датаграмм через recvmmsg.
+// Каждый слот смотрит в буфер из PacketPool, так что ядро пишет данные сразу
+// в буфер, который потом уходит агентам без копирования.
+struct RecvBatch {
+  PacketPool &pool;
+  size_t datagram_size;
+  std::vector<PacketRef> buffers;
+  std::vector<iovec> iovecs;
+  std::vector<sockaddr_in> senders;
+  std::vector<mmsghdr> msgs;
+  // Сюда читаются датаграммы, когда в пуле кончились буферы. Такие пакеты
+  // отбрасываются, но сокет всё равно вычитывается до конца
+  std::unique_ptr<char[]> overflow;
+
+  RecvBatch(PacketPool &p, size_t batch_size)
+      : pool(p), datagram_size(p.buffer_size()), buffers(batch_size),
+        iovecs(batch_size), senders(batch_size), msgs(batch_size),
+        overflow(std::make_unique<char[]>(p.buffer_size())) {
+    for (size_t i = 0; i < batch_size; ++i) {
+      iovecs[i].iov_len = datagram_size;
+      msgs[i].msg_hdr.msg_iov = &iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &senders[i];
+    }
+  }
+
+  size_t size() const { return msgs.size(); }
+
+  // Забирает буфер слота с принятыми данными, слот получит новый при reset()
+  PacketRef take(size_t i) { return std::move(buffers[i]); }
+
+  // Подготовка к очередному recvmmsg: пустые слоты получают буферы из пула,
+  // recvmmsg перезаписывает msg_namelen и msg_flags, восстанавливаем их
+  void reset() {
+    for (size_t i = 0; i < msgs.size(); ++i) {
+      if (!buffers[i])
+        buffers[i] = pool.acquire();
+      iovecs[i].iov_base = buffers[i] ? buffers[i].data() : overflow.get();
+      msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+      msgs[i].msg_hdr.msg_flags = 0;
+      msgs[i].msg_len = 0;
+    }
+  }
+};
+
+// Ключ адреса отправителя для разбора общего сокета MSC
+inline uint64_t source_key(const sockaddr_in &addr) {
+  return (static_cast<uint64_t>(addr.sin_addr.s_addr) << 16) | addr.sin_port;
+}
+
+// Приемные сокеты шлюза и маршрутизация принятых датаграмм: командный порт
+// в очередь ingress, порты MSC в ящики агентов. Общая часть бэкендов
+// приема, поэтому epoll и io_uring дают одинаковый результат.
+//
+// Каждый поток приема держит свой набор сокетов (worker - номер потока):
+// порт с receive_threads = N открывается в потоках 0..N-1 с SO_REUSEPORT.
+// Потоки не делят ничего, кроме очереди команд, пула пакетов и ящиков
+// агентов, а они без блокировок.
+//
+// MSC с одинаковым local_address делят один сокет, агент выбирается по
+// адресу отправителя (remote_address MSC). Так тысячи MSC обходятся одним
+// сокетом вместо тысячи.
+//
+// Порты MSC берутся из MscDirectory и сверяются с ним на каждом круге
+// приема (sync), поэтому перечитывание конфига открывает и закрывает
+// только сокеты добавленных и удаленных адресов. Номер порта (слот) не
+// меняется, пока порт открыт: по нему бэкенды находят порт в событиях
+// epoll и завершениях io_uring
+class ReceivePorts {
+public:
+  // Куда отдать пакет MSC: id порта и ящик агента
+  struct Route {
+    std::string id;
+    so_5::mbox_t mbox;
+  };
+
+  // Всё, что нужно знать о сокете при приеме, разрешается один раз при
+  // регистрации. Командный порт без маршрутов, порт одной MSC - с одним
+  // маршрутом, общий порт - с маршрутами по адресу отправителя.
+  // Свободный слот - fd = -1
+  struct Port {
+    int fd = -1;
+    std::string id;
+    bool cmd = false;
+    Route msc;
+    std::unordered_map<uint64_t, Route> sources;
+    // Локальный адрес порта MSC
+    std::string address;
+    // Адрес удален из конфига, сокет закроет release()
+    bool closing = false;
+  };
+
+  // Что изменил очередной sync: номера открытых и снимаемых портов
+  struct Changes {
+    std::vector<uint32_t> added;
+    std::vector<uint32_t> removed;
+  };
+
+  ReceivePorts(const Config &config, CommandQueue &command_queue,
+               const MscDirectory &msc_directory, so_5::mbox_t ingress_mbox,
+               int worker = 0)
+      : command_queue_(command_queue), msc_directory_(msc_directory),
+        ingress_mbox_(std::move(ingress_mbox)), worker_(worker) {
+    // Добавляем командный порт
+    Port cmd;
+    cmd.id = "cmd";
+    cmd.cmd = true;
+    add_socket(config.cmd.local_address, std::move(cmd),
+               config.cmd.receive_threads);
+
+    Changes initial;
+    sync(initial);
+  }
+
+  ~ReceivePorts() {
+    for (const auto &port : ports_) {
+      if (port.fd >= 0)
+        close(port.fd);
+    }
+  }
+
+  ReceivePorts(const ReceivePorts &) = delete;
+  ReceivePorts &operator=(const ReceivePorts &) = delete;
+
+  const std::vector<Port> &ports() const { return ports_; }
+
+  // Сверяет порты MSC с текущим снимком, если он сменился с прошлой
+  // проверки. Сокеты новых адресов открываются сразу, у оставшихся
+  // обновляются маршруты. Снятые порты только помечаются closing и
+  // продолжают принимать: сокет закрывает release(), когда бэкенд снимет с
+  // него прием. false, если снимок не менялся
+  bool sync(Changes &changes) {
+    uint64_t version = msc_directory_.version();
+    if (version == synced_version_)
+      return false;
+    synced_version_ = version;
+    changes.added.clear();
+    changes.removed.clear();
+    auto topology = msc_directory_.current();
+    if (!topology)
+      return false;
+
+    // MSC порты, сгруппированные по локальному адресу в порядке конфига
+    std::vector<std::string> addresses;
+    std::unordered_map<std::string, std::vector<const MscAgentSettings *>>
+        groups;
+    for (const auto &msc : topology->agents) {
+      auto &group = groups[msc.local_address];
+      if (group.empty())
+        addresses.push_back(msc.local_address);
+      group.push_back(&msc);
+    }
+
+    std::unordered_map<std::string, uint32_t> kept;
+    for (const auto &address : addresses) {
+      const auto &group = groups[address];
+      Port port;
+      port.address = address;
+      int threads = 1;
+      for (const MscAgentSettings *msc : group) {
+        threads = std::max(threads, msc->receive_threads);
+        Route route{"msc_" + msc->id, topology->mboxes[msc->index]};
+        if (group.size() == 1) {
+          port.id = route.id;
+          port.msc = std::move(route);
+        } else {
+          port.sources.emplace(
+              source_key(parse_address(msc->remote_address)), std::move(route));
+        }
+      }
+      if (group.size() > 1)
+        port.id = "msc_shared_" + address;
+      if (worker_ >= threads)
+        continue;
+
+      auto it = msc_slots_.find(address);
+      if (it != msc_slots_.end()) {
+        // Сокет остается, меняются только маршруты
+        Port &current = ports_[it->second];
+        current.id = std::move(port.id);
+        current.msc = std::move(port.msc);
+        current.sources = std::move(port.sources);
+        kept.emplace(address, it->second);
+        continue;
+      }
+      if (auto slot = add_socket(address, std::move(port), threads)) {
+        kept.emplace(address, *slot);
+        changes.added.push_back(*slot);
+      }
+    }
+
+    for (const auto &[address, slot] : msc_slots_) {
+      if (kept.count(address))
+        continue;
+      ports_[slot].closing = true;
+      changes.removed.push_back(slot);
+      LOG_DEBUG("Снимается сокет " << ports_[slot].id << " (" << address
+                << "), поток приема " << worker_);
+    }
+    msc_slots_ = std::move(kept);
+    return !changes.added.empty() || !changes.removed.empty();
+  }
+
+  // Закрывает снятый порт. Вызывается, когда бэкенд больше не ждет с него
+  // данных, после этого слот может занять новый порт
+  void release(uint32_t slot) {
+    Port &port = ports_[slot];
+    if (port.fd >= 0)
+      close(port.fd);
+    port = Port{};
+  }
+
+  // Обработка одной принятой датаграммы, буфер передаётся дальше без
+  // копирования. offset - начало данных в буфере
+  void deliver(const Port &port, PacketRef buffer, size_t len,
+               const sockaddr_in &sender, uint32_t offset = 0) {
+    if (port.cmd) {
+      Packet pkt{std::move(buffer), len, port.id, sender};
+      pkt.offset = offset;
+      // Пакеты команд. Если очередь полна и ждет места, ingress будится
+      // сразу, не дожидаясь конца пачки
+      command_queue_.push(std::move(pkt), [this] { wake_ingress(); });
+      LOG_DEBUG("CMD пакет, размер " << len);
+      return;
+    }
+
+    const Route *route = &port.msc;
+    if (!port.sources.empty()) {
+      auto it = port.sources.find(source_key(sender));
+      if (it == port.sources.end()) {
+        metrics().msc_unknown_source.add();
+        LOG_DEBUG("Пакет на " << port.id << " от неизвестного отправителя, "
+                  "порт " << ntohs(sender.sin_port));
+        return;
+      }
+      route = &it->second;
+    }
+    Packet pkt{std::move(buffer), len, route->id, sender};
+    pkt.offset = offset;
+    so_5::send<Packet>(route->mbox, std::move(pkt));
+    LOG_DEBUG("MSC пакет из " << route->id << ", размер " << len);
+  }
+
+  // Будим ingress агента один раз на пачку, если он ещё не уведомлён
+  void notify(const Port &port) {
+    if (port.cmd)
+      wake_ingress();
   }
 
-  std::unordered_map<int, std::string> fd_to_id;
-  std::vector<int> sockets;
+private:
+  void wake_ingress() {
+    if (command_queue_.request_wakeup())
+      so_5::send<ProcessQueue>(ingress_mbox_);
+  }
 
-  auto add_socket = [&](const std::string &addr_str, const std::string &id) {
+  // Номер слота открытого сокета. Свободные слоты занимаются повторно
+  std::optional<uint32_t> add_socket(const std::string &addr_str, Port port,
+                                     int threads) {
+    if (worker_ >= threads)
+      return std::nullopt;
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
     fcntl(sock, F_SETFL, O_NONBLOCK);
+    int one = 1;
+    if (threads > 1)
+      setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
     sockaddr_in local = parse_address(addr_str);
     if (bind(sock, (struct sockaddr *)&local, sizeof(local)) < 0) {
-      std::cerr << "Ошибка: bind для " << addr_str << std::endl;
+      LOG_ERROR("bind для " << addr_str);
       close(sock);
-      return;
+      return std::nullopt;
+    }
+    port.fd = sock;
+    LOG_DEBUG("Добавлен сокет для " << port.id << " (" << addr_str
+              << "), поток приема " << worker_);
+
+    auto free_slot = std::find_if(ports_.begin(), ports_.end(),
+                                  [](const Port &p) { return p.fd < 0; });
+    if (free_slot != ports_.end()) {
+      *free_slot = std::move(port);
+      return static_cast<uint32_t>(free_slot - ports_.begin());
     }
+    ports_.push_back(std::move(port));
+    return static_cast<uint32_t>(ports_.size() - 1);
+  }
+
+  CommandQueue &command_queue_;
+  const MscDirectory &msc_directory_;
+  so_5::mbox_t ingress_mbox_;
+  int worker_;
+  std::vector<Port> ports_;
+  // Слоты открытых портов MSC по локальному адресу
+  std::unordered_map<std::string, uint32_t> msc_slots_;
+  // Версия снимка MscDirectory, с которой сверены порты
+  uint64_t synced_version_ = 0;
+};
+
+// Сколько потоков приема нужно запустить: по максимуму receive_threads
+// среди портов
+inline int receive_thread_count(const Config &config) {
+  int count = config.cmd.receive_threads;
+  for (const auto &msc : config.msc_agents)
+    count = std::max(count, msc.receive_threads);
+  return count;
+}
+
+// Прием через epoll: готовность сокета, затем recvmmsg пачками
+void epoll_receive_loop(const NetworkSettings &network,
+                        PacketPool &packet_pool, ReceivePorts &ports,
+                        std::atomic<bool> &running, StopEvent &stop_event) {
+  int epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0) {
+    LOG_ERROR("epoll_create");
+    return;
+  }
+
+  // Событие остановки будит epoll_wait сразу, не дожидаясь таймаута. Для
+  // сокетов в data.u32 лежит номер порта, для события остановки - kStopTag
+  constexpr uint32_t kStopTag = UINT32_MAX;
+  {
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u32 = kStopTag;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_event.fd(), &ev);
+  }
+  auto watch = [&](uint32_t slot) {
     struct epoll_event ev{};
     ev.events = EPOLLIN | EPOLLET;
-    ev.data.fd = sock;
-    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
-    sockets.push_back(sock);
-    fd_to_id[sock] = id;
-#ifdef DEBUG
-    std::cout << "DEBUG: Добавлен сокет для " << id << " (" << addr_str << ")"
-              << std::endl;
-#endif
+    ev.data.u32 = slot;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ports.ports()[slot].fd, &ev);
   };
-
-  // Добавляем командный порт
-  add_socket(config.cmd.local_address, "cmd");
-  // Добавляем MSC порты
-  for (const auto &msc : config.msc_agents) {
-    add_socket(msc.local_address, "msc_" + msc.id);
+  for (uint32_t i = 0; i < ports.ports().size(); ++i) {
+    if (ports.ports()[i].fd >= 0)
+      watch(i);
   }
 
-  struct epoll_event events[10];
+  const int max_events = network.max_events;
+  std::vector<epoll_event> events(max_events);
+  RecvBatch batch(packet_pool, network.recv_batch_size);
+  ReceivePorts::Changes changes;
+
   while (running) {
-    int nfds = epoll_wait(epoll_fd, events, 10, 100);
+    // Порты MSC после перечитывания конфига. Снятый сокет убирается из epoll
+    // до закрытия, событий с его номером в следующем epoll_wait уже нет
+    if (ports.sync(changes)) {
+      for (uint32_t slot : changes.removed) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ports.ports()[slot].fd, nullptr);
+        ports.release(slot);
+      }
+      for (uint32_t slot : changes.added)
+        watch(slot);
+    }
+
+    int nfds = epoll_wait(epoll_fd, events.data(), max_events, 100);
+    metrics().receive_syscalls.add();
     if (nfds < 0)
       continue;
     for (int i = 0; i < nfds; ++i) {
-      int fd = events[i].data.fd;
-      sockaddr_in sender{};
-      socklen_t slen = sizeof(sender);
-      char buf[4096];
-      ssize_t recv_len =
-          recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&sender, &slen);
-      if (recv_len > 0) {
-        std::string port_id = fd_to_id[fd];
-        std::vector<uint8_t> buffer_data(reinterpret_cast<uint8_t *>(buf),
-                                         reinterpret_cast<uint8_t *>(buf) +
-                                             recv_len);
-        Packet pkt{buffer_data, static_cast<size_t>(recv_len), port_id, sender};
-        if (port_id.starts_with("msc_")) {
-          std::string agent_id = port_id.substr(4);
-          auto it = msc_mboxes.find(agent_id);
-          if (it != msc_mboxes.end()) {
-            so_5::send<Packet>(it->second, pkt);
-          } else {
-             std::cerr << "ERROR: Mailbox for agent " << agent_id 
-                       << " not found. Packet dropped." << std::endl;
+      if (events[i].data.u32 == kStopTag)
+        continue; // Флаг running проверит цикл
+      const ReceivePorts::Port &port = ports.ports()[events[i].data.u32];
+
+      // Сокеты зарегистрированы с EPOLLET, поэтому вычитываем всё, что успело
+      // накопиться в буфере ядра, пачками по recv_batch_size датаграмм
+      while (true) {
+        batch.reset();
+        int received = recvmmsg(port.fd, batch.msgs.data(), batch.size(),
+                                MSG_DONTWAIT, nullptr);
+        metrics().receive_syscalls.add();
+        if (received < 0) {
+          if (errno == EINTR)
+            continue;
+          if (errno != EAGAIN && errno != EWOULDBLOCK)
+            LOG_ERROR("recvmmsg");
+          break;
+        }
+        auto batch_start = std::chrono::steady_clock::now();
+        metrics().epoll_datagrams.add(received);
+        for (int j = 0; j < received; ++j) {
+          const mmsghdr &m = batch.msgs[j];
+          if (m.msg_hdr.msg_flags & MSG_TRUNC) {
+            metrics().epoll_truncated.add();
+            LOG_WARN("Датаграмма из " << port.id
+                     << " обрезана до " << batch.datagram_size << " байт");
           }
-#ifdef DEBUG
-          std::cout << "DEBUG: MSC пакет из " << port_id << ", размер "
-                    << recv_len << std::endl;
-#endif
-        } else {
-          command_queue.push(pkt); // Пакеты команд
-#ifdef DEBUG
-          std::cout << "DEBUG: CMD пакет, размер " << recv_len << std::endl;
-#endif
+          PacketRef buffer = batch.take(j);
+          if (!buffer) {
+            // Пул исчерпан, датаграмма прочитана в overflow и отбрасывается
+            metrics().pool_exhausted.add();
+            continue;
+          }
+          if (m.msg_len > 0)
+            ports.deliver(port, std::move(buffer), m.msg_len,
+                          batch.senders[j]);
+        }
+        if (received > 0) {
+          ports.notify(port);
+          metrics().epoll_batch.record(std::chrono::steady_clock::now() -
+                                       batch_start);
         }
-      } else if (recv_len < 0) {
-        std::cerr << "Ошибка: recvfrom" << std::endl;
+        // Неполная пачка значит, что буфер сокета опустошён. Всё, что придёт
+        // позже, снова взведёт EPOLLET
+        if (static_cast<size_t>(received) < batch.size())
+          break;
       }
     }
   }
 
-  for (int sock : sockets)
-    close(sock);
   close(epoll_fd);
-#ifdef DEBUG
-  std::cout << "DEBUG: Поток epoll завершён" << std::endl;
-#endif
+}
+
+// Место в начале буфера, которое multishot recvmsg занимает под заголовок
+// и адрес отправителя. Данные датаграммы идут сразу за ним
+constexpr size_t kUringRecvHeadroom =
+    sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in);
+
+// Размер буфера пула под одну датаграмму при выбранном бэкенде
+inline size_t receive_buffer_size(const NetworkSettings &network) {
+  size_t size = static_cast<size_t>(network.max_datagram_size);
+  if (network.backend == NetworkBackend::io_uring)
+    size += kUringRecvHeadroom;
+  return size;
+}
+
+// Прием через io_uring: на каждом сокете висит один multishot RECVMSG,
+// ядро само выбирает буфер из кольца provided buffers. Буферы кольца -
+// это буферы PacketPool, поэтому датаграмма уходит агентам без копирования,
+// а на место взятого буфера кладется новый из пула. Системный вызов один на
+// пачку завершений, а не пара на каждую датаграмму.
+//
+// false, если io_uring не удалось поднять; тогда вызывающий переходит на
+// epoll с теми же сокетами
+bool uring_receive_loop(const NetworkSettings &network,
+                        PacketPool &packet_pool, ReceivePorts &ports,
+                        std::atomic<bool> &running, StopEvent &stop_event) {
+  constexpr uint16_t kBufferGroup = 0;
+  constexpr uint64_t kStopTag = UINT64_MAX;
+  constexpr uint64_t kCancelTag = UINT64_MAX - 1;
+  const unsigned buffer_count = static_cast<unsigned>(network.io_uring_buffers);
+  const auto &port_list = ports.ports();
+
+  if (packet_pool.buffer_size() <= kUringRecvHeadroom) {
+    LOG_ERROR("io_uring: буфер пула меньше заголовка recvmsg");
+    return false;
+  }
+
+  // В CQ должно поместиться по завершению на каждый буфер кольца. SQ с
+  // запасом под порты, добавленные перечитыванием конфига; если места не
+  // хватит, запрос взведется на следующем круге
+  IoUring uring;
+  if (!uring.init(std::max(static_cast<unsigned>(port_list.size()) * 2 + 8,
+                           64u),
+                  buffer_count * 2)) {
+    LOG_WARN("io_uring недоступен: " << std::strerror(errno));
+    return false;
+  }
+  IoUringBufferRing buffers;
+  if (!buffers.init(uring, buffer_count, kBufferGroup)) {
+    LOG_WARN("io_uring: кольцо буферов не зарегистрировано: "
+             << std::strerror(errno));
+    return false;
+  }
+
+  // Буфер пула под каждым номером кольца. Пустые номера ждут, пока в пуле
+  // освободится буфер
+  std::vector<PacketRef> slots(buffer_count);
+  std::vector<uint16_t> empty_slots;
+  auto refill = [&](uint16_t bid) {
+    slots[bid] = packet_pool.acquire();
+    if (!slots[bid]) {
+      empty_slots.push_back(bid);
+      return;
+    }
+    buffers.add(bid, slots[bid].data(),
+                static_cast<uint32_t>(packet_pool.buffer_size()));
+  };
+  for (unsigned bid = 0; bid < buffer_count; ++bid)
+    refill(static_cast<uint16_t>(bid));
+  buffers.publish();
+
+  // msghdr задает только размер адреса, сами данные ядро кладет в буфер
+  // кольца. Один на все порты, живет, пока висят multishot запросы
+  msghdr recv_msg{};
+  recv_msg.msg_namelen = sizeof(sockaddr_in);
+  std::vector<bool> armed(port_list.size(), false);
+  auto arm = [&](size_t i) {
+    if (port_list[i].fd < 0 || port_list[i].closing)
+      return;
+    io_uring_sqe *sqe = uring.get_sqe();
+    if (!sqe)
+      return;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = port_list[i].fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&recv_msg);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufferGroup;
+    sqe->user_data = i;
+    armed[i] = true;
+  };
+  for (size_t i = 0; i < port_list.size(); ++i)
+    arm(i);
+  bool stop_armed = false;
+  auto arm_stop = [&] {
+    io_uring_sqe *sqe = uring.get_sqe();
+    if (!sqe)
+      return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = stop_event.fd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = kStopTag;
+    stop_armed = true;
+  };
+  arm_stop();
+
+  // Снятые перечитыванием конфига порты: multishot запрос отменяется, а
+  // сокет закрывается только по его последнему завершению, до тех пор ядро
+  // держит ссылку на сокет и может прислать еще датаграммы
+  std::vector<uint32_t> to_cancel;
+  auto cancel = [&](uint32_t slot) {
+    io_uring_sqe *sqe = uring.get_sqe();
+    if (!sqe)
+      return false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = slot;
+    sqe->user_data = kCancelTag;
+    return true;
+  };
+  ReceivePorts::Changes changes;
+
+  LOG_INFO("Прием через io_uring, буферов в кольце: " << buffer_count);
+  std::vector<bool> received_on(port_list.size(), false);
+
+  // Разбор одного завершения RECVMSG порта i. true, если это датаграмма
+  auto receive = [&](const io_uring_cqe &cqe, size_t i) {
+    if (cqe.res < 0) {
+      // ENOBUFS: кольцо опустело, перевзвод после пополнения. ECANCELED
+      // приходит снятым портам и ошибкой не считается
+      if (cqe.res == -ENOBUFS)
+        metrics().pool_exhausted.add();
+      else if (cqe.res != -ECANCELED)
+        LOG_ERROR("io_uring recvmsg " << port_list[i].id << ": "
+                  << std::strerror(-cqe.res));
+      return false;
+    }
+    if (!(cqe.flags & IORING_CQE_F_BUFFER))
+      return false;
+
+    uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    PacketRef buffer = std::move(slots[bid]);
+    refill(bid);
+
+    const auto *out =
+        reinterpret_cast<const io_uring_recvmsg_out *>(buffer.data());
+    sockaddr_in sender{};
+    std::memcpy(&sender, buffer.data() + sizeof(io_uring_recvmsg_out),
+                std::min<size_t>(out->namelen, sizeof(sender)));
+    size_t capacity = packet_pool.buffer_size() - kUringRecvHeadroom;
+    size_t len = out->payloadlen;
+    if ((out->flags & MSG_TRUNC) || len > capacity) {
+      metrics().epoll_truncated.add();
+      LOG_WARN("Датаграмма из " << port_list[i].id << " обрезана до "
+               << capacity << " байт");
+      len = std::min(len, capacity);
+    }
+    if (len > 0) {
+      ports.deliver(port_list[i], std::move(buffer), len, sender,
+                    static_cast<uint32_t>(kUringRecvHeadroom));
+      received_on[i] = true;
+    }
+    return true;
+  };
+
+  while (running) {
+    if (ports.sync(changes)) {
+      armed.resize(port_list.size(), false);
+      received_on.resize(port_list.size(), false);
+      for (uint32_t slot : changes.removed) {
+        if (armed[slot])
+          to_cancel.push_back(slot);
+        else
+          ports.release(slot); // Запроса на сокете нет
+      }
+      // Новые порты взводятся вместе со снятыми запросами ниже
+    }
+    to_cancel.erase(std::remove_if(to_cancel.begin(), to_cancel.end(), cancel),
+                    to_cancel.end());
+
+    // Пока часть кольца пуста, просыпаемся часто: агенты возвращают буферы в
+    // пул без уведомления, а датаграммы тем временем копятся в сокете
+    int ret = uring.submit_and_wait(1, empty_slots.empty() ? 100 : 1);
+    metrics().receive_syscalls.add();
+    if (ret < 0) {
+      LOG_ERROR("io_uring_enter: " << std::strerror(-ret));
+      continue;
+    }
+
+    auto batch_start = std::chrono::steady_clock::now();
+    uint64_t datagrams = 0;
+    uring.for_each_cqe([&](const io_uring_cqe &cqe) {
+      if (cqe.user_data == kStopTag) {
+        stop_armed = false; // Флаг running проверит цикл
+        return;
+      }
+      if (cqe.user_data == kCancelTag)
+        return; // Итог отмены придет завершением самого запроса
+      size_t i = static_cast<size_t>(cqe.user_data);
+      bool last = !(cqe.flags & IORING_CQE_F_MORE);
+      if (last)
+        armed[i] = false; // Ядро сняло multishot, перевзведем ниже
+      if (receive(cqe, i))
+        ++datagrams;
+      // Последнее завершение снятого порта: новых датаграмм с него не будет.
+      // Если отмена еще не ушла в ядро, она уже не нужна
+      if (last && port_list[i].closing) {
+        to_cancel.erase(std::remove(to_cancel.begin(), to_cancel.end(), i),
+                        to_cancel.end());
+        ports.release(static_cast<uint32_t>(i));
+      }
+    });
+
+    if (datagrams > 0) {
+      metrics().epoll_datagrams.add(datagrams);
+      for (size_t i = 0; i < port_list.size(); ++i) {
+        if (received_on[i]) {
+          ports.notify(port_list[i]);
+          received_on[i] = false;
+        }
+      }
+    }
+
+    // Номера, для которых в пуле не нашлось буфера, пробуем снова: агенты
+    // могли вернуть буферы
+    size_t pending = empty_slots.size();
+    for (size_t k = 0; k < pending; ++k) {
+      uint16_t bid = empty_slots.front();
+      empty_slots.erase(empty_slots.begin());
+      refill(bid);
+    }
+    buffers.publish();
+
+    // Снятые запросы перевзводим, только если в кольце есть буферы, иначе
+    // ядро сразу вернет ENOBUFS
+    if (empty_slots.size() < buffer_count) {
+      for (size_t i = 0; i < port_list.size(); ++i) {
+        if (!armed[i])
+          arm(i);
+      }
+    }
+    if (!stop_armed)
+      arm_stop();
+
+    if (datagrams > 0)
+      metrics().epoll_batch.record(std::chrono::steady_clock::now() -
+                                   batch_start);
+  }
+  return true;
+}
+
+// Поток приема пакетов номер worker (от 0 до receive_thread_count). Бэкенд
+// выбирается в config.network.backend, при недоступности io_uring
+// используется epoll
+void receive_thread(const Config &config, PacketPool &packet_pool,
+                    CommandQueue &command_queue, std::atomic<bool> &running,
+                    StopEvent &stop_event, const MscDirectory &msc_directory,
+                    so_5::mbox_t ingress_mbox, int worker = 0) {
+  pin_current_thread(config.threading.receive, "потока приема");
+  ReceivePorts ports(config, command_queue, msc_directory, ingress_mbox,
+                     worker);
+
+  bool done = false;
+  if (config.network.backend == NetworkBackend::io_uring) {
+    done = uring_receive_loop(config.network, packet_pool, ports, running,
+                              stop_event);
+    if (!done)
+      LOG_WARN("Прием переключен на epoll");
+  }
+  if (!done)
+    epoll_receive_loop(config.network, packet_pool, ports, running,
+                       stop_event);
+  LOG_DEBUG("Поток приема " << worker << " завершён");
 }
 
 #endif
@@ -0,0 +1,109 @@
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include "BoundedRing.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class PacketPool;
+
+// Заголовок одного буфера пула. Данные лежат в общем слабе пула
+struct PacketBuffer {
+  std::atomic<uint32_t> refs{0};
+  uint32_t index = 0;
+  char *data = nullptr;
+  PacketPool *pool = nullptr;
+};
+
+// Ссылка на буфер пула с подсчётом ссылок. Копирование только увеличивает
+// счетчик, буфер возвращается в пул при уничтожении последней ссылки
+class PacketRef {
+public:
+  PacketRef() = default;
+  explicit PacketRef(PacketBuffer *b) : b_(b) {}
+
+  PacketRef(const PacketRef &other) : b_(other.b_) {
+    if (b_)
+      b_->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  PacketRef(PacketRef &&other) noexcept : b_(other.b_) { other.b_ = nullptr; }
+
+  PacketRef &operator=(PacketRef other) noexcept {
+    std::swap(b_, other.b_);
+    return *this;
+  }
+
+  ~PacketRef() { reset(); }
+
+  inline void reset();
+
+  char *data() const { return b_ ? b_->data : nullptr; }
+
+  explicit operator bool() const { return b_ != nullptr; }
+
+private:
+  PacketBuffer *b_ = nullptr;
+};
+
+// Пул буферов фиксированного размера для принимаемых датаграмм. Вся память
+// выделяется один раз при создании, свободные буферы хранятся в lock-free
+// кольце, поэтому acquire/release можно вызывать из любых потоков.
+class PacketPool {
+public:
+  PacketPool(size_t count, size_t buffer_size)
+      : buffer_size_(buffer_size),
+        slab_(std::make_unique<char[]>(count * buffer_size)),
+        headers_(count), free_(count) {
+    for (size_t i = 0; i < count; ++i) {
+      headers_[i].index = static_cast<uint32_t>(i);
+      headers_[i].data = slab_.get() + i * buffer_size;
+      headers_[i].pool = this;
+      uint32_t idx = static_cast<uint32_t>(i);
+      free_.try_push(idx);
+    }
+  }
+
+  PacketPool(const PacketPool &) = delete;
+  PacketPool &operator=(const PacketPool &) = delete;
+
+  // Пустая ссылка, если свободных буферов не осталось. Отброшенные из-за
+  // этого датаграммы считает поток приема (pool_exhausted в Metrics): пустой
+  // слот пачки запрашивает буфер снова на каждом круге, и счетчик здесь
+  // считал бы попытки, а не потерянные датаграммы
+  PacketRef acquire() {
+    auto idx = free_.try_pop();
+    if (!idx)
+      return PacketRef{};
+    PacketBuffer *b = &headers_[*idx];
+    b->refs.store(1, std::memory_order_relaxed);
+    return PacketRef{b};
+  }
+
+  void release(PacketBuffer *b) {
+    uint32_t idx = b->index;
+    free_.try_push(idx);
+  }
+
+  size_t buffer_size() const { return buffer_size_; }
+  size_t capacity() const { return headers_.size(); }
+  size_t available() const { return free_.size(); }
+
+private:
+  size_t buffer_size_;
+  std::unique_ptr<char[]> slab_;
+  std::vector<PacketBuffer> headers_;
+  BoundedRing<uint32_t> free_;
+};
+
+inline void PacketRef::reset() {
+  if (b_ && b_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    b_->pool->release(b_);
+  b_ = nullptr;
+}
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef PAYLOAD_PARSER_H
+#define PAYLOAD_PARSER_H
+
+#include "JsonParser.hpp"
+#include "JsonScan.hpp"
+
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <string>
+#include <string_view>
+
+using json = nlohmann::json;
+
+// Поля команды, которые нужны конвейеру. Сам payload дальше уходит как есть
+struct CommandFields {
+  std::string target;
+  // Значение client_request_id в исходном JSON виде, пусто если поля нет.
+  // Возвращается клиенту в финальном ответе для сопоставления запросов
+  std::string client_request_id;
+  // Положение значения request_id клиента в исходном тексте, npos если поля
+  // нет. Перед отправкой в MSC значение заменяется идентификатором шлюза
+  size_t request_id_offset = std::string::npos;
+  size_t request_id_length = 0;
+};
+
+// Что пришло от MSC
+enum class MscPacketKind { reply, event, invalid };
+
+// Разбор входящих пакетов. Режим scan валидирует JSON и достает поля прямо
+// из буфера пакета без построения DOM, режим dom делает то же через
+// nlohmann::json. Экземпляр хранит состояние сканера, поэтому у каждого
+// агента свой.
+class PayloadParser {
+public:
+  explicit PayloadParser(ParserMode mode) : mode_(mode) {}
+
+  // Проверка команды от клиента. При ошибке заполняет error
+  bool parse_command(const char *data, size_t len, CommandFields &out,
+                     std::string &error) {
+    if (mode_ == ParserMode::dom) {
+      try {
+        json j = json::parse(data, data + len);
+        if (!j.is_object() || !j.contains("command") ||
+            !j["command"].is_string()) {
+          error = "Invalid format or missing 'command' field";
+          return false;
+        }
+        out.target.clear();
+        if (j.contains("target") && j["target"].is_string())
+          out.target = j["target"].get<std::string>();
+        out.client_request_id.clear();
+        if (j.contains("client_request_id"))
+          out.client_request_id = j["client_request_id"].dump();
+        out.request_id_offset = std::string::npos;
+        out.request_id_length = 0;
+        // Позиции в тексте DOM не хранит, за ними идем сканером, только
+        // если поле есть. Без позиции request_id клиента остался бы в
+        // команде рядом с нашим, поэтому расхождение разборов - отказ
+        if (j.contains("request_id")) {
+          if (!scan_.parse(data, len)) {
+            error = std::string("JSON parse error: ") + scan_.error();
+            return false;
+          }
+          locate_request_id(data, out);
+        }
+        return true;
+      } catch (const std::exception &e) {
+        error = e.what();
+        return false;
+      }
+    }
+
+    if (!scan_.parse(data, len)) {
+      error = std::string("JSON parse error: ") + scan_.error();
+      return false;
+    }
+    const JsonField *command = scan_.find("command");
+    if (!command || command->type != JsonType::string) {
+      error = "Invalid format or missing 'command' field";
+      return false;
+    }
+    out.target.clear();
+    if (const JsonField *target = scan_.find("target");
+        target && target->type == JsonType::string) {
+      if (target->has_escapes)
+        out.target = target->decode_string();
+      else
+        out.target.assign(target->string_view());
+    }
+    out.client_request_id.clear();
+    if (const JsonField *client_id = scan_.find("client_request_id"))
+      out.client_request_id.assign(client_id->raw);
+    out.request_id_offset = std::string::npos;
+    out.request_id_length = 0;
+    locate_request_id(data, out);
+    return true;
+  }
+
+  // Разбор пакета от MSC: ответ на команду содержит строковый request_id,
+  // всё остальное считается асинхронным событием
+  MscPacketKind parse_msc_packet(const char *data, size_t len,
+                                 std::string &request_id, std::string &error) {
+    if (mode_ == ParserMode::dom) {
+      try {
+        json j = json::parse(data, data + len);
+        if (!j.contains("request_id"))
+          return MscPacketKind::event;
+        if (!j["request_id"].is_string()) {
+          error = "'request_id' is not a string";
+          return MscPacketKind::invalid;
+        }
+        request_id = j["request_id"].get<std::string>();
+        reply_has_reserved_ = j.contains("agent_id") || j.contains("success");
+        return MscPacketKind::reply;
+      } catch (const std::exception &e) {
+        error = e.what();
+        return MscPacketKind::invalid;
+      }
+    }
+
+    if (!scan_.parse(data, len)) {
+      error = std::string("JSON parse error: ") + scan_.error();
+      return MscPacketKind::invalid;
+    }
+    const JsonField *rid = scan_.find("request_id");
+    if (!rid)
+      return MscPacketKind::event;
+    if (rid->type != JsonType::string) {
+      error = "'request_id' is not a string";
+      return MscPacketKind::invalid;
+    }
+    if (rid->has_escapes)
+      request_id = rid->decode_string();
+    else
+      request_id.assign(rid->string_view());
+    reply_has_reserved_ = false;
+    for (size_t i = 0; i < scan_.field_count(); ++i)
+      reply_has_reserved_ = reply_has_reserved_ || is_reserved(scan_.field(i));
+    return MscPacketKind::reply;
+  }
+
+  // Ответ MSC для вставки в финальный ответ. Поля agent_id и success туда
+  // дописывает шлюз, поэтому если MSC прислала свои, возвращается объект
+  // без них, иначе nullopt и ответ вставляется как есть. Вызывается сразу
+  // после parse_msc_packet для того же буфера, вернувшего reply
+  std::optional<std::string> reply_without_reserved(const char *data,
+                                                    size_t len) {
+    if (!reply_has_reserved_)
+      return std::nullopt;
+    if (mode_ == ParserMode::dom) {
+      json j = json::parse(data, data + len);
+      j.erase("agent_id");
+      j.erase("success");
+      return j.dump();
+    }
+    // Член объекта в исходном тексте - от кавычки ключа до конца значения
+    std::string out = "{";
+    for (size_t i = 0; i < scan_.field_count(); ++i) {
+      const JsonField &f = scan_.field(i);
+      if (is_reserved(f))
+        continue;
+      if (out.size() > 1)
+        out += ',';
+      const char *begin = f.key.data() - 1;
+      out.append(begin, f.raw.data() + f.raw.size());
+    }
+    out += '}';
+    return out;
+  }
+
+private:
+  // Запоминает положение request_id из последнего разбора сканером
+  void locate_request_id(const char *data, CommandFields &out) {
+    if (const JsonField *rid = scan_.find("request_id")) {
+      out.request_id_offset = static_cast<size_t>(rid->raw.data() - data);
+      out.request_id_length = rid->raw.size();
+    }
+  }
+
+  static bool is_reserved(const JsonField &f) {
+    if (f.key_escapes) {
+      std::string key = json_unescape(f.key);
+      return key == "agent_id" || key == "success";
+    }
+    return f.key == "agent_id" || f.key == "success";
+  }
+
+  ParserMode mode_;
+  JsonScan scan_;
+  // Есть ли в последнем разобранном ответе MSC свои agent_id или success
+  bool reply_has_reserved_ = false;
+};
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef PENDING_REQUESTS_H
+#define PENDING_REQUESTS_H
+
+#include "Ids.hpp"
+#include "ResponseBuffer.hpp"
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <optional>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+// Таймаут ответа для каждого номера агента
+using AgentTimeouts = std::vector<std::chrono::milliseconds>;
+
+// Запрос, разосланный MSC агентам и ожидающий их ответов
+struct PendingRequest {
+  AgentSet waiting_for;                 // Агенты от которых ждем ответ
+  std::vector<AgentIndex> timed_out;    // Агенты, не ответившие вовремя
+  ResponseBuffer response;              // Финальный ответ, собирается на ходу
+  sockaddr_in original_sender;          // Адрес оригинального отправителя
+  Clock::time_point start_time;         // Время начала обработки
+  std::shared_ptr<RequestTrace> trace;  // Трасса, если запрос в выборке
+  // Таймауты агентов на момент рассылки. Пусто - таймауты таблицы
+  std::shared_ptr<const AgentTimeouts> agent_timeouts;
+};
+
+// Таблица ожидающих запросов, разбитая на шарды по request_id. Каждый
+// шард под своим мьютексом, поэтому обработчики диспетчера на разных потоках
+// пула почти не конкурируют между собой.
+//
+// Дедлайн ветки рассылки равен start_time плюс таймаут ее агента. Таймауты
+// отслеживаются мин-кучей дедлайнов в каждом шарде: на запрос кладется по
+// одной записи на каждый различный дедлайн его веток. Записи
+// завершенных запросов не удаляются из кучи сразу, а пропускаются, когда
+// до них доходит очередь, поэтому проверка таймаутов стоит O(истекших), а не
+// O(ожидающих).
+class PendingRequestTable {
+public:
+  // agent_timeouts: таймаут ответа для каждого номера агента, если запрос
+  // не несет своих
+  explicit PendingRequestTable(AgentTimeouts agent_timeouts,
+                               size_t shard_count = 64)
+      : agent_timeouts_(std::move(agent_timeouts)),
+        shards_(std::make_unique<Shard[]>(shard_count)),
+        shard_count_(shard_count) {}
+
+  void insert(RequestId request_id, PendingRequest request) {
+    std::vector<Clock::time_point> deadlines;
+    const AgentTimeouts &timeouts = timeouts_for(request);
+    request.waiting_for.for_each([&](AgentIndex agent) {
+      deadlines.push_back(request.start_time + timeouts[agent]);
+    });
+    std::sort(deadlines.begin(), deadlines.end());
+    deadlines.erase(std::unique(deadlines.begin(), deadlines.end()),
+                    deadlines.end());
+
+    Shard &shard = shard_for(request_id);
+    std::lock_guard lock(shard.mtx);
+    if (!shard.requests.emplace(request_id, std::move(request)).second)
+      return;
+    size_.fetch_add(1, std::memory_order_relaxed);
+    for (auto deadline : deadlines)
+      shard.deadlines.push({deadline, request_id});
+  }
+
+  // Учитывает ответ агента и сразу дописывает его в финальный ответ. Если
+  // это был последний ожидаемый ответ, запрос удаляется из таблицы и
+  // возвращается вызывающему. on_accept(pending) вызывается под
+  // блокировкой шарда, только если ответ принят
+  template <typename OnAccept>
+  std::optional<PendingRequest>
+  add_reply(RequestId request_id, AgentIndex agent, std::string_view reply,
+            std::string_view agent_id_json, bool success,
+            OnAccept &&on_accept) {
+    Shard &shard = shard_for(request_id);
+    std::lock_guard lock(shard.mtx);
+    auto it = shard.requests.find(request_id);
+    if (it == shard.requests.end())
+      return std::nullopt;
+
+    PendingRequest &pending = it->second;
+    if (!pending.waiting_for.reset(agent))
+      return std::nullopt; // Повторный, опоздавший или чужой ответ
+    pending.response.append_reply(reply, agent_id_json, success);
+    on_accept(pending);
+
+    if (!pending.waiting_for.empty())
+      return std::nullopt;
+    return extract(shard, it);
+  }
+
+  std::optional<PendingRequest> add_reply(RequestId request_id,
+                                          AgentIndex agent,
+                                          std::string_view reply,
+                                          std::string_view agent_id_json,
+                                          bool success) {
+    return add_reply(request_id, agent, reply, agent_id_json, success,
+                     [](PendingRequest &) {});
+  }
+
+  // Переводит ветки с истекшим дедлайном в timed_out и извлекает запросы,
+  // у которых не осталось ожидаемых веток
+  std::vector<std::pair<RequestId, PendingRequest>>
+  take_expired(Clock::time_point now) {
+    std::vector<std::pair<RequestId, PendingRequest>> expired;
+    for (size_t i = 0; i < shard_count_; ++i) {
+      Shard &shard = shards_[i];
+      std::lock_guard lock(shard.mtx);
+      while (!shard.deadlines.empty() && shard.deadlines.top().at <= now) {
+        RequestId request_id = shard.deadlines.top().request_id;
+        shard.deadlines.pop();
+
+        auto it = shard.requests.find(request_id);
+        if (it == shard.requests.end())
+          continue; // Запрос уже завершился
+        PendingRequest &pending = it->second;
+        const AgentTimeouts &timeouts = timeouts_for(pending);
+        pending.waiting_for.for_each([&](AgentIndex agent) {
+          if (pending.start_time + timeouts[agent] <= now)
+            pending.timed_out.push_back(agent);
+        });
+        for (AgentIndex agent : pending.timed_out)
+          pending.waiting_for.reset(agent);
+
+        if (pending.waiting_for.empty())
+          expired.emplace_back(request_id, extract(shard, it));
+      }
+    }
+    return expired;
+  }
+
+  size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+private:
+  struct Deadline {
+    Clock::time_point at;
+    RequestId request_id;
+    bool operator>(const Deadline &other) const { return at > other.at; }
+  };
+
+  struct alignas(64) Shard {
+    std::mutex mtx;
+    std::unordered_map<RequestId, PendingRequest> requests;
+    std::priority_queue<Deadline, std::vector<Deadline>, std::greater<>>
+        deadlines;
+  };
+
+  using RequestIt = std::unordered_map<RequestId, PendingRequest>::iterator;
+
+  const AgentTimeouts &timeouts_for(const PendingRequest &request) const {
+    return request.agent_timeouts ? *request.agent_timeouts : agent_timeouts_;
+  }
+
+  PendingRequest extract(Shard &shard, RequestIt it) {
+    PendingRequest done = std::move(it->second);
+    shard.requests.erase(it);
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    return done;
+  }
+
+  // Идентификаторы выдаются подряд, поэтому остаток от деления равномерно
+  // раскладывает запросы по шардам
+  Shard &shard_for(RequestId request_id) {
+    return shards_[request_id % shard_count_];
+  }
+
+  AgentTimeouts agent_timeouts_;
+  std::unique_ptr<Shard[]> shards_;
+  size_t shard_count_;
+  std::atomic<size_t> size_{0};
+};
+
+#endif
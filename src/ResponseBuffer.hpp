@@ -0,0 +1,125 @@
+#ifndef RESPONSE_BUFFER_H
+#define RESPONSE_BUFFER_H
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+// Дописывает s как JSON-строку в кавычках
+inline void append_json_string(std::string &out, std::string_view s) {
+  out += '"';
+  for (char c : s) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        char buf[8];
+        std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+        out += buf;
+      } else {
+        out += c;
+      }
+    }
+  }
+  out += '"';
+}
+
+// Финальный ответ, который собирается прямо в выходной буфер по мере прихода
+// ответов агентов. Ответ агента вставляется как есть, в конец его объекта
+// дописываются agent_id и success. Свои agent_id и success MSC агент убирает
+// из ответа заранее (PayloadParser::reply_without_reserved), так что имена
+// в объекте не повторяются.
+//
+// Формат: {"status":"completed","request_id":"...",
+//          ["client_request_id":...,] "responses":[...]}
+class ResponseBuffer {
+public:
+  // Начинает ответ. reserve_hint: ожидаемый размер всего ответа.
+  // client_request_id: проверенное JSON значение от клиента или пусто
+  void begin(std::string_view wire_id, size_t reserve_hint,
+             std::string_view client_request_id = {}) {
+    out_.clear();
+    out_.reserve(reserve_hint);
+    out_ += R"({"status":"completed","request_id":)";
+    append_json_string(out_, wire_id);
+    if (!client_request_id.empty()) {
+      out_ += R"(,"client_request_id":)";
+      out_ += client_request_id;
+    }
+    out_ += R"(,"responses":[)";
+    first_ = true;
+  }
+
+  // reply: проверенный JSON-объект от MSC. agent_id_json: id агента уже в
+  // виде JSON-строки с кавычками
+  void append_reply(std::string_view reply, std::string_view agent_id_json,
+                    bool success) {
+    trim(reply);
+    if (reply.size() < 2 || reply.front() != '{' || reply.back() != '}') {
+      // Сюда попадают только проверенные объекты, но на всякий случай
+      // отдаем запись без тела ответа
+      open_entry();
+      out_ += '{';
+    } else {
+      std::string_view body = reply.substr(0, reply.size() - 1);
+      open_entry();
+      out_ += body;
+      std::string_view inner = body.substr(1);
+      trim(inner);
+      if (!inner.empty())
+        out_ += ',';
+    }
+    out_ += R"("agent_id":)";
+    out_ += agent_id_json;
+    out_ += success ? R"(,"success":true})" : R"(,"success":false})";
+  }
+
+  void append_timeout(std::string_view agent_id_json) {
+    open_entry();
+    out_ += R"({"error":"timeout","agent_id":)";
+    out_ += agent_id_json;
+    out_ += R"(,"success":false})";
+  }
+
+  // Закрывает ответ и отдает буфер без копирования
+  std::string finish() {
+    out_ += "]}";
+    return std::move(out_);
+  }
+
+private:
+  void open_entry() {
+    if (!first_)
+      out_ += ',';
+    first_ = false;
+  }
+
+  static void trim(std::string_view &s) {
+    auto is_ws = [](char c) {
+      return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    };
+    while (!s.empty() && is_ws(s.front()))
+      s.remove_prefix(1);
+    while (!s.empty() && is_ws(s.back()))
+      s.remove_suffix(1);
+  }
+
+  std::string out_;
+  bool first_ = true;
+};
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef STREAM_PORTS_H
+#define STREAM_PORTS_H
+
+#include "JsonParser.hpp"
+#include "Log.hpp"
+#include "NetworkUtils.hpp"
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Формат binary_v1: датаграмма состоит из одного или нескольких кадров,
+// каждый кадр это 4 байта длины (big-endian) и следом столько же байт
+// полезной нагрузки. Кадры должны ровно покрывать датаграмму.
+constexpr size_t kBinaryV1HeaderSize = 4;
+
+// Проверяет датаграмму binary_v1. Возвращает число кадров или 0, если
+// датаграмма повреждена
+inline size_t decode_binary_v1(const char *data, size_t len) {
+  size_t frames = 0;
+  size_t offset = 0;
+  while (offset < len) {
+    if (len - offset < kBinaryV1HeaderSize)
+      return 0;
+    uint32_t frame_len;
+    std::memcpy(&frame_len, data + offset, sizeof(frame_len));
+    frame_len = ntohl(frame_len);
+    offset += kBinaryV1HeaderSize;
+    if (frame_len > len - offset)
+      return 0;
+    offset += frame_len;
+    ++frames;
+  }
+  return frames;
+}
+
+// Высокоскоростной путь для потоковых данных: датаграммы принимаются
+// выделенными потоками, проверяются декодером binary_v1 и пересылаются на
+// remote_address как есть, без JSON и без копирования. При threads > 1
+// каждый поток держит свой сокет с SO_REUSEPORT, ядро распределяет потоки
+// отправителей между ними.
+class StreamPort {
+public:
+  struct Stats {
+    std::atomic<uint64_t> datagrams{0};
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> malformed{0};
+    std::atomic<uint64_t> send_errors{0};
+  };
+
+  StreamPort(const StreamPortSettings &settings, std::atomic<bool> &running)
+      : settings_(settings), running_(running),
+        remote_(parse_address(settings.remote_address)) {}
+
+  StreamPort(const StreamPort &) = delete;
+  StreamPort &operator=(const StreamPort &) = delete;
+
+  ~StreamPort() { join(); }
+
+  // Открывает сокеты и запускает потоки. false, если не удалось открыть
+  // ни одного сокета
+  bool start() {
+    for (int i = 0; i < settings_.threads; ++i) {
+      int sock = open_socket();
+      if (sock < 0)
+        break;
+      workers_.emplace_back([this, sock] { worker(sock); });
+    }
+    LOG_DEBUG("Stream " << settings_.id << " запущен, потоков: "
+              << workers_.size());
+    return !workers_.empty();
+  }
+
+  void join() {
+    for (auto &t : workers_) {
+      if (t.joinable())
+        t.join();
+    }
+    workers_.clear();
+  }
+
+  const Stats &stats() const { return stats_; }
+  const StreamPortSettings &settings() const { return settings_; }
+
+private:
+  int open_socket() {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+      LOG_ERROR("невозможно создать сокет для stream " << settings_.id);
+      return -1;
+    }
+    int one = 1;
+    if (settings_.threads > 1)
+      setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (settings_.rcvbuf_bytes > 0)
+      setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &settings_.rcvbuf_bytes,
+                 sizeof(settings_.rcvbuf_bytes));
+    // Таймаут нужен, чтобы поток периодически проверял флаг остановки
+    timeval timeout{0, 100 * 1000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    sockaddr_in local = parse_address(settings_.local_address);
+    if (bind(sock, reinterpret_cast<sockaddr *>(&local), sizeof(local)) < 0) {
+      LOG_ERROR("bind для stream " << settings_.id << " ("
+                << settings_.local_address << ")");
+      close(sock);
+      return -1;
+    }
+    return sock;
+  }
+
+  void worker(int recv_sock) {
+    const size_t batch_size = settings_.recv_batch_size;
+    const size_t dgram_size = settings_.max_datagram_size;
+
+    // Исходящий сокет подключен к remote, адрес в каждом сообщении не нужен
+    int send_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (send_sock < 0 ||
+        connect(send_sock, reinterpret_cast<const sockaddr *>(&remote_),
+                sizeof(remote_)) < 0) {
+      LOG_ERROR("не удалось подключиться к " << settings_.remote_address
+                << " для stream " << settings_.id);
+      if (send_sock >= 0)
+        close(send_sock);
+      close(recv_sock);
+      return;
+    }
+
+    auto storage = std::make_unique<char[]>(batch_size * dgram_size);
+    std::vector<iovec> recv_iov(batch_size);
+    std::vector<mmsghdr> recv_msgs(batch_size);
+    std::vector<iovec> send_iov(batch_size);
+    std::vector<mmsghdr> send_msgs(batch_size);
+    for (size_t i = 0; i < batch_size; ++i) {
+      recv_iov[i].iov_base = storage.get() + i * dgram_size;
+      recv_iov[i].iov_len = dgram_size;
+      recv_msgs[i].msg_hdr.msg_iov = &recv_iov[i];
+      recv_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (running_) {
+      for (auto &m : recv_msgs) {
+        m.msg_hdr.msg_flags = 0;
+        m.msg_len = 0;
+      }
+      // MSG_WAITFORONE: ждём первую датаграмму, остальные забираем без
+      // ожидания
+      int received = recvmmsg(recv_sock, recv_msgs.data(), batch_size,
+                              MSG_WAITFORONE, nullptr);
+      if (received <= 0) {
+        if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+            errno != EINTR)
+          LOG_ERROR("recvmmsg для stream " << settings_.id);
+        continue;
+      }
+
+      // Проверенные датаграммы отправляются прямо из приемных буферов
+      size_t to_send = 0;
+      uint64_t bytes = 0, frames = 0, malformed = 0;
+      for (int i = 0; i < received; ++i) {
+        const mmsghdr &m = recv_msgs[i];
+        const char *data = static_cast<const char *>(recv_iov[i].iov_base);
+        size_t frame_count = (m.msg_hdr.msg_flags & MSG_TRUNC)
+                                 ? 0
+                                 : decode_binary_v1(data, m.msg_len);
+        if (frame_count == 0) {
+          ++malformed;
+          continue;
+        }
+        frames += frame_count;
+        bytes += m.msg_len;
+        send_iov[to_send].iov_base = recv_iov[i].iov_base;
+        send_iov[to_send].iov_len = m.msg_len;
+        send_msgs[to_send] = mmsghdr{};
+        send_msgs[to_send].msg_hdr.msg_iov = &send_iov[to_send];
+        send_msgs[to_send].msg_hdr.msg_iovlen = 1;
+        ++to_send;
+      }
+
+      size_t sent = 0;
+      while (sent < to_send) {
+        int n = sendmmsg(send_sock, send_msgs.data() + sent, to_send - sent, 0);
+        if (n < 0) {
+          if (errno == EINTR)
+            continue;
+          stats_.send_errors.fetch_add(to_send - sent,
+                                       std::memory_order_relaxed);
+          break;
+        }
+        sent += n;
+      }
+
+      stats_.datagrams.fetch_add(received, std::memory_order_relaxed);
+      stats_.frames.fetch_add(frames, std::memory_order_relaxed);
+      stats_.bytes.fetch_add(bytes, std::memory_order_relaxed);
+      if (malformed)
+        stats_.malformed.fetch_add(malformed, std::memory_order_relaxed);
+    }
+
+    close(send_sock);
+    close(recv_sock);
+  }
+
+  StreamPortSettings settings_;
+  std::atomic<bool> &running_;
+  sockaddr_in remote_;
+  std::vector<std::thread> workers_;
+  Stats stats_;
+};
+
+#endif
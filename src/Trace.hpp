@@ -0,0 +1,191 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "Ids.hpp"
+#include "Log.hpp"
+#include "ResponseBuffer.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using TracePoint = std::chrono::steady_clock::time_point;
+
+// Одна ветка рассылки: путь команды до MSC агента и обратно
+struct TraceLeg {
+  AgentIndex agent = 0;
+  TracePoint msc_sent;      // MSC агент отправил команду во внешнюю систему
+  TracePoint msc_received;  // epoll поток принял ответ внешней системы
+  TracePoint reply_handled; // Диспетчер учел ответ
+  bool timed_out = false;
+};
+
+// Трасса одного запроса. Заводится только для запросов, попавших в выборку,
+// остальные несут пустой указатель. Каждая стадия пишет свою отметку
+// steady_clock, ветки дописывает диспетчер под блокировкой шарда.
+struct RequestTrace {
+  RequestId request_id = 0;
+  TracePoint received;       // epoll поток принял датаграмму
+  TracePoint dequeued;       // Ingress извлек пакет из очереди
+  TracePoint validated;      // Ingress проверил JSON
+  TracePoint dispatch_start; // Диспетчер начал обработку команды
+  TracePoint dispatched;     // Запрос зарегистрирован, начата рассылка
+  TracePoint final_built;    // Финальный ответ собран
+  TracePoint final_sent;     // Финальный ответ ушел клиенту
+  std::vector<TraceLeg> legs;
+};
+
+// Кольцо завершенных трасс и выгрузка в формат Chrome trace
+// (chrome://tracing, Perfetto). Каждый запрос показывается отдельным
+// процессом: поток 0 - общий путь, поток N+1 - ветка к MSC агенту N.
+class Tracer {
+public:
+  static Tracer &instance() {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  // sample_every: трассировать каждый N-й запрос, 0 - выключено
+  void configure(size_t sample_every, size_t ring_size,
+                 std::vector<std::string> agent_ids) {
+    std::lock_guard lock(mtx_);
+    sample_every_.store(sample_every, std::memory_order_relaxed);
+    ring_.assign(ring_size, nullptr);
+    next_ = 0;
+    agent_ids_ = std::move(agent_ids);
+  }
+
+  // Имена агентов по номерам после перечитывания конфига
+  void set_agent_ids(std::vector<std::string> agent_ids) {
+    std::lock_guard lock(mtx_);
+    agent_ids_ = std::move(agent_ids);
+  }
+
+  // Новая трасса, если запрос попал в выборку
+  std::shared_ptr<RequestTrace> maybe_start(RequestId request_id,
+                                            TracePoint received) {
+    size_t every = sample_every_.load(std::memory_order_relaxed);
+    if (every == 0 || request_id % every != 0)
+      return nullptr;
+    auto trace = std::make_shared<RequestTrace>();
+    trace->request_id = request_id;
+    trace->received = received;
+    return trace;
+  }
+
+  void complete(std::shared_ptr<RequestTrace> trace) {
+    std::lock_guard lock(mtx_);
+    if (ring_.empty())
+      return;
+    ring_[next_ % ring_.size()] = std::move(trace);
+    ++next_;
+  }
+
+  // Записывает накопленные трассы в файл. false при ошибке записи
+  bool dump(const std::string &path) {
+    std::vector<std::shared_ptr<RequestTrace>> traces;
+    std::vector<std::string> agent_ids;
+    {
+      std::lock_guard lock(mtx_);
+      for (const auto &t : ring_) {
+        if (t)
+          traces.push_back(t);
+      }
+      agent_ids = agent_ids_;
+    }
+
+    std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    auto span = [&](const RequestTrace &t, int tid, const char *name,
+                    TracePoint from, TracePoint to) {
+      if (from == TracePoint{} || to == TracePoint{} || to < from)
+        return;
+      char buf[192];
+      std::snprintf(buf, sizeof(buf),
+                    "%s{\"ph\":\"X\",\"pid\":%llu,\"tid\":%d,\"ts\":%.3f,"
+                    "\"dur\":%.3f,\"name\":\"%s\"}",
+                    first ? "" : ",",
+                    static_cast<unsigned long long>(t.request_id), tid,
+                    to_us(from), to_us(to) - to_us(from), name);
+      out += buf;
+      first = false;
+    };
+
+    for (const auto &trace : traces) {
+      const RequestTrace &t = *trace;
+      // Имена процесса и потоков для просмотрщика
+      out += first ? "" : ",";
+      first = false;
+      out += "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":" +
+             std::to_string(t.request_id) + ",\"args\":{\"name\":";
+      append_json_string(out, request_id_to_wire(t.request_id));
+      out += "}}";
+      for (const auto &leg : t.legs) {
+        out += ",{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" +
+               std::to_string(t.request_id) +
+               ",\"tid\":" + std::to_string(leg.agent + 1) +
+               ",\"args\":{\"name\":";
+        append_json_string(out,
+                           "msc " + (leg.agent < agent_ids.size()
+                                         ? agent_ids[leg.agent]
+                                         : std::to_string(leg.agent)));
+        out += "}}";
+      }
+
+      span(t, 0, "request", t.received, t.final_sent);
+      span(t, 0, "ingress_queue", t.received, t.dequeued);
+      span(t, 0, "ingress_parse", t.dequeued, t.validated);
+      span(t, 0, "dispatcher_queue", t.validated, t.dispatch_start);
+      span(t, 0, "fanout", t.dispatch_start, t.dispatched);
+      span(t, 0, "final_send", t.final_built, t.final_sent);
+      for (const auto &leg : t.legs) {
+        int tid = static_cast<int>(leg.agent) + 1;
+        if (leg.timed_out) {
+          span(t, tid, "timeout", t.dispatched, t.final_built);
+          continue;
+        }
+        span(t, tid, "msc_leg", t.dispatched, leg.reply_handled);
+        span(t, tid, "to_msc", t.dispatched, leg.msc_sent);
+        span(t, tid, "msc_remote", leg.msc_sent, leg.msc_received);
+        span(t, tid, "reply_queue", leg.msc_received, leg.reply_handled);
+      }
+    }
+    out += "]}\n";
+
+    std::FILE *f = std::fopen(path.c_str(), "w");
+    if (!f) {
+      LOG_ERROR("не удалось открыть " << path);
+      return false;
+    }
+    bool ok = std::fwrite(out.data(), 1, out.size(), f) == out.size();
+    ok = std::fclose(f) == 0 && ok;
+    if (!ok) {
+      LOG_ERROR("не удалось записать " << path);
+      return false;
+    }
+    LOG_INFO("Trace: " << traces.size() << " requests written to " << path);
+    return true;
+  }
+
+private:
+  Tracer() = default;
+
+  static double to_us(TracePoint t) {
+    return std::chrono::duration<double, std::micro>(t.time_since_epoch())
+        .count();
+  }
+
+  std::mutex mtx_;
+  std::atomic<size_t> sample_every_{0};
+  std::vector<std::shared_ptr<RequestTrace>> ring_;
+  size_t next_ = 0;
+  std::vector<std::string> agent_ids_;
+};
+
+inline Tracer &tracer() { return Tracer::instance(); }
+
+#endif
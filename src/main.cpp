@@ -1,29 +1,31 @@
+#include "AgentPools.hpp"
 #include "Agents.hpp"
 #include "CommandQueue.hpp"
 #include "JsonParser.hpp"
+#include "Lifecycle.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "MetricsServer.hpp"
+#include "MscDirectory.hpp"
+#include "MscHost.hpp"
 #include "NetworkUtils.hpp"
+#include "PacketPool.hpp"
+#include "StreamPorts.hpp"
+#include "Trace.hpp"
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <csignal>
 #include <iostream>
 #include <so_5/all.hpp>
 #include <thread>
-#include <unordered_map>
+#include <vector>
 
 std::atomic<bool> running{true};
 
-std::thread epoll_thr;
-
-void signal_handler(int signal) {
-  std::cout << "Received signal " << signal << ", shutting down..."
-            << std::endl;
-  running.store(false);
-  std::thread force_exit([] {
-    std::this_thread::sleep_for(std::chrono::seconds(1));
-    std::exit(1);
-  });
-  force_exit.detach();
-}
+// Потоки приема, по одному на каждый сокет SO_REUSEPORT порта
+std::vector<std::thread> receive_thrs;
 
 int main(int argc, char *argv[]) {
   if (argc < 2) {
@@ -41,79 +43,208 @@ int main(int argc, char *argv[]) {
   }
 
   Config config = config_opt.value();
-  std::cout << "Config parsed successfully!" << std::endl;
-
-  std::signal(SIGINT, signal_handler);
-  std::signal(SIGTERM, signal_handler);
-
-  int queue_size = 1000;
-  if (config.cmd.agent_settings) {
-    queue_size = config.cmd.agent_settings->queue_size;
+  LOG_INFO("Config parsed successfully!");
+
+  // Блокируем сигналы до запуска любых потоков, дальше их принимает только
+  // main через signalfd
+  SignalWaiter signals{SIGINT, SIGTERM, SIGUSR1, SIGHUP};
+  StopEvent stop_event;
+  InflightTracker inflight;
+
+  AgentSettings cmd_settings = config.cmd.agent_settings.value_or(AgentSettings{});
+  OverflowPolicy overflow_policy =
+      overflow_policy_from_string(cmd_settings.overflow_policy).value();
+
+  // Сокеты приема на каждый поток приема плюс запас на остальное
+  raise_open_files_limit(
+      static_cast<rlim_t>(config.msc_agents.size() + 1) *
+          static_cast<rlim_t>(receive_thread_count(config)) +
+      1024);
+
+  PacketPool packet_pool(config.network.packet_pool_size,
+                         receive_buffer_size(config.network));
+  CommandQueue command_queue(cmd_settings.queue_size, overflow_policy);
+  // Одна очередь и один исходящий сокет на все агенты MSC
+  MscEgress msc_egress;
+  // Текущие MSC агенты для диспетчера и потоков приема
+  MscDirectory msc_directory;
+
+  // Значения, которые метрики снимают в момент запроса
+  auto add_queue_gauges = [](const std::string &name, CommandQueue &queue) {
+    metrics().add_gauge("gateway_" + name + "_queue_depth",
+                        "Packets waiting in the " + name + " queue",
+                        [&queue] { return double(queue.stats().depth); });
+    metrics().add_gauge("gateway_" + name + "_queue_pushed",
+                        "Packets pushed to the " + name + " queue",
+                        [&queue] { return double(queue.stats().pushed); });
+    metrics().add_gauge(
+        "gateway_" + name + "_queue_dropped_oldest",
+        "Packets evicted from the " + name + " queue by drop_oldest",
+        [&queue] { return double(queue.stats().dropped_oldest); });
+    metrics().add_gauge(
+        "gateway_" + name + "_queue_dropped_newest",
+        "Packets rejected by the " + name + " queue",
+        [&queue] { return double(queue.stats().dropped_newest); });
+  };
+  add_queue_gauges("command", command_queue);
+  metrics().add_gauge("gateway_inflight_requests",
+                      "Accepted requests without a final response",
+                      [&inflight] { return double(inflight.value()); });
+  metrics().add_gauge("gateway_packet_pool_available",
+                      "Free buffers in the packet pool",
+                      [&packet_pool] { return double(packet_pool.available()); });
+
+  std::vector<std::string> agent_ids;
+  for (const auto &msc : config.msc_agents)
+    agent_ids.push_back(msc.id);
+  tracer().configure(config.tracing.sample_every, config.tracing.ring_size,
+                     std::move(agent_ids));
+
+  MetricsServer metrics_server(config.metrics, running);
+  if (!metrics_server.start())
+    LOG_ERROR("Metrics endpoint not started");
+
+  // Потоковые порты работают независимо от агентов на своих потоках
+  std::vector<std::unique_ptr<StreamPort>> stream_ports;
+  for (const auto &stream_config : config.stream_ports) {
+    auto stream = std::make_unique<StreamPort>(stream_config, running);
+    if (!stream->start()) {
+      LOG_ERROR("Stream " << stream_config.id << " not started");
+      continue;
+    }
+    stream_ports.push_back(std::move(stream));
   }
 
-  CommandQueue command_queue(queue_size);
-  CommandQueue msc_queue(queue_size);
-
   try {
     so_5::launch([&](so_5::environment_t &env) {
-      using namespace so_5::disp::adv_thread_pool;
-      so_5::mbox_t dispatcher_mbox;
+      // Каждая роль агентов - своя кооперация на пуле из threading.bind
+      AgentPools pools(env, config.threading);
+
       CommandDispatcherAgent *dispatcher;
+      pools.introduce("dispatcher", [&](so_5::coop_t &coop) {
+        dispatcher = coop.make_agent<CommandDispatcherAgent>(
+            std::cref(msc_directory), std::ref(inflight));
+      });
+      auto dispatcher_mbox = dispatcher->so_direct_mbox();
+
+      so_5::mbox_t broadcaster_mbox;
+      pools.introduce("event_broadcaster", [&](so_5::coop_t &coop) {
+        broadcaster_mbox =
+            coop.make_agent<EventBroadcasterAgent>(std::cref(config))
+                ->so_direct_mbox();
+      });
+
+      so_5::mbox_t final_reponser_mbox;
+      pools.introduce("final_response", [&](so_5::coop_t &coop) {
+        final_reponser_mbox =
+            coop.make_agent<FinalResponseAgent>()->so_direct_mbox();
+      });
+
+      pools.introduce("msc_egress", [&](so_5::coop_t &coop) {
+        msc_egress.set_consumer(
+            coop.make_agent<MscEgressAgent>(std::ref(msc_egress))
+                ->so_direct_mbox());
+      });
+
+      // Каждый агент MSC - своя кооперация, чтобы перечитывание конфига
+      // могло останавливать их по одному
+      MscHost msc_host(env, pools, msc_directory, config, broadcaster_mbox,
+                       dispatcher_mbox, msc_egress,
+                       receive_thread_count(config));
+      msc_host.start();
+
+      so_5::mbox_t ingress_mbox;
+      pools.introduce("ingress", [&](so_5::coop_t &coop) {
+        ingress_mbox = coop.make_agent<CommandIngressAgent>(
+                               std::ref(command_queue), std::cref(config),
+                               test_mode, dispatcher_mbox, std::ref(inflight))
+                           ->so_direct_mbox();
+      });
+
+      for (int worker = 0; worker < receive_thread_count(config); ++worker) {
+        receive_thrs.emplace_back([&, ingress_mbox, worker]() {
+          receive_thread(config, packet_pool, command_queue, running,
+                         stop_event, msc_directory, ingress_mbox, worker);
+        });
+      }
 
-      env.introduce_coop(make_dispatcher(env, 3).binder(
-                             bind_params_t{}.fifo(fifo_t::individual)),
-                         [&](so_5::coop_t &coop) {
-                           dispatcher = coop.make_agent<CommandDispatcherAgent>(
-                               std::cref(config));
-                         });
-
-      env.introduce_coop(
-          so_5::disp::active_obj::make_dispatcher(env).binder(),
-          [&](so_5::coop_t &coop) {
-            auto broadcaster_mbox =
-                coop.make_agent<EventBroadcasterAgent>(std::cref(config))
-                    ->so_direct_mbox();
-
-            auto final_reponser = coop.make_agent<FinalResponseAgent>();
-            auto final_reponser_mbox = final_reponser->so_direct_mbox();
-
-            auto dispatcher_mbox = dispatcher->so_direct_mbox();
-
-            std::unordered_map<std::string, so_5::mbox_t> msc_mboxes;
-            for (const auto &msc_config : config.msc_agents) {
-              auto msc_agent = coop.make_agent<MscAgent>(
-                  std::cref(msc_config), broadcaster_mbox, dispatcher_mbox,
-                  std::ref(msc_queue));
-              msc_mboxes[msc_config.id] = msc_agent->so_direct_mbox();
-              std::cout << "Added one\n";
-            }
-            
-            epoll_thr = std::thread([&, msc_mboxes]() {
-              epoll_thread(config, command_queue, msc_queue, running, msc_mboxes);
-          });
-            
-            auto ingress_agent = coop.make_agent<CommandIngressAgent>(
-                std::ref(command_queue), std::cref(config), test_mode,
-                dispatcher_mbox);
-            auto ingress_mbox = ingress_agent->so_direct_mbox();
-
-            dispatcher->set_links(std::move(msc_mboxes), final_reponser_mbox);
-          });
-
-      while (running.load()) {
+      dispatcher->set_links(final_reponser_mbox);
+
+      // Спим до сигнала остановки, не занимая ядро. SIGUSR1 выгружает
+      // накопленные трассы, SIGHUP перечитывает конфиг (добавляет, удаляет
+      // и перенастраивает MSC), работа при этом продолжается
+      int sig = signals.wait();
+      while (sig == SIGUSR1 || sig == SIGHUP) {
+        if (sig == SIGUSR1) {
+          tracer().dump(config.tracing.dump_path);
+        } else {
+          LOG_INFO("Reloading config " << path);
+          if (auto fresh = ConfigParser::try_parse(path)) {
+            msc_host.reload(*fresh);
+          } else {
+            metrics().config_reload_errors.add();
+            LOG_ERROR("Config not reloaded, keeping the running one");
+          }
+        }
+        sig = signals.wait();
+      }
+      auto shutdown_start = std::chrono::steady_clock::now();
+      LOG_INFO("Received signal " << sig << ", shutting down...");
+
+      // Новые команды больше не принимаем. Уже принятые дорабатываем, пока
+      // поток приема продолжает принимать ответы MSC
+      command_queue.close();
+      auto unfinished = [&] {
+        return inflight.value() +
+               static_cast<int64_t>(command_queue.stats().depth);
+      };
+      int64_t inflight_at_signal = unfinished();
+      auto drain_deadline =
+          shutdown_start +
+          std::chrono::milliseconds(config.shutdown.drain_timeout_ms);
+      while (unfinished() > 0 &&
+             std::chrono::steady_clock::now() < drain_deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      }
+      int64_t abandoned = std::max<int64_t>(unfinished(), 0);
+
+      // Поток приема шлет сообщения агентам, поэтому останавливаем его до
+      // остановки окружения
+      running.store(false);
+      stop_event.notify();
+      for (auto &thr : receive_thrs) {
+        if (thr.joinable())
+          thr.join();
       }
 
       env.stop();
+
+      auto shutdown_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                             std::chrono::steady_clock::now() - shutdown_start)
+                             .count();
+      LOG_INFO("Shutdown: drained " << inflight_at_signal - abandoned
+                                    << " of " << inflight_at_signal
+                                    << " in-flight requests, " << abandoned
+                                    << " abandoned, took " << shutdown_ms
+                                    << " ms");
     });
   } catch (const std::exception &e) {
-    std::cerr << "SObjectizer error: " << e.what() << std::endl;
+    LOG_ERROR("SObjectizer error: " << e.what());
     running.store(false);
+    stop_event.notify();
   }
-  
-  if (epoll_thr.joinable()) {
-    epoll_thr.join();
+
+  for (auto &thr : receive_thrs) {
+    if (thr.joinable())
+      thr.join();
+  }
+  for (auto &stream : stream_ports) {
+    stream->join();
   }
-  
-  std::cout << "Application shutdown complete." << std::endl;
+  metrics_server.join();
+  if (config.tracing.sample_every > 0)
+    tracer().dump(config.tracing.dump_path);
+
+  LOG_INFO("Application shutdown complete.");
   return 0;
 }
@@ -4,263 +4,454 @@
 #include <chrono>
 #include <atomic>
 #include <vector>
-#include <mutex>
+#include <memory>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <cerrno>
+#include <cstdio>
 #include <cstring>
 #include <algorithm>
-#include <numeric>
+#include <fstream>
 #include <iomanip>
 
+#include "src/Metrics.hpp"
+
+// Нагрузочный тест с открытым контуром: запросы уходят по расписанию
+// start + k / rate независимо от того, пришли ли ответы. Задержка считается
+// от запланированного момента отправки, поэтому отставание самого
+// генератора попадает в результат, а не прячется (coordinated omission).
+//
+// Каждый поток-отправитель держит свой сокет и шлет запросы k = t, t + T, ...
+// Сервис отвечает на адрес отправителя и возвращает client_request_id,
+// по нему ответ сопоставляется с запросом.
+
+using Clock = std::chrono::steady_clock;
+
+struct TestConfig {
+    std::string target_ip = "127.0.0.1";
+    int target_port = 11000;
+    std::string target = "1";
+    int rate = 10;
+    int duration = 5;
+    int threads = 1;
+    int warmup = 0;
+    int drain_ms = 2000;
+    std::string report_path;
+};
+
 struct TestResult {
-    std::atomic<int> sent_count{0};
-    std::atomic<int> received_count{0};
-    std::vector<double> response_times;
-    std::vector<std::string> errors;
-    std::mutex result_mutex;
-    
+    std::atomic<uint64_t> sent_count{0};
+    std::atomic<uint64_t> received_count{0};
+    std::atomic<uint64_t> duplicate_count{0};
+    std::atomic<uint64_t> uncorrelated_count{0};
+    std::atomic<uint64_t> send_errors{0};
+    std::atomic<uint64_t> receive_errors{0};
+    std::atomic<int64_t> max_send_lag_ns{0};
+
+    // От запланированной отправки до ответа: то, что видит клиент
+    LatencyHistogram response_time;
+    // От фактической отправки до ответа: время самого сервиса
+    LatencyHistogram service_time;
+
     double success_rate() const {
-        int sent = sent_count.load();
-        int received = received_count.load();
+        uint64_t sent = sent_count.load();
+        uint64_t received = received_count.load();
         return sent > 0 ? (double)received / sent * 100.0 : 0.0;
     }
 };
 
-class SimpleTester {
+class LoadTester {
 private:
-    std::string target_ip_;
-    int target_port_;
-    int response_port_;
-    int rate_per_second_;
-    int duration_seconds_;
-    
+    TestConfig config_;
     TestResult result_;
-    std::atomic<bool> running_{true};
-    
-    int send_sock_ = -1;
-    int recv_sock_ = -1;
-    
+    std::atomic<bool> receiving_{true};
+
+    sockaddr_in target_addr_{};
+    std::vector<int> socks_;
+
+    uint64_t total_requests_ = 0;
+    int64_t interval_ns_ = 0;
+    int64_t warmup_ns_ = 0;
+    Clock::time_point start_time_;
+
+    // Фактическое время отправки запроса k (нс от start_time_), -1 - не отправлен
+    std::unique_ptr<std::atomic<int64_t>[]> sent_at_;
+    std::unique_ptr<std::atomic<uint8_t>[]> answered_;
+
 public:
-    SimpleTester(const std::string& target_ip = "127.0.0.1", 
-                 int target_port = 11000, 
-                 int response_port = 11001,
-                 int rate = 10, 
-                 int duration = 5)
-        : target_ip_(target_ip), target_port_(target_port), response_port_(response_port),
-          rate_per_second_(rate), duration_seconds_(duration) {}
-    
-    ~SimpleTester() {
+    explicit LoadTester(const TestConfig& config) : config_(config) {}
+
+    ~LoadTester() {
         cleanup();
     }
-    
+
     bool setup() {
-        // Создаем сокет для отправки
-        send_sock_ = socket(AF_INET, SOCK_DGRAM, 0);
-        if (send_sock_ < 0) {
-            std::cerr << "❌ Failed to create send socket" << std::endl;
+        target_addr_.sin_family = AF_INET;
+        target_addr_.sin_port = htons(config_.target_port);
+        if (inet_pton(AF_INET, config_.target_ip.c_str(), &target_addr_.sin_addr) != 1) {
+            std::cerr << "❌ Invalid target IP: " << config_.target_ip << std::endl;
             return false;
         }
-        
-        // Создаем сокет для получения ответов
-        recv_sock_ = socket(AF_INET, SOCK_DGRAM, 0);
-        if (recv_sock_ < 0) {
-            std::cerr << "❌ Failed to create receive socket" << std::endl;
-            return false;
+
+        // Сокет на каждый поток: отправитель не делит его с другими, а ответы
+        // приходят на тот же эфемерный порт
+        for (int t = 0; t < config_.threads; ++t) {
+            int sock = socket(AF_INET, SOCK_DGRAM, 0);
+            if (sock < 0) {
+                std::cerr << "❌ Failed to create socket" << std::endl;
+                return false;
+            }
+            socks_.push_back(sock);
+
+            struct timeval timeout;
+            timeout.tv_sec = 0;
+            timeout.tv_usec = 100 * 1000;
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+            int buf_size = 4 * 1024 * 1024;
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
         }
-        
-        // Настраиваем таймаут для receive socket
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        setsockopt(recv_sock_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-        
-        // Биндим receive socket
-        sockaddr_in local_addr{};
-        local_addr.sin_family = AF_INET;
-        local_addr.sin_addr.s_addr = INADDR_ANY;
-        local_addr.sin_port = htons(response_port_);
-        
-        if (bind(recv_sock_, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
-            std::cerr << "❌ Failed to bind receive socket to port " << response_port_ << std::endl;
-            return false;
+
+        total_requests_ = static_cast<uint64_t>(config_.rate) * config_.duration;
+        interval_ns_ = 1000000000LL / config_.rate;
+        warmup_ns_ = static_cast<int64_t>(config_.warmup) * 1000000000LL;
+        sent_at_ = std::make_unique<std::atomic<int64_t>[]>(total_requests_);
+        answered_ = std::make_unique<std::atomic<uint8_t>[]>(total_requests_);
+        for (uint64_t k = 0; k < total_requests_; ++k) {
+            sent_at_[k].store(-1, std::memory_order_relaxed);
+            answered_[k].store(0, std::memory_order_relaxed);
         }
-        
-        std::cout << "✅ Sockets created successfully" << std::endl;
-        std::cout << "📡 Will send to: " << target_ip_ << ":" << target_port_ << std::endl;
-        std::cout << "📥 Will listen on: " << response_port_ << std::endl;
-        
+
+        std::cout << "✅ " << socks_.size() << " sockets created successfully" << std::endl;
+        std::cout << "📡 Will send to: " << config_.target_ip << ":" << config_.target_port << std::endl;
         return true;
     }
-    
+
     void cleanup() {
-        if (send_sock_ >= 0) {
-            close(send_sock_);
-            send_sock_ = -1;
+        for (int sock : socks_) {
+            close(sock);
+        }
+        socks_.clear();
+    }
+
+    int64_t now_ns() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - start_time_).count();
+    }
+
+    // Ждет момента отправки: спит, пока до него далеко, последние
+    // ~100 мкс крутится, чтобы не зависеть от точности sleep
+    void wait_until(int64_t deadline_ns) {
+        int64_t now = now_ns();
+        if (deadline_ns - now > 200000) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(deadline_ns - now - 100000));
         }
-        if (recv_sock_ >= 0) {
-            close(recv_sock_);
-            recv_sock_ = -1;
+        while (now_ns() < deadline_ns) {
         }
     }
-    
-    void send_command(int request_id) {
-        // Создаем простое JSON сообщение
-        std::string message = "{"
-            "\"command\":\"stress_test\","
-            "\"target\":\"1\","
-            "\"request_id\":\"stress_" + std::to_string(request_id) + "\","
-            "\"data\":\"load_test_data_" + std::to_string(request_id) + "\","
-            "\"timestamp\":" + std::to_string(
-                std::chrono::duration_cast<std::chrono::milliseconds>(
-                    std::chrono::steady_clock::now().time_since_epoch()).count()) +
-            "}";
-        
-        sockaddr_in target_addr{};
-        target_addr.sin_family = AF_INET;
-        target_addr.sin_port = htons(target_port_);
-        inet_pton(AF_INET, target_ip_.c_str(), &target_addr.sin_addr);
-        
-        if (sendto(send_sock_, message.c_str(), message.size(), 0, 
-                   (struct sockaddr*)&target_addr, sizeof(target_addr)) >= 0) {
-            result_.sent_count++;
-        } else {
-            std::lock_guard<std::mutex> lock(result_.result_mutex);
-            result_.errors.push_back("Failed to send message " + std::to_string(request_id));
+
+    void send_loop(int thread_index) {
+        int sock = socks_[thread_index];
+        std::string message;
+        message.reserve(256);
+
+        for (uint64_t k = thread_index; k < total_requests_; k += config_.threads) {
+            int64_t intended = static_cast<int64_t>(k) * interval_ns_;
+            wait_until(intended);
+
+            message = "{"
+                "\"command\":\"stress_test\","
+                "\"target\":\"" + config_.target + "\","
+                "\"client_request_id\":" + std::to_string(k) + ","
+                "\"data\":\"load_test_data_" + std::to_string(k) + "\""
+                "}";
+
+            int64_t actual = now_ns();
+            sent_at_[k].store(actual, std::memory_order_release);
+            if (sendto(sock, message.data(), message.size(), 0,
+                       (struct sockaddr*)&target_addr_, sizeof(target_addr_)) >= 0) {
+                result_.sent_count++;
+            } else {
+                sent_at_[k].store(-1, std::memory_order_relaxed);
+                result_.send_errors++;
+            }
+
+            int64_t lag = actual - intended;
+            int64_t prev = result_.max_send_lag_ns.load(std::memory_order_relaxed);
+            while (lag > prev &&
+                   !result_.max_send_lag_ns.compare_exchange_weak(prev, lag, std::memory_order_relaxed)) {
+            }
+        }
+    }
+
+    // Извлекает числовой client_request_id из ответа, false если его нет
+    static bool parse_client_id(const char* data, size_t len, uint64_t& id) {
+        static const char key[] = "\"client_request_id\":";
+        const char* end = data + len;
+        const char* pos = std::search(data, end, key, key + sizeof(key) - 1);
+        if (pos == end) {
+            return false;
+        }
+        pos += sizeof(key) - 1;
+        while (pos < end && *pos == ' ') {
+            ++pos;
+        }
+        if (pos == end || *pos < '0' || *pos > '9') {
+            return false;
+        }
+        id = 0;
+        while (pos < end && *pos >= '0' && *pos <= '9') {
+            id = id * 10 + (*pos - '0');
+            ++pos;
         }
+        return true;
     }
-    
-    void receive_responses() {
-        char buffer[4096];
-        sockaddr_in sender_addr{};
-        socklen_t addr_len = sizeof(sender_addr);
-        
-        while (running_) {
-            ssize_t received = recvfrom(recv_sock_, buffer, sizeof(buffer), 0,
-                                       (struct sockaddr*)&sender_addr, &addr_len);
-            
-            if (received > 0) {
-                auto receive_time = std::chrono::steady_clock::now();
-                std::string response(buffer, received);
-                
-                result_.received_count++;
-                
-                // Пытаемся извлечь timestamp для вычисления времени ответа
-                size_t timestamp_pos = response.find("\"timestamp\":");
-                if (timestamp_pos != std::string::npos) {
-                    try {
-                        size_t start = timestamp_pos + 12; // длина "timestamp":
-                        size_t end = response.find_first_of(",}", start);
-                        if (end != std::string::npos) {
-                            std::string timestamp_str = response.substr(start, end - start);
-                            long long sent_time = std::stoll(timestamp_str);
-                            
-                            auto current_time = std::chrono::duration_cast<std::chrono::milliseconds>(
-                                receive_time.time_since_epoch()).count();
-                            
-                            double response_time = current_time - sent_time;
-                            if (response_time > 0) {
-                                std::lock_guard<std::mutex> lock(result_.result_mutex);
-                                result_.response_times.push_back(response_time);
-                            }
-                        }
-                    } catch (...) {
-                        // Игнорируем ошибки парсинга timestamp
-                    }
+
+    void receive_loop(int thread_index) {
+        int sock = socks_[thread_index];
+        char buffer[65536];
+
+        while (receiving_) {
+            ssize_t received = recv(sock, buffer, sizeof(buffer), 0);
+            if (received < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    result_.receive_errors++;
                 }
-                
-            } else if (errno != EAGAIN && errno != EWOULDBLOCK && running_) {
-                std::lock_guard<std::mutex> lock(result_.result_mutex);
-                result_.errors.push_back("Receive error: " + std::string(strerror(errno)));
+                continue;
+            }
+            int64_t receive_time = now_ns();
+
+            uint64_t k = 0;
+            if (!parse_client_id(buffer, received, k) || k >= total_requests_) {
+                result_.uncorrelated_count++;
+                continue;
+            }
+            int64_t actual = sent_at_[k].load(std::memory_order_acquire);
+            if (actual < 0) {
+                result_.uncorrelated_count++;
+                continue;
             }
+            if (answered_[k].exchange(1, std::memory_order_relaxed) != 0) {
+                result_.duplicate_count++;
+                continue;
+            }
+            result_.received_count++;
+
+            int64_t intended = static_cast<int64_t>(k) * interval_ns_;
+            if (intended < warmup_ns_) {
+                continue;
+            }
+            result_.response_time.record(static_cast<uint64_t>(std::max<int64_t>(receive_time - intended, 0)));
+            result_.service_time.record(static_cast<uint64_t>(std::max<int64_t>(receive_time - actual, 0)));
         }
     }
-    
-    void run_test() {
+
+    bool run_test() {
         if (!setup()) {
-            return;
+            return false;
         }
-        
-        std::cout << "\n🚀 Starting stress test..." << std::endl;
-        std::cout << "📊 Rate: " << rate_per_second_ << " req/sec" << std::endl;
-        std::cout << "⏱️ Duration: " << duration_seconds_ << "s" << std::endl;
-        std::cout << "🎯 Target: " << target_ip_ << ":" << target_port_ << std::endl;
+
+        std::cout << "\n🚀 Starting open-loop load test..." << std::endl;
+        std::cout << "📊 Rate: " << config_.rate << " req/sec" << std::endl;
+        std::cout << "⏱️ Duration: " << config_.duration << "s (warmup " << config_.warmup << "s)" << std::endl;
+        std::cout << "🧵 Sender threads: " << config_.threads << std::endl;
+        std::cout << "🎯 Target: " << config_.target_ip << ":" << config_.target_port
+                  << ", msc \"" << config_.target << "\"" << std::endl;
         std::cout << std::string(50, '=') << std::endl;
-        
-        // Запускаем поток получения ответов
-        std::thread receive_thread(&SimpleTester::receive_responses, this);
-        
-        // Отправка команд
-        auto start_time = std::chrono::steady_clock::now();
-        auto end_time = start_time + std::chrono::seconds(duration_seconds_);
-        
-        double interval = rate_per_second_ > 0 ? 1.0 / rate_per_second_ : 0;
-        int request_id = 1;
-        
-        while (std::chrono::steady_clock::now() < end_time && running_) {
-            send_command(request_id++);
-            
-            if (interval > 0) {
-                std::this_thread::sleep_for(std::chrono::duration<double>(interval));
-            }
-            
-            // Показываем прогресс каждую секунду
-            if (request_id % rate_per_second_ == 0) {
-                auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(
-                    std::chrono::steady_clock::now() - start_time).count();
-                std::cout << "⏳ " << elapsed << "s elapsed, sent: " << result_.sent_count.load() 
-                         << ", received: " << result_.received_count.load() << std::endl;
-            }
+
+        start_time_ = Clock::now() + std::chrono::milliseconds(50);
+
+        std::vector<std::thread> receivers;
+        std::vector<std::thread> senders;
+        for (int t = 0; t < config_.threads; ++t) {
+            receivers.emplace_back(&LoadTester::receive_loop, this, t);
+        }
+        for (int t = 0; t < config_.threads; ++t) {
+            senders.emplace_back(&LoadTester::send_loop, this, t);
+        }
+
+        // Прогресс раз в секунду, пока отправители работают
+        auto end_time = start_time_ + std::chrono::seconds(config_.duration);
+        for (int second = 1; Clock::now() < end_time; ++second) {
+            std::this_thread::sleep_until(std::min(start_time_ + std::chrono::seconds(second), end_time));
+            std::cout << "⏳ " << second << "s elapsed, sent: " << result_.sent_count.load()
+                      << ", received: " << result_.received_count.load() << std::endl;
+        }
+        for (auto& sender : senders) {
+            sender.join();
         }
-        
+
         // Ждем последние ответы
         std::cout << "⏳ Waiting for remaining responses..." << std::endl;
-        std::this_thread::sleep_for(std::chrono::seconds(2));
-        
-        running_ = false;
-        receive_thread.join();
-        
-        print_statistics();
+        auto drain_deadline = Clock::now() + std::chrono::milliseconds(config_.drain_ms);
+        while (Clock::now() < drain_deadline &&
+               result_.received_count.load() < result_.sent_count.load()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        receiving_ = false;
+        for (auto& receiver : receivers) {
+            receiver.join();
+        }
+
+        auto response_snap = result_.response_time.snapshot();
+        auto service_snap = result_.service_time.snapshot();
+        print_statistics(response_snap, service_snap);
+        if (!config_.report_path.empty()) {
+            return write_report(response_snap, service_snap);
+        }
+        return true;
+    }
+
+    static constexpr double kPercentiles[] = {
+        50.0, 75.0, 90.0, 95.0, 99.0, 99.9, 99.99, 99.999, 100.0};
+
+    static double to_ms(uint64_t ns) {
+        return ns / 1e6;
+    }
+
+    static void print_histogram(const char* title, const LatencyHistogram::Snapshot& snap) {
+        std::cout << "\n⏱️ " << title << " (" << snap.count << " samples):" << std::endl;
+        if (snap.count == 0) {
+            std::cout << "   no data" << std::endl;
+            return;
+        }
+        std::cout << std::fixed << std::setprecision(3);
+        std::cout << "   Mean:    " << to_ms(snap.sum / snap.count) << "ms" << std::endl;
+        for (double p : kPercentiles) {
+            char label[32];
+            std::snprintf(label, sizeof(label), "p%g", p);
+            std::cout << "   " << std::left << std::setw(9) << label << std::right
+                      << to_ms(p >= 100.0 ? snap.max : snap.quantile(p / 100.0)) << "ms" << std::endl;
+        }
+    }
+
+    // Полное распределение в духе HdrHistogram: значение, процентиль,
+    // накопленное число и 1/(1-P) для каждой непустой корзины
+    static void print_distribution(const LatencyHistogram::Snapshot& snap) {
+        if (snap.count == 0) {
+            return;
+        }
+        std::cout << "\n📈 Response time distribution:" << std::endl;
+        std::cout << "   " << std::setw(14) << "Value(ms)" << std::setw(14) << "Percentile"
+                  << std::setw(12) << "TotalCount" << std::setw(14) << "1/(1-P)" << std::endl;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < snap.buckets.size(); ++i) {
+            if (snap.buckets[i] == 0) {
+                continue;
+            }
+            seen += snap.buckets[i];
+            double fraction = (double)seen / snap.count;
+            uint64_t value = std::min(LatencyHistogram::bucket_mid(i), snap.max);
+            std::cout << "   " << std::fixed << std::setw(14) << std::setprecision(3) << to_ms(value)
+                      << std::setw(14) << std::setprecision(6) << fraction
+                      << std::setw(12) << seen;
+            if (seen < snap.count) {
+                std::cout << std::setw(14) << std::setprecision(2) << 1.0 / (1.0 - fraction);
+            }
+            std::cout << std::endl;
+        }
     }
-    
-    void print_statistics() {
+
+    void print_statistics(const LatencyHistogram::Snapshot& response_snap,
+                          const LatencyHistogram::Snapshot& service_snap) {
+        uint64_t sent = result_.sent_count.load();
+        uint64_t received = result_.received_count.load();
+
         std::cout << "\n" << std::string(50, '=') << std::endl;
-        std::cout << "📊 STRESS TEST RESULTS" << std::endl;
+        std::cout << "📊 LOAD TEST RESULTS" << std::endl;
         std::cout << std::string(50, '=') << std::endl;
-        std::cout << "📤 Sent commands: " << result_.sent_count.load() << std::endl;
-        std::cout << "📥 Received responses: " << result_.received_count.load() << std::endl;
-        std::cout << "📈 Success rate: " << std::fixed << std::setprecision(2) 
+        std::cout << "📤 Sent commands: " << sent << " of " << total_requests_ << std::endl;
+        std::cout << "📥 Received responses: " << received << std::endl;
+        std::cout << "📉 Lost: " << (sent > received ? sent - received : 0) << std::endl;
+        std::cout << "📈 Success rate: " << std::fixed << std::setprecision(2)
                   << result_.success_rate() << "%" << std::endl;
-        std::cout << "❌ Errors: " << result_.errors.size() << std::endl;
-        
-        // Статистика по времени ответа
-        std::lock_guard<std::mutex> lock(result_.result_mutex);
-        if (!result_.response_times.empty()) {
-            auto times = result_.response_times;
-            std::sort(times.begin(), times.end());
-            
-            double avg = std::accumulate(times.begin(), times.end(), 0.0) / times.size();
-            double min_time = *std::min_element(times.begin(), times.end());
-            double max_time = *std::max_element(times.begin(), times.end());
-            double p95 = times[static_cast<size_t>(times.size() * 0.95)];
-            
-            std::cout << "\n⏱️ Response Time Statistics:" << std::endl;
-            std::cout << "   Average: " << std::fixed << std::setprecision(2) << avg << "ms" << std::endl;
-            std::cout << "   Minimum: " << min_time << "ms" << std::endl;
-            std::cout << "   Maximum: " << max_time << "ms" << std::endl;
-            std::cout << "   95th percentile: " << p95 << "ms" << std::endl;
+        std::cout << "🔁 Duplicates: " << result_.duplicate_count.load()
+                  << ", uncorrelated: " << result_.uncorrelated_count.load() << std::endl;
+        std::cout << "❌ Errors: send " << result_.send_errors.load()
+                  << ", receive " << result_.receive_errors.load() << std::endl;
+        std::cout << "🐢 Max send lag: " << std::setprecision(3)
+                  << to_ms(result_.max_send_lag_ns.load()) << "ms" << std::endl;
+
+        print_histogram("Response time (from intended send)", response_snap);
+        print_histogram("Service time (from actual send)", service_snap);
+        print_distribution(response_snap);
+
+        std::cout << std::string(50, '=') << std::endl;
+    }
+
+    static void write_snapshot_json(std::ostream& out, const LatencyHistogram::Snapshot& snap) {
+        out << "{\"count\":" << snap.count
+            << ",\"mean_ns\":" << (snap.count ? snap.sum / snap.count : 0)
+            << ",\"max_ns\":" << snap.max
+            << ",\"percentiles_ns\":{";
+        bool first = true;
+        for (double p : kPercentiles) {
+            char key[32];
+            std::snprintf(key, sizeof(key), "%g", p);
+            out << (first ? "" : ",") << "\"" << key << "\":"
+                << (p >= 100.0 ? snap.max : snap.quantile(p / 100.0));
+            first = false;
         }
-        
-        // Показываем первые ошибки
-        if (!result_.errors.empty()) {
-            std::cout << "\n❌ First 5 errors:" << std::endl;
-            for (size_t i = 0; i < std::min(result_.errors.size(), size_t(5)); ++i) {
-                std::cout << "   - " << result_.errors[i] << std::endl;
+        out << "},\"distribution\":[";
+        uint64_t seen = 0;
+        first = true;
+        for (size_t i = 0; i < snap.buckets.size(); ++i) {
+            if (snap.buckets[i] == 0) {
+                continue;
             }
+            seen += snap.buckets[i];
+            out << (first ? "" : ",") << "{\"value_ns\":"
+                << std::min(LatencyHistogram::bucket_mid(i), snap.max)
+                << ",\"count\":" << snap.buckets[i]
+                << ",\"total\":" << seen << "}";
+            first = false;
         }
-        
-        std::cout << std::string(50, '=') << std::endl;
+        out << "]}";
+    }
+
+    // Машиночитаемый отчет для сравнения прогонов и планирования мощности
+    bool write_report(const LatencyHistogram::Snapshot& response_snap,
+                      const LatencyHistogram::Snapshot& service_snap) {
+        std::ofstream out(config_.report_path);
+        if (!out) {
+            std::cerr << "❌ Failed to open report " << config_.report_path << std::endl;
+            return false;
+        }
+        uint64_t sent = result_.sent_count.load();
+        uint64_t received = result_.received_count.load();
+        out << "{\"config\":{"
+            << "\"target_ip\":\"" << config_.target_ip << "\""
+            << ",\"target_port\":" << config_.target_port
+            << ",\"target\":\"" << config_.target << "\""
+            << ",\"rate\":" << config_.rate
+            << ",\"duration_s\":" << config_.duration
+            << ",\"warmup_s\":" << config_.warmup
+            << ",\"threads\":" << config_.threads
+            << "},\"requests\":{"
+            << "\"scheduled\":" << total_requests_
+            << ",\"sent\":" << sent
+            << ",\"received\":" << received
+            << ",\"lost\":" << (sent > received ? sent - received : 0)
+            << ",\"duplicates\":" << result_.duplicate_count.load()
+            << ",\"uncorrelated\":" << result_.uncorrelated_count.load()
+            << ",\"send_errors\":" << result_.send_errors.load()
+            << ",\"receive_errors\":" << result_.receive_errors.load()
+            << "},\"max_send_lag_ns\":" << result_.max_send_lag_ns.load()
+            << ",\"response_time\":";
+        write_snapshot_json(out, response_snap);
+        out << ",\"service_time\":";
+        write_snapshot_json(out, service_snap);
+        out << "}\n";
+        out.close();
+        if (!out) {
+            std::cerr << "❌ Failed to write report " << config_.report_path << std::endl;
+            return false;
+        }
+        std::cout << "📝 Report written to " << config_.report_path << std::endl;
+        return true;
     }
 };
 
@@ -269,58 +460,74 @@ void print_usage(const char* program_name) {
     std::cout << "Options:" << std::endl;
     std::cout << "  --target-ip <ip>       Target IP address (default: 127.0.0.1)" << std::endl;
     std::cout << "  --target-port <port>   Target port (default: 11000)" << std::endl;
-    std::cout << "  --response-port <port> Response port (default: 11001)" << std::endl;
-    std::cout << "  --rate <req/sec>       Requests per second (default: 10)" << std::endl;
+    std::cout << "  --target <ids>         MSC target field of commands (default: 1)" << std::endl;
+    std::cout << "  --rate <req/sec>       Requests per second, all threads (default: 10)" << std::endl;
     std::cout << "  --duration <seconds>   Test duration in seconds (default: 5)" << std::endl;
+    std::cout << "  --threads <n>          Sender threads (default: 1)" << std::endl;
+    std::cout << "  --warmup <seconds>     Exclude first seconds from latency (default: 0)" << std::endl;
+    std::cout << "  --drain-ms <ms>        Wait for late responses (default: 2000)" << std::endl;
+    std::cout << "  --report <file.json>   Write JSON report" << std::endl;
     std::cout << "  --help                 Show this help" << std::endl;
     std::cout << "\nExamples:" << std::endl;
     std::cout << "  " << program_name << " --rate 100 --duration 10" << std::endl;
-    std::cout << "  " << program_name << " --target-ip 192.168.1.100 --rate 50" << std::endl;
+    std::cout << "  " << program_name << " --rate 200000 --threads 4 --warmup 2 --report run.json" << std::endl;
 }
 
 int main(int argc, char* argv[]) {
-    std::string target_ip = "127.0.0.1";
-    int target_port = 11000;
-    int response_port = 11001;
-    int rate = 10;
-    int duration = 5;
-    
+    TestConfig config;
+
     // Парсим аргументы командной строки
     for (int i = 1; i < argc; i += 2) {
         if (i + 1 >= argc && std::string(argv[i]) != "--help") {
             std::cerr << "❌ Missing value for " << argv[i] << std::endl;
             return 1;
         }
-        
+
         std::string arg = argv[i];
-        
+
         if (arg == "--help") {
             print_usage(argv[0]);
             return 0;
         } else if (arg == "--target-ip") {
-            target_ip = argv[i + 1];
+            config.target_ip = argv[i + 1];
         } else if (arg == "--target-port") {
-            target_port = std::stoi(argv[i + 1]);
-        } else if (arg == "--response-port") {
-            response_port = std::stoi(argv[i + 1]);
+            config.target_port = std::stoi(argv[i + 1]);
+        } else if (arg == "--target") {
+            config.target = argv[i + 1];
         } else if (arg == "--rate") {
-            rate = std::stoi(argv[i + 1]);
+            config.rate = std::stoi(argv[i + 1]);
         } else if (arg == "--duration") {
-            duration = std::stoi(argv[i + 1]);
+            config.duration = std::stoi(argv[i + 1]);
+        } else if (arg == "--threads") {
+            config.threads = std::stoi(argv[i + 1]);
+        } else if (arg == "--warmup") {
+            config.warmup = std::stoi(argv[i + 1]);
+        } else if (arg == "--drain-ms") {
+            config.drain_ms = std::stoi(argv[i + 1]);
+        } else if (arg == "--report") {
+            config.report_path = argv[i + 1];
         } else {
             std::cerr << "❌ Unknown option: " << arg << std::endl;
             print_usage(argv[0]);
             return 1;
         }
     }
-    
+
+    if (config.rate <= 0 || config.duration <= 0 || config.threads <= 0 ||
+        config.warmup < 0 || config.warmup >= config.duration) {
+        std::cerr << "❌ rate, duration and threads must be positive, warmup shorter than duration" << std::endl;
+        return 1;
+    }
+
     try {
-        SimpleTester tester(target_ip, target_port, response_port, rate, duration);
-        tester.run_test();
+        LoadTester tester(config);
+        if (!tester.run_test()) {
+            return 1;
+        }
     } catch (const std::exception& e) {
         std::cerr << "❌ Error: " << e.what() << std::endl;
         return 1;
     }
-    
+
     return 0;
 }